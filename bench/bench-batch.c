@@ -0,0 +1,265 @@
+/*
+ * bench-batch
+ * -----------
+ * 
+ * Compares resolving many uids (or, with -n, names) with one call of the
+ * batch functions of nss-confd-batch.h to a loop of getpwuid_r() (getpwnam_r())
+ * calls, like a tool that lists the owners of many files. The users are
+ * expected to be named "user<n>" with uid 10000 + n like the ones in a
+ * dataset of "bench-stages -g <dir>" that NSS_CONFD_PASSWD_DIR points to.
+ * Without NSS_CONFD_PASSWD_DIR, the benchmark writes such a dataset with the
+ * given number of users into a temporary directory and removes it afterwards.
+ * The keys repeat like the owners of files do.
+ * 
+ * The module is loaded directly. With -l, the loop calls getpwuid_r() of
+ * glibc instead, which goes through /etc/nsswitch.conf.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <nss.h>
+#include <pwd.h>
+#include <errno.h>
+
+#include "../nss-confd-batch.h"
+#include "bench-common.h"
+
+typedef enum nss_status (*getpwnam_r_t)(const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*getpwuid_r_t)(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+typedef int (*uids_to_names_t)(const uid_t *uids, size_t n, char ***names);
+typedef int (*names_to_uids_t)(const char *const *names, size_t n, uid_t *uids);
+
+static getpwnam_r_t getpwnam_r_fn;
+static getpwuid_r_t getpwuid_r_fn;
+static int use_libc;
+
+// resolves every uid on its own and counts the names that differ from $expected
+static unsigned long loop_uids(uid_t *uids, size_t n, char **expected) {
+	struct passwd pw, *res;
+	char buffer[4096];
+	unsigned long mismatches;
+	int err, found;
+	size_t i;
+	
+	mismatches = 0;
+	for (i=0; i < n; i++) {
+		if (use_libc)
+			found = getpwuid_r(uids[i], &pw, buffer, sizeof(buffer), &res) == 0 && res;
+		else
+			found = getpwuid_r_fn(uids[i], &pw, buffer, sizeof(buffer), &err) == NSS_STATUS_SUCCESS;
+		
+		if (expected && (found != (expected[i] != 0) || (found && strcmp(pw.pw_name, expected[i]))))
+			mismatches += 1;
+	}
+	
+	return mismatches;
+}
+
+static unsigned long loop_names(char **names, size_t n, uid_t *expected) {
+	struct passwd pw, *res;
+	char buffer[4096];
+	unsigned long mismatches;
+	int err, found;
+	size_t i;
+	
+	mismatches = 0;
+	for (i=0; i < n; i++) {
+		if (use_libc)
+			found = getpwnam_r(names[i], &pw, buffer, sizeof(buffer), &res) == 0 && res;
+		else
+			found = getpwnam_r_fn(names[i], &pw, buffer, sizeof(buffer), &err) == NSS_STATUS_SUCCESS;
+		
+		if (expected && (found != (expected[i] != (uid_t) NSS_CONFD_NO_ID) || (found && pw.pw_uid != expected[i])))
+			mismatches += 1;
+	}
+	
+	return mismatches;
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options] <libnss_confd.so.2> <number of users> <number of keys>\n", argv0);
+	printf("\n");
+	printf("Resolves random uids of the users and a few unknown ones with one batch call\n");
+	printf("and with a loop of getpwuid_r() calls.\n");
+	printf("\n");
+	printf("The users are \"user<n>\" with uid 10000 + n in NSS_CONFD_PASSWD_DIR, e.g., the\n");
+	printf("passwd.d of \"bench-stages -g <dir>\". If NSS_CONFD_PASSWD_DIR is not set, a\n");
+	printf("temporary dataset with <number of users> users is created.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n      resolve names instead of uids\n");
+	printf("  -l      call getpwuid_r() or getpwnam_r() of glibc in the loop\n");
+	printf("  -r <n>  repeat both <n> times and report the best run (default: 5)\n");
+}
+
+int main(int argc, char **argv) {
+	uids_to_names_t uids_to_names_fn;
+	names_to_uids_t names_to_uids_fn;
+	uint64_t start, best_loop, best_batch, t;
+	unsigned long n_users, count, n_runs, i, n, hits, mismatches;
+	char **names, **result_names, *pool;
+	struct dataset ds = { DATASET_PASSWD, 0, 0, 0, 0 };
+	char root[] = "/tmp/bench-batch.XXXXXX", dirpath[4096];
+	uid_t *uids, *result_uids;
+	int by_name, generated, c, r;
+	void *handle;
+	
+	by_name = 0;
+	n_runs = 5;
+	while ((c = getopt(argc, argv, "hnlr:")) != -1) {
+		switch (c) {
+			case 'n': by_name = 1; break;
+			case 'l': use_libc = 1; break;
+			case 'r': n_runs = strtoul(optarg, 0, 0); break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (argc - optind != 3 || n_runs == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	n_users = strtoul(argv[optind + 1], 0, 0);
+	count = strtoul(argv[optind + 2], 0, 0);
+	if (n_users == 0 || count == 0) {
+		fprintf(stderr, "invalid number of users or keys\n");
+		return 1;
+	}
+	
+	// without a dataset, write one with up to 100 files and load it in this process, neither from an index nor from the daemon
+	generated = !getenv("NSS_CONFD_PASSWD_DIR");
+	if (generated) {
+		if (!mkdtemp(root)) {
+			fprintf(stderr, "cannot create a temporary directory: %s\n", strerror(errno));
+			return 1;
+		}
+		
+		ds.n_per_file = (n_users + 99) / 100;
+		ds.n_files = (n_users + ds.n_per_file - 1) / ds.n_per_file;
+		n_users = ds.n_files * ds.n_per_file;
+		
+		r = create_dataset(root, &ds);
+		if (r) {
+			fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+			remove_dataset(root);
+			return 1;
+		}
+		
+		snprintf(dirpath, sizeof(dirpath), "%s/passwd.d", root);
+		setenv("NSS_CONFD_PASSWD_DIR", dirpath, 1);
+		setenv("NSS_CONFD_PASSWD_INDEX", "", 1);
+		setenv("NSS_CONFD_SOCKET", "", 1);
+		unsetenv("NSS_CONFD_SHM");
+	}
+	
+	handle = dlopen(argv[optind], RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "cannot load \"%s\": %s\n", argv[optind], dlerror());
+		if (generated)
+			remove_dataset(root);
+		return 1;
+	}
+	
+	getpwnam_r_fn = (getpwnam_r_t) dlsym(handle, "_nss_confd_getpwnam_r");
+	getpwuid_r_fn = (getpwuid_r_t) dlsym(handle, "_nss_confd_getpwuid_r");
+	uids_to_names_fn = (uids_to_names_t) dlsym(handle, "_nss_confd_uids_to_names");
+	names_to_uids_fn = (names_to_uids_t) dlsym(handle, "_nss_confd_names_to_uids");
+	if (!getpwnam_r_fn || !getpwuid_r_fn || !uids_to_names_fn || !names_to_uids_fn) {
+		fprintf(stderr, "cannot find the lookup functions: %s\n", dlerror());
+		if (generated)
+			remove_dataset(root);
+		return 1;
+	}
+	
+	uids = (uid_t *) malloc(sizeof(uid_t) * count);
+	result_uids = (uid_t *) malloc(sizeof(uid_t) * count);
+	names = (char **) malloc(sizeof(char *) * count);
+	pool = (char *) malloc(32 * count);
+	if (!uids || !result_uids || !names || !pool) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	
+	// every 64th key is unknown
+	srandom(1);
+	for (i=0; i < count; i++) {
+		n = random() % n_users;
+		if (random() % 64 == 0)
+			n += n_users;
+		
+		uids[i] = 10000 + n;
+		names[i] = pool + 32 * i;
+		snprintf(names[i], 32, "user%lu", n);
+	}
+	
+	// the first lookups load the database
+	if (by_name)
+		loop_names(names, 1, 0);
+	else
+		loop_uids(uids, 1, 0);
+	
+	best_loop = best_batch = 0;
+	result_names = 0;
+	for (i=0; i < n_runs; i++) {
+		start = now_ns();
+		if (by_name)
+			loop_names(names, count, 0);
+		else
+			loop_uids(uids, count, 0);
+		t = now_ns() - start;
+		if (i == 0 || t < best_loop)
+			best_loop = t;
+		
+		free(result_names);
+		result_names = 0;
+		
+		start = now_ns();
+		if (by_name)
+			r = names_to_uids_fn((const char *const *) names, count, result_uids);
+		else
+			r = uids_to_names_fn(uids, count, &result_names);
+		t = now_ns() - start;
+		if (i == 0 || t < best_batch)
+			best_batch = t;
+		
+		if (r) {
+			fprintf(stderr, "batch lookup failed: %s\n", strerror(-r));
+			if (r == -ENOENT)
+				fprintf(stderr, "NSS_CONFD_PASSWD_DIR=%s has to be the passwd.d of a dataset of \"bench-stages -g <dir>\"\n",
+					getenv("NSS_CONFD_PASSWD_DIR"));
+			if (generated)
+				remove_dataset(root);
+			return 1;
+		}
+	}
+	
+	// both have to return the same users
+	hits = 0;
+	for (i=0; i < count; i++)
+		hits += by_name ? result_uids[i] != (uid_t) NSS_CONFD_NO_ID : result_names[i] != 0;
+	mismatches = by_name ? loop_names(names, count, result_uids) : loop_uids(uids, count, result_names);
+	
+	printf("%lu keys by %s, %lu hits, %lu mismatches\n", count, by_name ? "name" : "uid", hits, mismatches);
+	printf("loop of %s: %.1f ns/key\n", by_name ? "getpwnam_r()" : "getpwuid_r()", (double) best_loop / count);
+	printf("batch: %.1f ns/key\n", (double) best_batch / count);
+	printf("speedup: %.2fx\n", (double) best_loop / best_batch);
+	
+	free(result_names);
+	free(uids);
+	free(result_uids);
+	free(names);
+	free(pool);
+	
+	if (generated)
+		remove_dataset(root);
+	
+	return mismatches != 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * bench-common
+ * ------------
+ * 
+ * Helpers that the benchmarks share, see bench-common.h.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "bench-common.h"
+
+#define N_MEMBERSHIP_FILES 10
+
+static const char *names[] = { "passwd", "group", "shadow" };
+#define N_NAMES (sizeof(names) / sizeof(names[0]))
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int cmp_u64(const void *a, const void *b) {
+	uint64_t ua = *(const uint64_t *) a;
+	uint64_t ub = *(const uint64_t *) b;
+	
+	return (ua > ub) - (ua < ub);
+}
+
+static int write_file(const char *path, FILE **f) {
+	*f = fopen(path, "w");
+	if (!*f)
+		return -errno;
+	
+	return 0;
+}
+
+/*
+ * Writes the databases in $ds->databases with $ds->n_files files of
+ * $ds->n_per_file entries each into $root, which is created if it does not
+ * exist. Every group lists $ds->n_members random users and, if $ds->n_lines is
+ * set, the .membership files in group.d contain that many lines with three
+ * users each.
+ */
+int create_dataset(const char *root, struct dataset *ds) {
+	FILE *dir_f, *flat_f;
+	char path[4096], line[4096];
+	unsigned long i, j, k, n, n_entries;
+	size_t db, pos;
+	int r;
+	
+	n_entries = ds->n_files * ds->n_per_file;
+	
+	srandom(1);
+	
+	if (mkdir(root, 0755) && errno != EEXIST)
+		return -errno;
+	
+	for (db=0; db < N_NAMES; db++) {
+		if (!(ds->databases & (1 << db)))
+			continue;
+		
+		snprintf(path, sizeof(path), "%s/%s.d", root, names[db]);
+		if (mkdir(path, 0755) && errno != EEXIST)
+			return -errno;
+		
+		flat_f = 0;
+		if (ds->databases & DATASET_FLAT) {
+			snprintf(path, sizeof(path), "%s/%s", root, names[db]);
+			r = write_file(path, &flat_f);
+			if (r)
+				return r;
+		}
+		
+		for (i=0; i < ds->n_files; i++) {
+			snprintf(path, sizeof(path), "%s/%s.d/%s%04lu", root, names[db], names[db], i);
+			r = write_file(path, &dir_f);
+			if (r) {
+				if (flat_f)
+					fclose(flat_f);
+				return r;
+			}
+			
+			for (j=0; j < ds->n_per_file; j++) {
+				n = i * ds->n_per_file + j;
+				
+				if (db == 0) {
+					snprintf(line, sizeof(line), "user%lu:x:%lu:%lu:User %lu:/home/user%lu:/bin/sh\n",
+						n, 10000 + n, 10000 + n, n, n);
+				} else if (db == 1) {
+					pos = snprintf(line, sizeof(line), "group%lu:x:%lu:", n, 10000 + n);
+					for (k=0; k < ds->n_members && pos < sizeof(line) - 32; k++)
+						pos += snprintf(line + pos, sizeof(line) - pos, "%suser%lu", k ? "," : "", random() % n_entries);
+					snprintf(line + pos, sizeof(line) - pos, "\n");
+				} else {
+					snprintf(line, sizeof(line), "user%lu:$6$bench$%016lx:19000:0:99999:7:::\n", n, (unsigned long) random());
+				}
+				
+				fputs(line, dir_f);
+				if (flat_f)
+					fputs(line, flat_f);
+			}
+			
+			fclose(dir_f);
+		}
+		
+		if (flat_f)
+			fclose(flat_f);
+	}
+	
+	for (i=0; i < N_MEMBERSHIP_FILES && ds->n_lines > 0 && (ds->databases & DATASET_GROUP); i++) {
+		snprintf(path, sizeof(path), "%s/group.d/users%02lu.membership", root, i);
+		r = write_file(path, &dir_f);
+		if (r)
+			return r;
+		
+		for (j=i; j < ds->n_lines; j += N_MEMBERSHIP_FILES) {
+			fprintf(dir_f, "group%lu:user%lu,user%lu,user%lu\n", random() % n_entries,
+				random() % n_entries, random() % n_entries, random() % n_entries);
+		}
+		
+		fclose(dir_f);
+	}
+	
+	return 0;
+}
+
+// removes the files in $dirpath and the directory itself
+void remove_dir(const char *dirpath) {
+	struct dirent *dent;
+	char path[4096];
+	DIR *dir;
+	
+	dir = opendir(dirpath);
+	if (dir) {
+		while ((dent = readdir(dir))) {
+			if (dent->d_name[0] == '.')
+				continue;
+			
+			if (snprintf(path, sizeof(path), "%s/%s", dirpath, dent->d_name) < (int) sizeof(path))
+				unlink(path);
+		}
+		closedir(dir);
+	}
+	
+	rmdir(dirpath);
+}
+
+// removes the dataset in $root and $root itself with the indexes and other files in it
+void remove_dataset(const char *root) {
+	char path[4096];
+	size_t db;
+	
+	for (db=0; db < N_NAMES; db++) {
+		snprintf(path, sizeof(path), "%s/%s.d", root, names[db]);
+		remove_dir(path);
+	}
+	
+	remove_dir(root);
+}
@@ -0,0 +1,43 @@
+/*
+ * bench-common
+ * ------------
+ * 
+ * Helpers that the benchmarks share: the clock, sorting latencies and the
+ * generated dataset that "bench-stages -g <dir>" writes as well. The dataset
+ * consists of the users "user<n>" with uid 10000 + n, the groups "group<n>"
+ * with gid 10000 + n and the shadow entries of the users, spread over files
+ * in passwd.d, group.d and shadow.d.
+ * 
+ */
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <stdint.h>
+
+#define DATASET_PASSWD (1 << 0)
+#define DATASET_GROUP (1 << 1)
+#define DATASET_SHADOW (1 << 2)
+// the flat files passwd, group and shadow with the same entries next to the directories
+#define DATASET_FLAT (1 << 3)
+#define DATASET_ALL (DATASET_PASSWD | DATASET_GROUP | DATASET_SHADOW | DATASET_FLAT)
+
+struct dataset {
+	unsigned int databases;
+	unsigned long n_files;
+	unsigned long n_per_file;
+	
+	// random users that every group lists
+	unsigned long n_members;
+	// lines with three random users in the .membership files of group.d
+	unsigned long n_lines;
+};
+
+extern uint64_t now_ns(void);
+extern int cmp_u64(const void *a, const void *b);
+
+extern int create_dataset(const char *root, struct dataset *ds);
+extern void remove_dir(const char *dirpath);
+extern void remove_dataset(const char *root);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * bench-load
+ * ----------
+ * 
+ * Measures what a loaded passwd database costs a process: the time of the
+ * first lookup, which loads the database, and the number of open file
+ * descriptors, the number of mappings and the resident memory that the
+ * process gains by it. The benchmark creates a temporary passwd.d directory
+ * with the given number of files with one user each, like the dataset of
+ * bench-stages, and removes it afterwards.
+ * 
+ * NSS_CONFD_MMAP_MIN is passed to the module, hence the effect of reading the
+ * files into an arena can be compared with mapping every file by running the
+ * benchmark with NSS_CONFD_MMAP_MIN=0.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <nss.h>
+#include <pwd.h>
+
+#include "bench-common.h"
+
+typedef enum nss_status (*getpwnam_r_t)(const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+
+struct usage {
+	unsigned long n_fds;
+	unsigned long n_maps;
+	unsigned long rss_kb;
+};
+
+static void get_usage(struct usage *usage) {
+	struct dirent *dent;
+	char line[4096];
+	DIR *dir;
+	FILE *f;
+	
+	memset(usage, 0, sizeof(struct usage));
+	
+	dir = opendir("/proc/self/fd");
+	if (dir) {
+		while ((dent = readdir(dir)))
+			if (dent->d_name[0] != '.')
+				usage->n_fds += 1;
+		closedir(dir);
+		
+		// the descriptor of the directory itself
+		usage->n_fds -= 1;
+	}
+	
+	f = fopen("/proc/self/maps", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			usage->n_maps += 1;
+		fclose(f);
+	}
+	
+	f = fopen("/proc/self/status", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (!strncmp(line, "VmRSS:", 6))
+				usage->rss_kb = strtoul(line + 6, 0, 10);
+		fclose(f);
+	}
+}
+
+int main(int argc, char **argv) {
+	getpwnam_r_t getpwnam_r_fn;
+	struct passwd pw;
+	struct usage before, after;
+	enum nss_status status;
+	struct dataset ds = { DATASET_PASSWD, 0, 1, 0, 0 };
+	char root[] = "/tmp/bench-load.XXXXXX";
+	char dirpath[4096], buffer[4096], name[64];
+	unsigned long n_files;
+	uint64_t start;
+	int err, r;
+	void *handle;
+	
+	if (argc < 2 || argc > 3 || !strcmp(argv[1], "-h")) {
+		printf("Usage: %s <libnss_confd.so.2> [<number of files>]\n", argv[0]);
+		printf("\n");
+		printf("Defaults to 5000 files.\n");
+		return argc < 2 ? 1 : 0;
+	}
+	
+	n_files = argc > 2 ? strtoul(argv[2], 0, 0) : 5000;
+	if (n_files == 0) {
+		fprintf(stderr, "invalid number of files\n");
+		return 1;
+	}
+	
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "cannot create a temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	ds.n_files = n_files;
+	r = create_dataset(root, &ds);
+	if (r) {
+		fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+		remove_dataset(root);
+		return 1;
+	}
+	
+	// load the files in this process, neither from an index nor from the daemon
+	snprintf(dirpath, sizeof(dirpath), "%s/passwd.d", root);
+	setenv("NSS_CONFD_PASSWD_DIR", dirpath, 1);
+	setenv("NSS_CONFD_PASSWD_INDEX", "", 1);
+	setenv("NSS_CONFD_SOCKET", "", 1);
+	unsetenv("NSS_CONFD_SHM");
+	
+	handle = dlopen(argv[1], RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "cannot load \"%s\": %s\n", argv[1], dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	getpwnam_r_fn = (getpwnam_r_t) dlsym(handle, "_nss_confd_getpwnam_r");
+	if (!getpwnam_r_fn) {
+		fprintf(stderr, "cannot find the lookup functions: %s\n", dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	snprintf(name, sizeof(name), "user%lu", n_files / 2);
+	
+	get_usage(&before);
+	
+	start = now_ns();
+	status = getpwnam_r_fn(name, &pw, buffer, sizeof(buffer), &err);
+	start = now_ns() - start;
+	
+	get_usage(&after);
+	
+	printf("%lu files, NSS_CONFD_MMAP_MIN=%s\n", n_files, getenv("NSS_CONFD_MMAP_MIN") ? getenv("NSS_CONFD_MMAP_MIN") : "(default)");
+	printf("first lookup: %s, %.1f ms\n", status == NSS_STATUS_SUCCESS ? "found" : "not found", start / 1e6);
+	printf("file descriptors: %lu -> %lu\n", before.n_fds, after.n_fds);
+	printf("mappings: %lu -> %lu\n", before.n_maps, after.n_maps);
+	printf("resident memory: %lu kB -> %lu kB\n", before.rss_kb, after.rss_kb);
+	
+	remove_dataset(root);
+	
+	return status == NSS_STATUS_SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+/*
+ * bench-lookup
+ * ------------
+ * 
+ * Measures the throughput and latency of getpwnam_r() and getpwuid_r() lookups
+ * of the nss-confd module. The users are expected to be named "user<n>" with
+ * uid 10000 + n like the ones in a dataset of "bench-stages -g <dir>" that
+ * NSS_CONFD_PASSWD_DIR points to.
+ * 
+ * The module is loaded directly, hence the result does not depend on
+ * /etc/nsswitch.conf. To compare the lookups through nss-confd-cached with
+ * in-process lookups, run the benchmark with NSS_CONFD_SOCKET set to the
+ * socket of the daemon and with an empty NSS_CONFD_SOCKET.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <nss.h>
+#include <pwd.h>
+
+#include "bench-common.h"
+
+typedef enum nss_status (*getpwnam_r_t)(const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*getpwuid_r_t)(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+
+int main(int argc, char **argv) {
+	getpwnam_r_t getpwnam_r_fn;
+	getpwuid_r_t getpwuid_r_fn;
+	struct passwd pw;
+	enum nss_status status;
+	char buffer[4096], name[64];
+	uint64_t *latencies, start, total, first;
+	unsigned long n_users, count, i, hits, n;
+	int by_uid, err, c;
+	void *handle;
+	
+	by_uid = 0;
+	while ((c = getopt(argc, argv, "hu")) != -1) {
+		switch (c) {
+			case 'u':
+				by_uid = 1;
+				break;
+			default:
+				printf("Usage: %s [-u] <libnss_confd.so.2> <number of users> <number of lookups>\n", argv[0]);
+				printf("\n");
+				printf("Looks up random users by name or, with -u, by uid.\n");
+				printf("\n");
+				printf("The users are \"user<n>\" with uid 10000 + n in NSS_CONFD_PASSWD_DIR, e.g., the\n");
+				printf("passwd.d of \"bench-stages -g <dir>\".\n");
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (argc - optind != 3) {
+		fprintf(stderr, "Usage: %s [-u] <libnss_confd.so.2> <number of users> <number of lookups>\n", argv[0]);
+		return 1;
+	}
+	
+	handle = dlopen(argv[optind], RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "cannot load \"%s\": %s\n", argv[optind], dlerror());
+		return 1;
+	}
+	
+	getpwnam_r_fn = (getpwnam_r_t) dlsym(handle, "_nss_confd_getpwnam_r");
+	getpwuid_r_fn = (getpwuid_r_t) dlsym(handle, "_nss_confd_getpwuid_r");
+	if (!getpwnam_r_fn || !getpwuid_r_fn) {
+		fprintf(stderr, "cannot find the lookup functions: %s\n", dlerror());
+		return 1;
+	}
+	
+	n_users = strtoul(argv[optind + 1], 0, 0);
+	count = strtoul(argv[optind + 2], 0, 0);
+	if (n_users == 0 || count == 0) {
+		fprintf(stderr, "invalid number of users or lookups\n");
+		return 1;
+	}
+	
+	latencies = (uint64_t *) malloc(sizeof(uint64_t) * count);
+	if (!latencies) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	
+	srandom(1);
+	hits = 0;
+	total = now_ns();
+	for (i=0; i < count; i++) {
+		n = random() % n_users;
+		
+		start = now_ns();
+		if (by_uid) {
+			status = getpwuid_r_fn(10000 + n, &pw, buffer, sizeof(buffer), &err);
+		} else {
+			snprintf(name, sizeof(name), "user%lu", n);
+			status = getpwnam_r_fn(name, &pw, buffer, sizeof(buffer), &err);
+		}
+		latencies[i] = now_ns() - start;
+		
+		if (status == NSS_STATUS_SUCCESS)
+			hits += 1;
+	}
+	total = now_ns() - total;
+	
+	// the first lookup also loads the database
+	first = latencies[0];
+	qsort(latencies, count, sizeof(uint64_t), cmp_u64);
+	
+	printf("%lu lookups by %s, %lu hits\n", count, by_uid ? "uid" : "name", hits);
+	printf("throughput: %.0f lookups/s\n", count / (total / 1e9));
+	printf("latency: first %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		first / 1e3, latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3, latencies[count - 1] / 1e3);
+	
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * bench-members
+ * -------------
+ * 
+ * Measures getgrnam_r() lookups and a full getgrent_r() enumeration of the
+ * nss-confd module with split members, i.e. the module has to be built with
+ * WITH_SPLIT_MEMBERS=1. The benchmark creates a temporary group.d directory
+ * with the given number of groups, each listing one user, and of lines in
+ * .membership files like the dataset of bench-stages and removes it
+ * afterwards.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <nss.h>
+#include <grp.h>
+
+#include "bench-common.h"
+
+#define N_FILES 100
+
+typedef enum nss_status (*getgrnam_r_t)(const char *name, struct group *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*setgrent_t)(void);
+typedef enum nss_status (*getgrent_r_t)(struct group *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*endgrent_t)(void);
+
+int main(int argc, char **argv) {
+	getgrnam_r_t getgrnam_r_fn;
+	setgrent_t setgrent_fn;
+	getgrent_r_t getgrent_r_fn;
+	endgrent_t endgrent_fn;
+	struct group gr;
+	enum nss_status status;
+	struct dataset ds;
+	char root[] = "/tmp/bench-members.XXXXXX";
+	char dirpath[4096], *buffer, name[64], **member;
+	size_t buflen;
+	uint64_t start, first, total;
+	unsigned long n_groups, n_lines, count, i, hits, n_members, n_entries;
+	int err, r;
+	void *handle;
+	
+	if (argc < 2 || argc > 5 || !strcmp(argv[1], "-h")) {
+		printf("Usage: %s <libnss_confd.so.2> [<number of groups> [<number of membership lines> [<number of lookups>]]]\n", argv[0]);
+		printf("\n");
+		printf("Defaults to 10000 groups, 100000 membership lines and 100000 lookups.\n");
+		return argc < 2 ? 1 : 0;
+	}
+	
+	n_groups = argc > 2 ? strtoul(argv[2], 0, 0) : 10000;
+	n_lines = argc > 3 ? strtoul(argv[3], 0, 0) : 100000;
+	count = argc > 4 ? strtoul(argv[4], 0, 0) : 100000;
+	if (n_groups == 0 || count == 0) {
+		fprintf(stderr, "invalid number of groups or lookups\n");
+		return 1;
+	}
+	
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "cannot create a temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	// spread the groups over up to $N_FILES files
+	ds.databases = DATASET_GROUP;
+	ds.n_per_file = (n_groups + N_FILES - 1) / N_FILES;
+	ds.n_files = (n_groups + ds.n_per_file - 1) / ds.n_per_file;
+	ds.n_members = 1;
+	ds.n_lines = n_lines;
+	n_groups = ds.n_files * ds.n_per_file;
+	
+	r = create_dataset(root, &ds);
+	if (r) {
+		fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+		remove_dataset(root);
+		return 1;
+	}
+	
+	// measure the lookups in this process only
+	snprintf(dirpath, sizeof(dirpath), "%s/group.d", root);
+	setenv("NSS_CONFD_GROUP_DIR", dirpath, 1);
+	setenv("NSS_CONFD_GROUP_INDEX", "", 1);
+	setenv("NSS_CONFD_SOCKET", "", 1);
+	unsetenv("NSS_CONFD_SHM");
+	
+	handle = dlopen(argv[1], RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "cannot load \"%s\": %s\n", argv[1], dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	getgrnam_r_fn = (getgrnam_r_t) dlsym(handle, "_nss_confd_getgrnam_r");
+	setgrent_fn = (setgrent_t) dlsym(handle, "_nss_confd_setgrent");
+	getgrent_r_fn = (getgrent_r_t) dlsym(handle, "_nss_confd_getgrent_r");
+	endgrent_fn = (endgrent_t) dlsym(handle, "_nss_confd_endgrent");
+	if (!getgrnam_r_fn || !setgrent_fn || !getgrent_r_fn || !endgrent_fn) {
+		fprintf(stderr, "cannot find the lookup functions: %s\n", dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	buflen = 1024;
+	buffer = (char *) malloc(buflen);
+	
+	srandom(2);
+	hits = 0;
+	n_members = 0;
+	first = 0;
+	total = now_ns();
+	for (i=0; i < count && buffer; i++) {
+		snprintf(name, sizeof(name), "group%lu", random() % n_groups);
+		
+		start = now_ns();
+		while ((status = getgrnam_r_fn(name, &gr, buffer, buflen, &err)) == NSS_STATUS_TRYAGAIN && err == ERANGE) {
+			buflen *= 2;
+			free(buffer);
+			buffer = (char *) malloc(buflen);
+			if (!buffer)
+				break;
+		}
+		if (i == 0)
+			first = now_ns() - start;
+		
+		if (status == NSS_STATUS_SUCCESS) {
+			hits += 1;
+			for (member = gr.gr_mem; *member; member++)
+				n_members += 1;
+		}
+	}
+	total = now_ns() - total;
+	
+	printf("%lu groups, %lu membership lines\n", n_groups, n_lines);
+	printf("%lu lookups by name, %lu hits, %.1f members per group\n", count, hits, hits ? (double) n_members / hits : 0.0);
+	printf("throughput: %.0f lookups/s, first lookup %.1f ms\n", count / (total / 1e9), first / 1e6);
+	
+	n_entries = 0;
+	start = now_ns();
+	setgrent_fn();
+	while (buffer) {
+		status = getgrent_r_fn(&gr, buffer, buflen, &err);
+		if (status == NSS_STATUS_TRYAGAIN && err == ERANGE) {
+			buflen *= 2;
+			free(buffer);
+			buffer = (char *) malloc(buflen);
+			continue;
+		}
+		if (status != NSS_STATUS_SUCCESS)
+			break;
+		
+		n_entries += 1;
+	}
+	endgrent_fn();
+	
+	printf("enumeration: %lu groups in %.1f ms\n", n_entries, (now_ns() - start) / 1e6);
+	
+	free(buffer);
+	remove_dataset(root);
+	
+	return 0;
+}
@@ -0,0 +1,565 @@
+/*
+ * bench-spawn
+ * -----------
+ * 
+ * Models workloads like shell scripts, cron jobs or CI runners that start many
+ * short processes which each resolve a single uid and gid. For generated
+ * passwd.d and group.d directories of increasing size, the benchmark starts
+ * itself again and again with fork() and execv(). Every child loads the module
+ * with dlopen() like glibc does for the first NSS call and looks up one user
+ * by uid and one group by gid.
+ * 
+ * For every configuration, it prints the latency from fork() until the child
+ * exited, the latency of the first lookups measured in the child and, from an
+ * additional run under ptrace, the number of syscalls of the whole process and
+ * of the lookups alone. The "exec" configuration starts the child without
+ * loading the module as a baseline for the cost of the process itself.
+ * 
+ * The directories are measured as they are scanned by every process and, if
+ * nss-confd-mkindex is given with -k, with a parsed copy that it published in
+ * NSS_CONFD_SHM and with a compiled index. Calls that io_uring batches are not visible as
+ * syscalls, only the io_uring_enter() calls that submit them.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include "bench-common.h"
+
+#define BUFFER_SIZE (16*1024)
+#define MAX_SIZES 16
+#define MAX_SYSCALL 512
+#define N_WARMUP 3
+
+typedef enum nss_status (*getpwuid_t)(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*getgrgid_t)(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop);
+
+enum mode {
+	MODE_EXEC,
+	MODE_SCAN,
+	MODE_SHM,
+	MODE_INDEX,
+	N_MODES,
+};
+
+static const char *mode_names[N_MODES] = { "exec", "scan", "shm", "index" };
+
+struct syscall_name {
+	long nr;
+	const char *name;
+};
+
+// the syscalls that are listed separately for the lookups, all others are summed up as "other"
+static const struct syscall_name syscall_names[] = {
+	#ifdef SYS_open
+	{ SYS_open, "open" },
+	#endif
+	{ SYS_openat, "openat" },
+	{ SYS_close, "close" },
+	{ SYS_read, "read" },
+	{ SYS_pread64, "pread64" },
+	{ SYS_mmap, "mmap" },
+	{ SYS_munmap, "munmap" },
+	{ SYS_mprotect, "mprotect" },
+	#ifdef SYS_stat
+	{ SYS_stat, "stat" },
+	#endif
+	{ SYS_fstat, "fstat" },
+	#ifdef SYS_newfstatat
+	{ SYS_newfstatat, "newfstatat" },
+	#endif
+	{ SYS_statx, "statx" },
+	{ SYS_getdents64, "getdents64" },
+	{ SYS_io_uring_setup, "io_uring_setup" },
+	{ SYS_io_uring_enter, "io_uring_enter" },
+	{ SYS_io_uring_register, "io_uring_register" },
+	{ SYS_brk, "brk" },
+	{ SYS_futex, "futex" },
+	{ SYS_connect, "connect" },
+	{ SYS_socket, "socket" },
+};
+#define N_SYSCALL_NAMES (sizeof(syscall_names) / sizeof(syscall_names[0]))
+
+struct config {
+	unsigned long n_files;
+	unsigned long n_entries;
+	enum mode mode;
+	const char *library;
+	unsigned long n_spawns;
+};
+
+static int first_result = 1;
+
+/*
+ * The child: loads the module and looks up $uid and $gid. The getppid() calls
+ * mark the beginning and the end of the lookups for the syscall count, neither
+ * the dynamic loader nor the module call it. Writes the latency to stdout and
+ * returns 0 if both entries were found.
+ */
+static int child(const char *library, uid_t uid, gid_t gid) {
+	getpwuid_t getpwuid_fn;
+	getgrgid_t getgrgid_fn;
+	struct passwd pw;
+	struct group gr;
+	char buffer[BUFFER_SIZE];
+	uint64_t start, latency;
+	void *handle;
+	int err, found;
+	
+	getppid();
+	start = now_ns();
+	
+	found = 1;
+	if (library[0]) {
+		handle = dlopen(library, RTLD_NOW);
+		if (!handle)
+			return 1;
+		
+		getpwuid_fn = (getpwuid_t) dlsym(handle, "_nss_confd_getpwuid_r");
+		getgrgid_fn = (getgrgid_t) dlsym(handle, "_nss_confd_getgrgid_r");
+		if (!getpwuid_fn || !getgrgid_fn)
+			return 1;
+		
+		found = getpwuid_fn(uid, &pw, buffer, sizeof(buffer), &err) == NSS_STATUS_SUCCESS &&
+			getgrgid_fn(gid, &gr, buffer, sizeof(buffer), &err) == NSS_STATUS_SUCCESS;
+	}
+	
+	latency = now_ns() - start;
+	getppid();
+	
+	if (write(STDOUT_FILENO, &latency, sizeof(latency)) != sizeof(latency))
+		return 1;
+	
+	return found ? 0 : 1;
+}
+
+/*
+ * Writes passwd.d and group.d with $n_files files of $n_per_file entries each
+ * into $root and creates the directory for the parsed copies. Every group lists
+ * three random users.
+ */
+static int create_spawn_dataset(const char *root, unsigned long n_files, unsigned long n_per_file) {
+	struct dataset ds = { DATASET_PASSWD | DATASET_GROUP, n_files, n_per_file, 3, 0 };
+	char path[4096];
+	int r;
+	
+	r = create_dataset(root, &ds);
+	if (r)
+		return r;
+	
+	snprintf(path, sizeof(path), "%s/shm", root);
+	if (mkdir(path, 0700) && errno != EEXIST)
+		return -errno;
+	
+	return 0;
+}
+
+static void remove_spawn_dataset(const char *root) {
+	char path[4096];
+	
+	snprintf(path, sizeof(path), "%s/shm", root);
+	remove_dir(path);
+	
+	remove_dataset(root);
+}
+
+// points the module to the dataset in $root and enables or disables the index and the parsed copy
+static void set_env(const char *root, enum mode mode) {
+	char path[4096];
+	
+	snprintf(path, sizeof(path), "%s/passwd.d", root);
+	setenv("NSS_CONFD_PASSWD_DIR", path, 1);
+	snprintf(path, sizeof(path), "%s/group.d", root);
+	setenv("NSS_CONFD_GROUP_DIR", path, 1);
+	
+	if (mode == MODE_INDEX) {
+		// the default paths next to the directories
+		unsetenv("NSS_CONFD_PASSWD_INDEX");
+		unsetenv("NSS_CONFD_GROUP_INDEX");
+	} else {
+		setenv("NSS_CONFD_PASSWD_INDEX", "", 1);
+		setenv("NSS_CONFD_GROUP_INDEX", "", 1);
+	}
+	
+	if (mode == MODE_SHM) {
+		snprintf(path, sizeof(path), "%s/shm", root);
+		setenv("NSS_CONFD_SHM", path, 1);
+	} else {
+		unsetenv("NSS_CONFD_SHM");
+	}
+}
+
+// runs $mkindex for passwd and group with the environment of the index or, with $shm, of the shm configuration
+static int build_index(const char *mkindex, int shm) {
+	pid_t pid;
+	int status, fd;
+	
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDOUT_FILENO);
+		
+		if (shm)
+			execl(mkindex, mkindex, "--shm", "passwd", "group", (char *) 0);
+		else
+			execl(mkindex, mkindex, "passwd", "group", (char *) 0);
+		_exit(127);
+	}
+	
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+	
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EINVAL;
+}
+
+// starts a child with $argv that writes its latency into a pipe and returns the time until it exited
+static int spawn(char **argv, uint64_t *spawn_ns, uint64_t *lookup_ns) {
+	uint64_t start;
+	pid_t pid;
+	int fds[2], status;
+	ssize_t n;
+	
+	if (pipe2(fds, O_CLOEXEC))
+		return -errno;
+	
+	start = now_ns();
+	
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	
+	close(fds[1]);
+	
+	if (waitpid(pid, &status, 0) < 0) {
+		close(fds[0]);
+		return -errno;
+	}
+	
+	*spawn_ns = now_ns() - start;
+	
+	n = read(fds[0], lookup_ns, sizeof(*lookup_ns));
+	close(fds[0]);
+	
+	if (n != sizeof(*lookup_ns) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -EINVAL;
+	
+	return 0;
+}
+
+/*
+ * Starts a child with $argv under ptrace and counts its syscalls from execv()
+ * on in $total and the syscalls between the two getppid() calls that enclose
+ * the lookups by number in $lookup.
+ */
+static int trace(char **argv, unsigned long *total, unsigned long *lookup) {
+	struct __ptrace_syscall_info info;
+	pid_t pid;
+	int status, sig, in_lookup, fd;
+	
+	*total = 0;
+	
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDOUT_FILENO);
+		
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		raise(SIGSTOP);
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+	
+	if (ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)) {
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		return -errno;
+	}
+	
+	in_lookup = 0;
+	sig = 0;
+	while (1) {
+		if (ptrace(PTRACE_SYSCALL, pid, 0, sig))
+			break;
+		
+		if (waitpid(pid, &status, 0) < 0)
+			return -errno;
+		
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+		
+		sig = 0;
+		if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+			// deliver other signals but not the SIGTRAP of the exec event
+			if (status >> 8 != (SIGTRAP | (PTRACE_EVENT_EXEC << 8)))
+				sig = WSTOPSIG(status);
+			continue;
+		}
+		
+		if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) <= 0 || info.op != PTRACE_SYSCALL_INFO_ENTRY)
+			continue;
+		
+		*total += 1;
+		
+		if (info.entry.nr == SYS_getppid) {
+			in_lookup = !in_lookup;
+			continue;
+		}
+		
+		if (in_lookup && info.entry.nr < MAX_SYSCALL)
+			lookup[info.entry.nr] += 1;
+	}
+	
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EINVAL;
+}
+
+// prints the results of a configuration as one JSON object
+static void print_config(struct config *cfg, uint64_t *spawn_ns, uint64_t *lookup_ns, unsigned long total, unsigned long *lookup) {
+	unsigned long n, n_lookup, other;
+	size_t i;
+	int first;
+	
+	qsort(spawn_ns, cfg->n_spawns, sizeof(uint64_t), cmp_u64);
+	qsort(lookup_ns, cfg->n_spawns, sizeof(uint64_t), cmp_u64);
+	
+	n_lookup = 0;
+	for (i=0; i < MAX_SYSCALL; i++)
+		n_lookup += lookup[i];
+	
+	n = cfg->n_spawns;
+	printf("%s\n    {\"mode\": \"%s\", \"files\": %lu, \"entries\": %lu, \"spawns\": %lu, "
+		"\"spawn_p50_ns\": %llu, \"spawn_p99_ns\": %llu, \"lookup_p50_ns\": %llu, \"lookup_p99_ns\": %llu, "
+		"\"syscalls\": %lu, \"lookup_syscalls\": %lu, \"lookup_calls\": {",
+		first_result ? "" : ",", mode_names[cfg->mode], cfg->n_files, cfg->n_entries, n,
+		(unsigned long long) spawn_ns[n / 2], (unsigned long long) spawn_ns[n * 99 / 100],
+		(unsigned long long) lookup_ns[n / 2], (unsigned long long) lookup_ns[n * 99 / 100],
+		total, n_lookup);
+			
+	first = 1;
+	other = n_lookup;
+	for (i=0; i < N_SYSCALL_NAMES; i++) {
+		if (!lookup[syscall_names[i].nr])
+			continue;
+				
+		printf("%s\"%s\": %lu", first ? "" : ", ", syscall_names[i].name, lookup[syscall_names[i].nr]);
+		other -= lookup[syscall_names[i].nr];
+		first = 0;
+	}
+	if (other)
+		printf("%s\"other\": %lu", first ? "" : ", ", other);
+	printf("}}");
+	
+	first_result = 0;
+}
+
+// measures one configuration, the environment has to be set already
+static int bench_config(struct config *cfg, uint64_t *spawn_ns, uint64_t *lookup_ns) {
+	unsigned long lookup[MAX_SYSCALL], total, i;
+	char uid[32], gid[32];
+	char *argv[6];
+	uint64_t ignore_spawn, ignore_lookup;
+	int r;
+	
+	// look up an entry in the middle of the directory
+	snprintf(uid, sizeof(uid), "%lu", 10000 + cfg->n_entries / 2);
+	snprintf(gid, sizeof(gid), "%lu", 10000 + cfg->n_entries / 2);
+	
+	argv[0] = "bench-spawn";
+	argv[1] = "-x";
+	argv[2] = (char *) (cfg->mode == MODE_EXEC ? "" : cfg->library);
+	argv[3] = uid;
+	argv[4] = gid;
+	argv[5] = 0;
+	
+	// fill the page cache
+	for (i=0; i < N_WARMUP; i++) {
+		r = spawn(argv, &ignore_spawn, &ignore_lookup);
+		if (r)
+			return r;
+	}
+	
+	for (i=0; i < cfg->n_spawns; i++) {
+		r = spawn(argv, &spawn_ns[i], &lookup_ns[i]);
+		if (r)
+			return r;
+	}
+	
+	memset(lookup, 0, sizeof(lookup));
+	r = trace(argv, &total, lookup);
+	if (r)
+		return r;
+	
+	print_config(cfg, spawn_ns, lookup_ns, total, lookup);
+	
+	return 0;
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options] <libnss_confd.so.2>\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -f <list>    comma-separated numbers of files per directory (default: 1,10,100,1000)\n");
+	printf("  -e <number>  entries per file (default: 20)\n");
+	printf("  -n <number>  spawned processes per configuration (default: 200)\n");
+	printf("  -k <path>    nss-confd-mkindex to also measure a parsed copy in shared memory and a compiled index\n");
+}
+
+int main(int argc, char **argv) {
+	struct config cfg;
+	unsigned long sizes[MAX_SIZES], n_per_file;
+	size_t n_sizes, i;
+	uint64_t *spawn_ns, *lookup_ns;
+	char root[] = "/tmp/bench-spawn.XXXXXX";
+	char dirpath[64], library[4096], *list, *end, *mkindex;
+	enum mode mode;
+	int c, r;
+	
+	if (argc == 5 && !strcmp(argv[1], "-x"))
+		return child(argv[2], strtoul(argv[3], 0, 0), strtoul(argv[4], 0, 0));
+	
+	list = "1,10,100,1000";
+	n_per_file = 20;
+	cfg.n_spawns = 200;
+	mkindex = 0;
+	
+	while ((c = getopt(argc, argv, "hf:e:n:k:")) != -1) {
+		switch (c) {
+			case 'f': list = optarg; break;
+			case 'e': n_per_file = strtoul(optarg, 0, 0); break;
+			case 'n': cfg.n_spawns = strtoul(optarg, 0, 0); break;
+			case 'k': mkindex = optarg; break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	n_sizes = 0;
+	while (*list && n_sizes < MAX_SIZES) {
+		sizes[n_sizes] = strtoul(list, &end, 0);
+		if (end == list || sizes[n_sizes] == 0)
+			break;
+		
+		n_sizes += 1;
+		list = *end == ',' ? end + 1 : end;
+	}
+	
+	if (n_sizes == 0 || *list || n_per_file == 0 || cfg.n_spawns == 0) {
+		fprintf(stderr, "invalid number of files, entries or spawns\n");
+		return 1;
+	}
+	
+	// the children have another working directory than the caller might expect
+	if (!realpath(argv[optind], library)) {
+		fprintf(stderr, "cannot find \"%s\": %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	cfg.library = library;
+	
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "cannot create a temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	spawn_ns = (uint64_t *) malloc(sizeof(uint64_t) * cfg.n_spawns);
+	lookup_ns = (uint64_t *) malloc(sizeof(uint64_t) * cfg.n_spawns);
+	if (!spawn_ns || !lookup_ns) {
+		fprintf(stderr, "out of memory\n");
+		rmdir(root);
+		return 1;
+	}
+	
+	// measure the module in the children only, without the daemon and without watching the directories
+	setenv("NSS_CONFD_SOCKET", "", 1);
+	unsetenv("NSS_CONFD_WATCH");
+	
+	printf("{\n  \"entries_per_file\": %lu,\n  \"results\": [", n_per_file);
+		
+	r = 0;
+	for (i=0; i < n_sizes && r == 0; i++) {
+		snprintf(dirpath, sizeof(dirpath), "%s/%lu", root, sizes[i]);
+			
+		r = create_spawn_dataset(dirpath, sizes[i], n_per_file);
+		if (r) {
+			fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+			remove_spawn_dataset(dirpath);
+			break;
+		}
+			
+		cfg.n_files = sizes[i];
+		cfg.n_entries = sizes[i] * n_per_file;
+			
+		for (mode=0; mode < N_MODES && r == 0; mode++) {
+			// the cost of the process itself does not depend on the directories
+			if (mode == MODE_EXEC && i > 0)
+				continue;
+			if ((mode == MODE_SHM || mode == MODE_INDEX) && !mkindex)
+				continue;
+				
+			set_env(dirpath, mode);
+				
+			if (mode == MODE_SHM || mode == MODE_INDEX) {
+				r = build_index(mkindex, mode == MODE_SHM);
+				if (r) {
+					fprintf(stderr, "cannot build the index with \"%s\"\n", mkindex);
+					break;
+				}
+			}
+				
+			cfg.mode = mode;
+			r = bench_config(&cfg, spawn_ns, lookup_ns);
+			if (r)
+				fprintf(stderr, "%s with %lu files failed: %s\n", mode_names[mode], sizes[i], strerror(-r));
+		}
+			
+		remove_spawn_dataset(dirpath);
+	}
+		
+	printf("\n  ]\n}\n");
+	
+	free(spawn_ns);
+	free(lookup_ns);
+	rmdir(root);
+	
+	return r ? 1 : 0;
+}
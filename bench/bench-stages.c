@@ -0,0 +1,504 @@
+/*
+ * bench-stages
+ * ------------
+ * 
+ * Measures the stages of the nss-confd module separately on a generated
+ * dataset and prints the results as JSON: the scan of a directory, loading
+ * its tables, parsing all records, the first lookup that loads a database,
+ * lookups of existing and unknown names, an enumeration and lookups that are
+ * repeated after ERANGE with a larger buffer.
+ * 
+ * The scan, load and parse stages call the internal functions that the module
+ * exports, hence the benchmark has to be built from the same tree as the
+ * module. With -g, the dataset is only written to the given directory, e.g.,
+ * to run other benchmarks on it.
+ * 
+ * As baseline, the same stages run on an equivalent flat file with
+ * fgetpwent_r(), fgetgrent_r() and fgetspent_r() the way nss_files reads
+ * /etc/passwd for every lookup. nss_files itself cannot be pointed to another
+ * file.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+#include <shadow.h>
+
+#include "../nss-confd.h"
+#include "bench-common.h"
+
+#define BUFFER_SIZE (64*1024)
+
+typedef enum nss_status (*getnam_t)(const char *name, void *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*setent_t)(void);
+typedef enum nss_status (*getent_t)(void *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*endent_t)(void);
+typedef int (*fgetent_t)(FILE *stream, void *result, char *buffer, size_t buflen, void **resultp);
+
+typedef int (*tables_load_t)(const char *dirpath, int (*filter)(const struct dirent *), struct table *old, size_t n_old,
+	struct table **tables, size_t *n_tables, int *changed);
+typedef void (*table_close_t)(struct table *table);
+typedef int (*next_record_t)(struct table *tables, size_t n_tables, struct table **cur_table, char **cur_pos,
+	struct field *fields, unsigned int n_fields, unsigned int numeric, char **next);
+
+struct database {
+	const char *name;
+	const char *dir_env;
+	const char *key;
+	unsigned int n_fields;
+	unsigned int numeric;
+	const char *getnam;
+	const char *setent;
+	const char *getent;
+	const char *endent;
+	fgetent_t fgetent;
+};
+
+static struct database databases[] = {
+	{ "passwd", "NSS_CONFD_PASSWD_DIR", "user", 7, (1 << 2) | (1 << 3),
+		"_nss_confd_getpwnam_r", "_nss_confd_setpwent", "_nss_confd_getpwent_r", "_nss_confd_endpwent", (fgetent_t) fgetpwent_r },
+	{ "group", "NSS_CONFD_GROUP_DIR", "group", 4, 1 << 2,
+		"_nss_confd_getgrnam_r", "_nss_confd_setgrent", "_nss_confd_getgrent_r", "_nss_confd_endgrent", (fgetent_t) fgetgrent_r },
+	{ "shadow", "NSS_CONFD_SHADOW_DIR", "user", 9, 0x1fc,
+		"_nss_confd_getspnam_r", "_nss_confd_setspent", "_nss_confd_getspent_r", "_nss_confd_endspent", (fgetent_t) fgetspent_r },
+};
+#define N_DATABASES (sizeof(databases) / sizeof(databases[0]))
+
+// the results of a stage are the latencies of its operations
+struct stage {
+	const char *impl;
+	const char *db;
+	const char *name;
+	unsigned long items;
+	unsigned long ops;
+	uint64_t *samples;
+};
+
+union result {
+	struct passwd pw;
+	struct group gr;
+	struct spwd sp;
+};
+
+static tables_load_t tables_load_fn;
+static table_close_t table_close_fn;
+static next_record_t next_record_fn;
+
+static char buffer[BUFFER_SIZE];
+static int first_result = 1;
+
+static int select_table(const struct dirent *ep) {
+	size_t len;
+	
+	if (ep->d_type != DT_REG)
+		return 0;
+	
+	len = strlen(ep->d_name);
+	
+	return len <= 11 || strcmp(&ep->d_name[len - 11], ".membership");
+}
+
+// prints the results of a stage as one JSON object
+static void print_stage(struct stage *stage) {
+	uint64_t total;
+	unsigned long i;
+	
+	total = 0;
+	for (i=0; i < stage->ops; i++)
+		total += stage->samples[i];
+	
+	qsort(stage->samples, stage->ops, sizeof(uint64_t), cmp_u64);
+	
+	printf("%s\n    {\"impl\": \"%s\", \"db\": \"%s\", \"stage\": \"%s\", \"ops\": %lu, \"items\": %lu, "
+		"\"total_ns\": %llu, \"ns_per_op\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu}",
+		first_result ? "" : ",", stage->impl, stage->db, stage->name, stage->ops, stage->items,
+		(unsigned long long) total, stage->ops ? (double) total / stage->ops : 0.0,
+		(unsigned long long) (stage->ops ? stage->samples[stage->ops / 2] : 0),
+		(unsigned long long) (stage->ops ? stage->samples[stage->ops * 99 / 100] : 0));
+	
+	first_result = 0;
+}
+
+// reads the names in the directory like the module does before it opens the files
+static void bench_scan(struct stage *stage, const char *dirpath) {
+	struct dirent *dent;
+	unsigned long i;
+	uint64_t start;
+	DIR *dir;
+	
+	for (i=0; i < stage->ops; i++) {
+		stage->items = 0;
+		
+		start = now_ns();
+		dir = opendir(dirpath);
+		while (dir && (dent = readdir(dir))) {
+			if (select_table(dent))
+				stage->items += 1;
+		}
+		if (dir)
+			closedir(dir);
+		stage->samples[i] = now_ns() - start;
+	}
+}
+
+// loads the tables of the directory and, if $parse is set, measures parsing all their records instead
+static int bench_load(struct stage *stage, struct database *db, const char *dirpath, int parse) {
+	struct field fields[DB_MAX_FIELDS];
+	struct table *tables, *cur_table;
+	char *cur_pos, *next;
+	size_t n_tables, j;
+	unsigned long i;
+	uint64_t start;
+	int changed, r;
+	
+	for (i=0; i < stage->ops; i++) {
+		start = now_ns();
+		r = tables_load_fn(dirpath, select_table, 0, 0, &tables, &n_tables, &changed);
+		if (r)
+			return r;
+		stage->samples[i] = now_ns() - start;
+		stage->items = n_tables;
+		
+		if (parse) {
+			stage->items = 0;
+			cur_table = tables;
+			cur_pos = n_tables ? tables->data : 0;
+			
+			start = now_ns();
+			while (next_record_fn(tables, n_tables, &cur_table, &cur_pos, fields, db->n_fields, db->numeric, &next) == 0) {
+				stage->items += 1;
+				cur_pos = next;
+			}
+			stage->samples[i] = now_ns() - start;
+		}
+		
+		for (j=0; j < n_tables; j++)
+			table_close_fn(&tables[j]);
+		free(tables);
+	}
+	
+	return 0;
+}
+
+/*
+ * Looks up random existing ($miss = 0) or unknown keys. With $erange set, every
+ * lookup is first tried with a buffer that is too small and repeated with a
+ * large enough buffer after ERANGE.
+ */
+static void bench_lookup(struct stage *stage, struct database *db, getnam_t getnam, unsigned long n_entries, int miss, int erange) {
+	union result result;
+	enum nss_status status;
+	char name[64];
+	unsigned long i;
+	uint64_t start;
+	int err;
+	
+	srandom(2);
+	stage->items = 0;
+	for (i=0; i < stage->ops; i++) {
+		snprintf(name, sizeof(name), "%s%s%lu", miss ? "no" : "", db->key, random() % n_entries);
+		
+		start = now_ns();
+		if (erange) {
+			status = getnam(name, &result, buffer, 16, &err);
+			if (status == NSS_STATUS_TRYAGAIN && err == ERANGE)
+				status = getnam(name, &result, buffer, sizeof(buffer), &err);
+		} else {
+			status = getnam(name, &result, buffer, sizeof(buffer), &err);
+		}
+		stage->samples[i] = now_ns() - start;
+		
+		if (status == NSS_STATUS_SUCCESS)
+			stage->items += 1;
+	}
+}
+
+static void bench_enum(struct stage *stage, setent_t setent, getent_t getent, endent_t endent) {
+	union result result;
+	unsigned long i;
+	uint64_t start;
+	int err;
+	
+	for (i=0; i < stage->ops; i++) {
+		stage->items = 0;
+		
+		start = now_ns();
+		setent();
+		while (getent(&result, buffer, sizeof(buffer), &err) == NSS_STATUS_SUCCESS)
+			stage->items += 1;
+		endent();
+		stage->samples[i] = now_ns() - start;
+	}
+}
+
+// searches the flat file for every lookup like nss_files, $key 0 enumerates all entries
+static unsigned long scan_flat(struct database *db, const char *path, const char *key) {
+	union result result;
+	unsigned long n;
+	void *resultp;
+	FILE *f;
+	
+	f = fopen(path, "re");
+	if (!f)
+		return 0;
+	
+	n = 0;
+	while (db->fgetent(f, &result, buffer, sizeof(buffer), &resultp) == 0) {
+		n += 1;
+		
+		// the name is the first member of struct passwd, group and spwd
+		if (key && !strcmp(*(char **) &result, key))
+			break;
+	}
+	
+	fclose(f);
+	
+	return n;
+}
+
+static void bench_flat(struct stage *stage, struct database *db, const char *path, unsigned long n_entries, int miss, int all) {
+	char name[64];
+	unsigned long i;
+	uint64_t start;
+	
+	srandom(2);
+	stage->items = 0;
+	for (i=0; i < stage->ops; i++) {
+		snprintf(name, sizeof(name), "%s%s%lu", miss ? "no" : "", db->key, random() % n_entries);
+		
+		start = now_ns();
+		if (all)
+			stage->items = scan_flat(db, path, 0);
+		else if (scan_flat(db, path, name) > 0 && !miss)
+			stage->items += 1;
+		stage->samples[i] = now_ns() - start;
+	}
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options] <libnss_confd.so.2>\n", argv0);
+	printf("       %s [options] -g <directory>\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -f <number>  files per database (default: 100)\n");
+	printf("  -e <number>  entries per file (default: 100)\n");
+	printf("  -m <number>  members per group (default: 10)\n");
+	printf("  -s <number>  lines in .membership files (default: 0), needs WITH_SPLIT_MEMBERS=1\n");
+	printf("  -n <number>  lookups per stage (default: 100000)\n");
+	printf("  -b <number>  lookups per stage of the flat file baseline (default: 1000)\n");
+	printf("  -r <number>  runs of the scan, load, parse and enumeration stages (default: 5)\n");
+	printf("  -g <dir>     only write the dataset into the existing directory <dir>\n");
+}
+
+int main(int argc, char **argv) {
+	struct dataset ds;
+	struct stage stage;
+	struct database *db;
+	getnam_t getnam;
+	setent_t setent;
+	getent_t getent;
+	endent_t endent;
+	char root[] = "/tmp/bench-stages.XXXXXX";
+	char dirpath[4096], path[4096], *generate;
+	unsigned long n_lookups, n_baseline, n_runs, n_entries, max_ops;
+	size_t i;
+	void *handle;
+	int c, r;
+	
+	ds.databases = DATASET_ALL;
+	ds.n_files = 100;
+	ds.n_per_file = 100;
+	ds.n_members = 10;
+	ds.n_lines = 0;
+	n_lookups = 100000;
+	n_baseline = 1000;
+	n_runs = 5;
+	generate = 0;
+	
+	while ((c = getopt(argc, argv, "hf:e:m:s:n:b:r:g:")) != -1) {
+		switch (c) {
+			case 'f': ds.n_files = strtoul(optarg, 0, 0); break;
+			case 'e': ds.n_per_file = strtoul(optarg, 0, 0); break;
+			case 'm': ds.n_members = strtoul(optarg, 0, 0); break;
+			case 's': ds.n_lines = strtoul(optarg, 0, 0); break;
+			case 'n': n_lookups = strtoul(optarg, 0, 0); break;
+			case 'b': n_baseline = strtoul(optarg, 0, 0); break;
+			case 'r': n_runs = strtoul(optarg, 0, 0); break;
+			case 'g': generate = optarg; break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	n_entries = ds.n_files * ds.n_per_file;
+	if (n_entries == 0 || n_lookups == 0 || n_runs == 0) {
+		fprintf(stderr, "invalid number of files, entries, lookups or runs\n");
+		return 1;
+	}
+	
+	if (generate) {
+		r = create_dataset(generate, &ds);
+		if (r) {
+			fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+			return 1;
+		}
+		
+		return 0;
+	}
+	
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "cannot create a temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	r = create_dataset(root, &ds);
+	if (r) {
+		fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+		remove_dataset(root);
+		return 1;
+	}
+	
+	// measure the module in this process only, neither with an index nor with the daemon
+	for (i=0; i < N_DATABASES; i++) {
+		snprintf(dirpath, sizeof(dirpath), "%s/%s.d", root, databases[i].name);
+		setenv(databases[i].dir_env, dirpath, 1);
+	}
+	setenv("NSS_CONFD_PASSWD_INDEX", "", 1);
+	setenv("NSS_CONFD_GROUP_INDEX", "", 1);
+	setenv("NSS_CONFD_SHADOW_INDEX", "", 1);
+	setenv("NSS_CONFD_SOCKET", "", 1);
+	unsetenv("NSS_CONFD_SHM");
+	
+	handle = dlopen(argv[optind], RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "cannot load \"%s\": %s\n", argv[optind], dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	tables_load_fn = (tables_load_t) dlsym(handle, "tables_load");
+	table_close_fn = (table_close_t) dlsym(handle, "table_close");
+	next_record_fn = (next_record_t) dlsym(handle, "next_record");
+	if (!tables_load_fn || !table_close_fn || !next_record_fn) {
+		fprintf(stderr, "cannot find the internal functions: %s\n", dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	max_ops = n_lookups > n_runs ? n_lookups : n_runs;
+	if (n_baseline > max_ops)
+		max_ops = n_baseline;
+	stage.samples = (uint64_t *) malloc(sizeof(uint64_t) * max_ops);
+	if (!stage.samples) {
+		fprintf(stderr, "out of memory\n");
+		remove_dataset(root);
+		return 1;
+	}
+	
+	printf("{\n  \"dataset\": {\"files\": %lu, \"entries_per_file\": %lu, \"entries\": %lu, \"members_per_group\": %lu, \"membership_lines\": %lu},\n",
+		ds.n_files, ds.n_per_file, n_entries, ds.n_members, ds.n_lines);
+	printf("  \"results\": [");
+		
+	r = 0;
+	for (i=0; i < N_DATABASES && r == 0; i++) {
+		db = &databases[i];
+			
+		getnam = (getnam_t) dlsym(handle, db->getnam);
+		setent = (setent_t) dlsym(handle, db->setent);
+		getent = (getent_t) dlsym(handle, db->getent);
+		endent = (endent_t) dlsym(handle, db->endent);
+		if (!getnam || !setent || !getent || !endent) {
+			fprintf(stderr, "cannot find the lookup functions: %s\n", dlerror());
+			r = 1;
+			break;
+		}
+			
+		snprintf(dirpath, sizeof(dirpath), "%s/%s.d", root, db->name);
+		snprintf(path, sizeof(path), "%s/%s", root, db->name);
+			
+		stage.impl = "nss-confd";
+		stage.db = db->name;
+			
+		stage.name = "scan";
+		stage.ops = n_runs;
+		bench_scan(&stage, dirpath);
+		print_stage(&stage);
+			
+		stage.name = "load";
+		stage.ops = n_runs;
+		if (bench_load(&stage, db, dirpath, 0) == 0)
+			print_stage(&stage);
+			
+		stage.name = "parse";
+		stage.ops = n_runs;
+		if (bench_load(&stage, db, dirpath, 1) == 0)
+			print_stage(&stage);
+			
+		// the first lookup loads the database, the following ones use it
+		stage.name = "first";
+		stage.ops = 1;
+		bench_lookup(&stage, db, getnam, n_entries, 0, 0);
+		print_stage(&stage);
+			
+		stage.name = "hit";
+		stage.ops = n_lookups;
+		bench_lookup(&stage, db, getnam, n_entries, 0, 0);
+		print_stage(&stage);
+			
+		stage.name = "miss";
+		stage.ops = n_lookups;
+		bench_lookup(&stage, db, getnam, n_entries, 1, 0);
+		print_stage(&stage);
+			
+		stage.name = "erange";
+		stage.ops = n_lookups;
+		bench_lookup(&stage, db, getnam, n_entries, 0, 1);
+		print_stage(&stage);
+			
+		stage.name = "enum";
+		stage.ops = n_runs;
+		bench_enum(&stage, setent, getent, endent);
+		print_stage(&stage);
+			
+		stage.impl = "flat";
+			
+		stage.name = "hit";
+		stage.ops = n_baseline;
+		bench_flat(&stage, db, path, n_entries, 0, 0);
+		print_stage(&stage);
+			
+		stage.name = "miss";
+		stage.ops = n_baseline;
+		bench_flat(&stage, db, path, n_entries, 1, 0);
+		print_stage(&stage);
+			
+		stage.name = "enum";
+		stage.ops = n_runs;
+		bench_flat(&stage, db, path, n_entries, 0, 1);
+		print_stage(&stage);
+	}
+		
+	printf("\n  ]\n}\n");
+	
+	free(stage.samples);
+	remove_dataset(root);
+	
+	return r;
+}
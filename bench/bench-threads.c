@@ -0,0 +1,405 @@
+/*
+ * bench-threads
+ * -------------
+ * 
+ * Measures how getpwuid_r() and getgrgid_r() lookups of the nss-confd module
+ * scale with the number of threads. For 1, 2, 4, ... threads up to the given
+ * maximum, every thread looks up existing and unknown ids and enumerates the
+ * passwd database from time to time while another thread changes a file in
+ * each directory, which makes the module load the databases again.
+ * 
+ * With -f, the main thread also forks children while the threads look up ids.
+ * Every child calls setpwent() and endpwent(), which waits for the lookups
+ * that were running in the snapshot, and has to exit within a few seconds.
+ * 
+ * The benchmark creates temporary passwd.d and group.d directories and removes
+ * them afterwards. Built with TSAN=1 together with the module, e.g.
+ * "make -B TSAN=1 libnss_confd.so.2 bench/bench-threads", it runs under
+ * ThreadSanitizer as a stress test.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include "bench-common.h"
+
+#define N_FILES 100
+#define BUFFER_SIZE 4096
+#define FORK_TIMEOUT_NS 5000000000ull
+
+typedef enum nss_status (*getpwuid_r_t)(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*getgrgid_r_t)(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*setpwent_t)(void);
+typedef enum nss_status (*getpwent_r_t)(struct passwd *result, char *buffer, size_t buflen, int *errnop);
+typedef enum nss_status (*endpwent_t)(void);
+
+struct config {
+	unsigned long n_entries;
+	unsigned long n_ops;
+	unsigned int miss_percent;
+	unsigned long enum_every;
+	unsigned long reload_ms;
+	unsigned long n_forks;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	uint64_t *latencies;
+	unsigned long n_latencies;
+	unsigned long n_hits;
+	unsigned long n_enums;
+	uint64_t enum_ns;
+};
+
+static getpwuid_r_t getpwuid_r_fn;
+static getgrgid_r_t getgrgid_r_fn;
+static setpwent_t setpwent_fn;
+static getpwent_r_t getpwent_r_fn;
+static endpwent_t endpwent_fn;
+
+static struct config config;
+static char root[] = "/tmp/bench-threads.XXXXXX";
+static pthread_barrier_t start_barrier;
+static int stop_reload;
+static unsigned long n_changes;
+
+// replaces the file "reload" in both directories with a new version until stop_reload is set
+static void *reload_thread(void *arg) {
+	char path[4096], tmppath[4096];
+	struct timespec ts;
+	unsigned long i;
+	FILE *f;
+	
+	(void) arg;
+	
+	ts.tv_sec = config.reload_ms / 1000;
+	ts.tv_nsec = (config.reload_ms % 1000) * 1000000;
+	
+	for (i=0; !__atomic_load_n(&stop_reload, __ATOMIC_RELAXED); i++) {
+		snprintf(tmppath, sizeof(tmppath), "%s/reload.tmp", root);
+		
+		f = fopen(tmppath, "w");
+		if (f) {
+			fprintf(f, "reload%lu:x:%lu:%lu::/:/bin/sh\n", i, 5000 + i % 1000, 5000 + i % 1000);
+			fclose(f);
+			snprintf(path, sizeof(path), "%s/passwd.d/reload", root);
+			rename(tmppath, path);
+		}
+		
+		f = fopen(tmppath, "w");
+		if (f) {
+			fprintf(f, "reload%lu:x:%lu:\n", i, 5000 + i % 1000);
+			fclose(f);
+			snprintf(path, sizeof(path), "%s/group.d/reload", root);
+			rename(tmppath, path);
+		}
+		
+		__atomic_add_fetch(&n_changes, 1, __ATOMIC_RELAXED);
+		
+		nanosleep(&ts, 0);
+	}
+	
+	return 0;
+}
+
+/*
+ * Performs $config.n_ops operations: lookups of random existing or, with a
+ * probability of $config.miss_percent, unknown uids and gids and every
+ * $config.enum_every operations an enumeration of all users.
+ */
+static void *worker_thread(void *arg) {
+	struct worker *worker = (struct worker *) arg;
+	struct passwd pw;
+	struct group gr;
+	enum nss_status status;
+	char buffer[BUFFER_SIZE];
+	unsigned long i, n;
+	uint64_t start;
+	int err;
+	
+	pthread_barrier_wait(&start_barrier);
+	
+	for (i=0; i < config.n_ops; i++) {
+		if (config.enum_every && i % config.enum_every == config.enum_every - 1) {
+			start = now_ns();
+			setpwent_fn();
+			while (getpwent_r_fn(&pw, buffer, sizeof(buffer), &err) == NSS_STATUS_SUCCESS);
+			endpwent_fn();
+			worker->enum_ns += now_ns() - start;
+			worker->n_enums += 1;
+			continue;
+		}
+		
+		n = rand_r(&worker->seed) % config.n_entries;
+		if ((unsigned int) rand_r(&worker->seed) % 100 < config.miss_percent)
+			n += config.n_entries;
+		
+		start = now_ns();
+		if (i % 2)
+			status = getpwuid_r_fn(10000 + n, &pw, buffer, sizeof(buffer), &err);
+		else
+			status = getgrgid_r_fn(10000 + n, &gr, buffer, sizeof(buffer), &err);
+		worker->latencies[worker->n_latencies++] = now_ns() - start;
+		
+		if (status == NSS_STATUS_SUCCESS)
+			worker->n_hits += 1;
+	}
+	
+	return 0;
+}
+
+// forks $config.n_forks children one after another and returns the number of children that did not exit in time
+static unsigned long fork_children(void) {
+	unsigned long i, hung;
+	uint64_t start;
+	int status;
+	pid_t pid;
+	
+	hung = 0;
+	for (i=0; i < config.n_forks; i++) {
+		pid = fork();
+		if (pid < 0)
+			break;
+		
+		// the child only has this thread, the lookups of the other threads never finish in it
+		if (pid == 0) {
+			setpwent_fn();
+			endpwent_fn();
+			_exit(0);
+		}
+		
+		start = now_ns();
+		while (waitpid(pid, &status, WNOHANG) == 0) {
+			if (now_ns() - start > FORK_TIMEOUT_NS) {
+				kill(pid, SIGKILL);
+				waitpid(pid, &status, 0);
+				hung += 1;
+				break;
+			}
+			
+			usleep(1000);
+		}
+	}
+	
+	return hung;
+}
+
+// runs the workload with $n_threads threads and prints the result
+static int run(unsigned int n_threads) {
+	struct worker *workers;
+	pthread_t reloader;
+	uint64_t *latencies, start, total_ns, enum_ns;
+	unsigned long n, hits, enums, changes, hung;
+	unsigned int i;
+	int r;
+	
+	workers = (struct worker *) calloc(n_threads, sizeof(struct worker));
+	latencies = (uint64_t *) malloc(sizeof(uint64_t) * config.n_ops * n_threads);
+	if (!workers || !latencies) {
+		free(workers);
+		free(latencies);
+		return -ENOMEM;
+	}
+	
+	pthread_barrier_init(&start_barrier, 0, n_threads + 1);
+	
+	for (i=0; i < n_threads; i++) {
+		workers[i].seed = i + 1;
+		workers[i].latencies = latencies + (size_t) i * config.n_ops;
+		pthread_create(&workers[i].thread, 0, worker_thread, &workers[i]);
+	}
+	
+	__atomic_store_n(&stop_reload, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&n_changes, 0, __ATOMIC_RELAXED);
+	r = config.reload_ms ? pthread_create(&reloader, 0, reload_thread, 0) : -1;
+	
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	
+	hung = fork_children();
+	
+	for (i=0; i < n_threads; i++)
+		pthread_join(workers[i].thread, 0);
+	
+	total_ns = now_ns() - start;
+	
+	__atomic_store_n(&stop_reload, 1, __ATOMIC_RELAXED);
+	if (r == 0)
+		pthread_join(reloader, 0);
+	changes = __atomic_load_n(&n_changes, __ATOMIC_RELAXED);
+	
+	pthread_barrier_destroy(&start_barrier);
+	
+	// the latencies of all threads are stored one after another
+	n = 0;
+	hits = 0;
+	enums = 0;
+	enum_ns = 0;
+	for (i=0; i < n_threads; i++) {
+		memmove(latencies + n, workers[i].latencies, sizeof(uint64_t) * workers[i].n_latencies);
+		n += workers[i].n_latencies;
+		hits += workers[i].n_hits;
+		enums += workers[i].n_enums;
+		enum_ns += workers[i].enum_ns;
+	}
+	
+	qsort(latencies, n, sizeof(uint64_t), cmp_u64);
+	
+	printf("%7u %12.0f %9.2f %9.2f %9.2f %9.2f %7lu %10.2f %7lu\n", n_threads,
+		(n + enums) / (total_ns / 1e9), n ? (double) hits / n : 0.0,
+		n ? latencies[n / 2] / 1e3 : 0.0, n ? latencies[n * 99 / 100] / 1e3 : 0.0, n ? latencies[n * 999 / 1000] / 1e3 : 0.0,
+		enums, enums ? enum_ns / 1e6 / enums : 0.0, changes);
+	fflush(stdout);
+	
+	free(workers);
+	free(latencies);
+	
+	if (hung) {
+		fprintf(stderr, "%lu of %lu forked children did not exit\n", hung, config.n_forks);
+		return -ETIMEDOUT;
+	}
+	
+	return 0;
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options] <libnss_confd.so.2>\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -t <number>  maximum number of threads (default: number of CPUs)\n");
+	printf("  -u <number>  number of users and groups (default: 10000)\n");
+	printf("  -n <number>  operations per thread (default: 100000)\n");
+	printf("  -m <number>  percentage of lookups of unknown ids (default: 10)\n");
+	printf("  -e <number>  enumerate the users every <number> operations, 0 disables (default: 20000)\n");
+	printf("  -r <number>  change the directories every <number> ms, 0 disables (default: 50)\n");
+	printf("  -f <number>  fork <number> children per run that call setpwent() and endpwent() (default: 0)\n");
+}
+
+int main(int argc, char **argv) {
+	struct dataset ds;
+	char path[4096];
+	unsigned int n_threads, max_threads;
+	void *handle;
+	long n_cpus;
+	int c, r;
+	
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	max_threads = n_cpus > 0 ? n_cpus : 1;
+	config.n_entries = 10000;
+	config.n_ops = 100000;
+	config.miss_percent = 10;
+	config.enum_every = 20000;
+	config.reload_ms = 50;
+	
+	while ((c = getopt(argc, argv, "ht:u:n:m:e:r:f:")) != -1) {
+		switch (c) {
+			case 't': max_threads = strtoul(optarg, 0, 0); break;
+			case 'u': config.n_entries = strtoul(optarg, 0, 0); break;
+			case 'n': config.n_ops = strtoul(optarg, 0, 0); break;
+			case 'm': config.miss_percent = strtoul(optarg, 0, 0); break;
+			case 'e': config.enum_every = strtoul(optarg, 0, 0); break;
+			case 'r': config.reload_ms = strtoul(optarg, 0, 0); break;
+			case 'f': config.n_forks = strtoul(optarg, 0, 0); break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if (max_threads == 0 || config.n_entries == 0 || config.n_ops == 0 || config.miss_percent > 100) {
+		fprintf(stderr, "invalid number of threads, users or operations\n");
+		return 1;
+	}
+	
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "cannot create a temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	// spread the users and groups over up to $N_FILES files, the unknown ids start after the last one
+	ds.databases = DATASET_PASSWD | DATASET_GROUP;
+	ds.n_per_file = (config.n_entries + N_FILES - 1) / N_FILES;
+	ds.n_files = (config.n_entries + ds.n_per_file - 1) / ds.n_per_file;
+	ds.n_members = 2;
+	ds.n_lines = 0;
+	config.n_entries = ds.n_files * ds.n_per_file;
+	
+	r = create_dataset(root, &ds);
+	if (r) {
+		fprintf(stderr, "cannot create the dataset: %s\n", strerror(-r));
+		remove_dataset(root);
+		return 1;
+	}
+	
+	snprintf(path, sizeof(path), "%s/passwd.d", root);
+	setenv("NSS_CONFD_PASSWD_DIR", path, 1);
+	snprintf(path, sizeof(path), "%s/group.d", root);
+	setenv("NSS_CONFD_GROUP_DIR", path, 1);
+	
+	// measure the module in this process only and load the databases again after changes
+	setenv("NSS_CONFD_PASSWD_INDEX", "", 1);
+	setenv("NSS_CONFD_GROUP_INDEX", "", 1);
+	setenv("NSS_CONFD_SOCKET", "", 1);
+	unsetenv("NSS_CONFD_SHM");
+	if (config.reload_ms && !getenv("NSS_CONFD_WATCH"))
+		setenv("NSS_CONFD_WATCH", "1", 1);
+	
+	handle = dlopen(argv[optind], RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "cannot load \"%s\": %s\n", argv[optind], dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	getpwuid_r_fn = (getpwuid_r_t) dlsym(handle, "_nss_confd_getpwuid_r");
+	getgrgid_r_fn = (getgrgid_r_t) dlsym(handle, "_nss_confd_getgrgid_r");
+	setpwent_fn = (setpwent_t) dlsym(handle, "_nss_confd_setpwent");
+	getpwent_r_fn = (getpwent_r_t) dlsym(handle, "_nss_confd_getpwent_r");
+	endpwent_fn = (endpwent_t) dlsym(handle, "_nss_confd_endpwent");
+	if (!getpwuid_r_fn || !getgrgid_r_fn || !setpwent_fn || !getpwent_r_fn || !endpwent_fn) {
+		fprintf(stderr, "cannot find the lookup functions: %s\n", dlerror());
+		remove_dataset(root);
+		return 1;
+	}
+	
+	printf("%lu users and groups, %lu operations per thread, %u%% misses, enumeration every %lu operations, reload every %lu ms\n",
+		config.n_entries, config.n_ops, config.miss_percent, config.enum_every, config.reload_ms);
+	printf("%7s %12s %9s %9s %9s %9s %7s %10s %7s\n", "threads", "ops/s", "hit rate", "p50 us", "p99 us", "p999 us", "enums", "enum ms", "changes");
+	
+	r = 0;
+	for (n_threads = 1; r == 0; n_threads *= 2) {
+		if (n_threads > max_threads)
+			n_threads = max_threads;
+		
+		r = run(n_threads);
+		
+		if (n_threads == max_threads)
+			break;
+	}
+	
+	if (r)
+		fprintf(stderr, "cannot run the benchmark: %s\n", strerror(-r));
+	
+	remove_dataset(root);
+	
+	return r ? 1 : 0;
+}
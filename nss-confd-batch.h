@@ -0,0 +1,47 @@
+/*
+ * nss-confd-batch
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This header declares the functions of libnss_confd.so.2 that resolve many
+ * uids, gids or names with one call, e.g., for tools that list the owners of
+ * many files. They only look into the directories of nss-confd and bypass
+ * /etc/nsswitch.conf, other NSS modules and nscd.
+ * 
+ * All functions return 0 or a negative errno, -ENOENT if the directory
+ * cannot be loaded.
+ * 
+ */
+
+#ifndef NSS_CONFD_BATCH_H
+#define NSS_CONFD_BATCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the id of a name that was not found
+#define NSS_CONFD_NO_ID ((id_t) -1)
+
+/*
+ * Sets *names to a malloc'ed array of $n pointers followed by the names,
+ * which the caller frees with a single free(). The pointer of an unknown id
+ * is 0.
+ */
+extern int _nss_confd_uids_to_names(const uid_t *uids, size_t n, char ***names);
+extern int _nss_confd_gids_to_names(const gid_t *gids, size_t n, char ***names);
+
+// sets the id of an unknown name to NSS_CONFD_NO_ID
+extern int _nss_confd_names_to_uids(const char *const *names, size_t n, uid_t *uids);
+extern int _nss_confd_names_to_gids(const char *const *names, size_t n, gid_t *gids);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
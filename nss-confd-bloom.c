@@ -0,0 +1,124 @@
+/*
+ * nss-confd-bloom
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file implements a blocked Bloom filter over the key hashes of a
+ * database. As nss-confd usually comes before other services in
+ * nsswitch.conf, most lookups are misses. The filter rejects most of them
+ * after reading a single cache line of a table that is much smaller than the
+ * hash tables and the records.
+ * 
+ * Every key sets BLOOM_K bits in one block of 512 bits, i.e. one cache line,
+ * that is selected by its hash. With about 10 bits per key, about 1% of the
+ * misses still have to search the hash tables.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+#define BLOOM_K 6
+#define BLOOM_BITS_PER_KEY 10
+
+static uint64_t bloom_mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	
+	return x;
+}
+
+// returns the number of blocks of a filter for $n_keys keys, a power of two
+uint32_t bloom_blocks(size_t n_keys) {
+	uint32_t n_blocks;
+	
+	n_blocks = 1;
+	while ((uint64_t) n_blocks * BLOOM_BLOCK_WORDS * 64 < (uint64_t) n_keys * BLOOM_BITS_PER_KEY && n_blocks < (1u << 31))
+		n_blocks *= 2;
+	
+	return n_blocks;
+}
+
+int bloom_init(struct bloom *bloom, size_t n_keys) {
+	bloom->n_blocks = bloom_blocks(n_keys);
+	
+	bloom->bits = (uint64_t *) calloc((size_t) bloom->n_blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+	if (!bloom->bits) {
+		if (log_level >= LL_ERROR)
+			ERROR("calloc(%zu) failed: %s\n", (size_t) bloom->n_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t), strerror(errno));
+		
+		bloom->n_blocks = 0;
+		
+		return -ENOMEM;
+	}
+	
+	return 0;
+}
+
+void bloom_free(struct bloom *bloom) {
+	free(bloom->bits);
+	
+	bloom->bits = 0;
+	bloom->n_blocks = 0;
+}
+
+void bloom_add(struct bloom *bloom, uint64_t hash) {
+	uint64_t *block, g;
+	unsigned int i;
+	
+	if (bloom->n_blocks == 0)
+		return;
+	
+	g = bloom_mix(hash);
+	block = &bloom->bits[(size_t) ((uint32_t) g & (bloom->n_blocks - 1)) * BLOOM_BLOCK_WORDS];
+	
+	// a second mix selects the bits within the block
+	g = bloom_mix(g);
+	for (i=0; i < BLOOM_K; i++) {
+		block[(g >> 6) & (BLOOM_BLOCK_WORDS - 1)] |= (uint64_t) 1 << (g & 63);
+		g >>= 9;
+	}
+}
+
+// returns 0 if no key with $hash was added, a filter without blocks contains every key
+int bloom_check(const struct bloom *bloom, uint64_t hash) {
+	const uint64_t *block;
+	uint64_t g;
+	unsigned int i;
+	
+	if (bloom->n_blocks == 0)
+		return 1;
+	
+	g = bloom_mix(hash);
+	block = &bloom->bits[(size_t) ((uint32_t) g & (bloom->n_blocks - 1)) * BLOOM_BLOCK_WORDS];
+	
+	g = bloom_mix(g);
+	for (i=0; i < BLOOM_K; i++) {
+		if (!(block[(g >> 6) & (BLOOM_BLOCK_WORDS - 1)] & ((uint64_t) 1 << (g & 63))))
+			return 0;
+		g >>= 9;
+	}
+	
+	return 1;
+}
+
+// loads the block of $hash into the cache, e.g., while a batch looks up the previous keys
+void bloom_prefetch(const struct bloom *bloom, uint64_t hash) {
+	if (bloom->n_blocks == 0)
+		return;
+	
+	__builtin_prefetch(&bloom->bits[(size_t) ((uint32_t) bloom_mix(hash) & (bloom->n_blocks - 1)) * BLOOM_BLOCK_WORDS]);
+}
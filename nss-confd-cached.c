@@ -0,0 +1,662 @@
+/*
+ * nss-confd-cached
+ * ----------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This daemon keeps the databases loaded and answers the lookups of the
+ * nss-confd modules over a local UNIX socket. Processes that use the daemon
+ * neither have to scan the directories nor map a compiled database.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+#include <shadow.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nss-confd.h"
+
+extern enum nss_status _nss_confd_setpwent(void);
+extern enum nss_status _nss_confd_endpwent(void);
+extern enum nss_status _nss_confd_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status _nss_confd_getpwnam_r(const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status _nss_confd_setgrent(void);
+extern enum nss_status _nss_confd_endgrent(void);
+extern enum nss_status _nss_confd_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status _nss_confd_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status _nss_confd_getgrnam_r(const char *name, struct group *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status _nss_confd_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size, gid_t **groupsp, long int limit, int *errnop);
+extern enum nss_status _nss_confd_setspent(void);
+extern enum nss_status _nss_confd_endspent(void);
+extern enum nss_status _nss_confd_getspnam_r(const char *name, struct spwd *result, char *buffer, size_t buflen, int *errnop);
+
+struct database {
+	const char *name;
+	const char *dir_env;
+	const char *dir;
+	enum nss_status (*endent)(void);
+	
+	const char *dirpath;
+	uint32_t dir_hash;
+	struct stat dir_stat;
+	struct watch watch;
+};
+
+static struct database databases[] = {
+	[CACHED_PASSWD] = { "passwd", "NSS_CONFD_PASSWD_DIR", PASSWD_DIR, _nss_confd_endpwent },
+	[CACHED_GROUP] = { "group", "NSS_CONFD_GROUP_DIR", GROUP_DIR, _nss_confd_endgrent },
+	[CACHED_SHADOW] = { "shadow", "NSS_CONFD_SHADOW_DIR", SHADOW_DIR, _nss_confd_endspent },
+};
+#define N_DATABASES (sizeof(databases) / sizeof(databases[0]))
+
+// the default limit of connected clients, the idle client of longest standing is closed for a new one
+#define MAX_CLIENTS 1024
+// how long accepting pauses if the daemon ran out of descriptors and no client closed its connection
+#define ACCEPT_PAUSE_MS 1000
+
+struct client {
+	int fd;
+	uid_t uid;
+	
+	// the number of the last request or of the connection, the lowest one is idle the longest
+	uint64_t last_used;
+};
+
+// the output of the NSS functions and the response that is sent to the client
+static char *buffer;
+static size_t buffer_size;
+static char *out;
+static size_t out_size, out_alloc;
+
+static volatile sig_atomic_t reload;
+static volatile sig_atomic_t terminate;
+
+static void unload(struct database *db) {
+	db->endent();
+	memset(&db->dir_stat, 0, sizeof(struct stat));
+}
+
+// drops a database if its directory changed, the module loads it again on the next lookup
+static void check_database(struct database *db) {
+	struct stat st;
+	
+	if (db->watch.fd >= 0) {
+		if (!watch_changed(&db->watch))
+			return;
+		
+		if (log_level >= LL_DBG)
+			DBG("reloading %s\n", db->name);
+		
+		unload(db);
+		
+		return;
+	}
+	
+	// without inotify, we only notice files that are added or removed
+	if (stat(db->dirpath, &st) == -1)
+		memset(&st, 0, sizeof(struct stat));
+	
+	if (st.st_ino == db->dir_stat.st_ino &&
+		st.st_mtim.tv_sec == db->dir_stat.st_mtim.tv_sec &&
+		st.st_mtim.tv_nsec == db->dir_stat.st_mtim.tv_nsec)
+	{
+		return;
+	}
+	
+	if (log_level >= LL_DBG)
+		DBG("reloading %s\n", db->name);
+	
+	unload(db);
+	db->dir_stat = st;
+}
+
+static int out_reserve(size_t size) {
+	char *new_out;
+	size_t alloc;
+	
+	if (out_size + size <= out_alloc)
+		return 0;
+	
+	alloc = out_alloc ? out_alloc : 4096;
+	while (alloc < out_size + size)
+		alloc *= 2;
+	
+	new_out = (char *) realloc(out, alloc);
+	if (!new_out)
+		return -ENOMEM;
+	
+	out = new_out;
+	out_alloc = alloc;
+	
+	return 0;
+}
+
+static int out_printf(const char *fmt, ...) {
+	va_list ap;
+	int len;
+	
+	va_start(ap, fmt);
+	len = vsnprintf(0, 0, fmt, ap);
+	va_end(ap);
+	
+	if (len < 0 || out_reserve(len + 1))
+		return -ENOMEM;
+	
+	va_start(ap, fmt);
+	vsnprintf(out + out_size, len + 1, fmt, ap);
+	va_end(ap);
+	
+	out_size += len;
+	
+	return 0;
+}
+
+static int grow_buffer(void) {
+	char *new_buffer;
+	size_t size;
+	
+	size = buffer_size ? buffer_size * 2 : 4096;
+	
+	new_buffer = (char *) realloc(buffer, size);
+	if (!new_buffer)
+		return -ENOMEM;
+	
+	buffer = new_buffer;
+	buffer_size = size;
+	
+	return 0;
+}
+
+// converts a nss_status into the status of a response
+static int nss_result(enum nss_status status, int err) {
+	if (status == NSS_STATUS_SUCCESS)
+		return 0;
+	if (status == NSS_STATUS_NOTFOUND)
+		return -ENOENT;
+	if (status == NSS_STATUS_TRYAGAIN && err == ERANGE)
+		return -ERANGE;
+	
+	return -EIO;
+}
+
+static int lookup_passwd(struct cached_request *request, const char *key) {
+	struct passwd pw;
+	enum nss_status status;
+	int err, r;
+	
+	do {
+		if (request->type == CACHED_BY_NAME)
+			status = _nss_confd_getpwnam_r(key, &pw, buffer, buffer_size, &err);
+		else
+			status = _nss_confd_getpwuid_r(request->id, &pw, buffer, buffer_size, &err);
+		
+		r = nss_result(status, err);
+	} while (r == -ERANGE && grow_buffer() == 0);
+	
+	if (r)
+		return r;
+	
+	return out_printf("%s:%s:%u:%u:%s:%s:%s", pw.pw_name, pw.pw_passwd, pw.pw_uid, pw.pw_gid, pw.pw_gecos, pw.pw_dir, pw.pw_shell);
+}
+
+static int lookup_group(struct cached_request *request, const char *key) {
+	struct group gr;
+	enum nss_status status;
+	char **member;
+	int err, r;
+	
+	do {
+		if (request->type == CACHED_BY_NAME)
+			status = _nss_confd_getgrnam_r(key, &gr, buffer, buffer_size, &err);
+		else
+			status = _nss_confd_getgrgid_r(request->id, &gr, buffer, buffer_size, &err);
+		
+		r = nss_result(status, err);
+	} while (r == -ERANGE && grow_buffer() == 0);
+	
+	if (r)
+		return r;
+	
+	r = out_printf("%s:%s:%u:", gr.gr_name, gr.gr_passwd, gr.gr_gid);
+	for (member = gr.gr_mem; r == 0 && *member; member++)
+		r = out_printf(member == gr.gr_mem ? "%s" : ",%s", *member);
+	
+	return r;
+}
+
+// prints a numeric field of struct spwd, -1 stands for an empty field
+static int out_long(long value, const char *sep) {
+	if (value == -1)
+		return out_printf("%s", sep);
+	
+	return out_printf("%ld%s", value, sep);
+}
+
+static int lookup_shadow(struct cached_request *request, const char *key) {
+	struct spwd sp;
+	enum nss_status status;
+	int err, r;
+	
+	if (request->type != CACHED_BY_NAME)
+		return -EINVAL;
+	
+	do {
+		status = _nss_confd_getspnam_r(key, &sp, buffer, buffer_size, &err);
+		
+		r = nss_result(status, err);
+	} while (r == -ERANGE && grow_buffer() == 0);
+	
+	if (r)
+		return r;
+	
+	r = out_printf("%s:%s:", sp.sp_namp, sp.sp_pwdp);
+	if (r == 0) r = out_long(sp.sp_lstchg, ":");
+	if (r == 0) r = out_long(sp.sp_min, ":");
+	if (r == 0) r = out_long(sp.sp_max, ":");
+	if (r == 0) r = out_long(sp.sp_warn, ":");
+	if (r == 0) r = out_long(sp.sp_inact, ":");
+	if (r == 0) r = out_long(sp.sp_expire, ":");
+	if (r == 0) r = out_long(sp.sp_flag, "");
+	
+	return r;
+}
+
+// the module keeps an index from every member to its groups, hence this does not enumerate the groups
+static int lookup_initgroups(const char *user) {
+	enum nss_status status;
+	gid_t *groups;
+	long int start, size, i;
+	uint32_t gid;
+	int err, r;
+	
+	start = 0;
+	size = 64;
+	groups = (gid_t *) malloc(size * sizeof(gid_t));
+	if (!groups)
+		return -ENOMEM;
+	
+	// no gid is excluded as the client passes its primary group to the module itself
+	status = _nss_confd_initgroups_dyn(user, (gid_t) -1, &start, &size, &groups, 0, &err);
+	
+	r = nss_result(status, err);
+	if (r == -ENOENT)
+		r = 0;
+	
+	for (i=0; r == 0 && i < start; i++) {
+		r = out_reserve(sizeof(uint32_t));
+		if (r)
+			break;
+		
+		gid = groups[i];
+		memcpy(out + out_size, &gid, sizeof(uint32_t));
+		out_size += sizeof(uint32_t);
+	}
+	
+	free(groups);
+	
+	return r;
+}
+
+static int handle_request(struct client *client, char *msg, size_t size) {
+	struct cached_request *request;
+	struct cached_response *response;
+	struct database *db;
+	char key[CACHED_MAX_KEY + 1];
+	size_t key_len;
+	int r;
+	
+	out_size = 0;
+	if (out_reserve(sizeof(struct cached_response)))
+		return -ENOMEM;
+	out_size = sizeof(struct cached_response);
+	
+	request = (struct cached_request *) msg;
+	key_len = size - sizeof(struct cached_request);
+	
+	if (size < sizeof(struct cached_request) || key_len > CACHED_MAX_KEY || request->version != CACHED_VERSION || request->db >= N_DATABASES) {
+		r = -EPROTO;
+		goto send;
+	}
+	
+	key_len = size - sizeof(struct cached_request);
+	memcpy(key, msg + sizeof(struct cached_request), key_len);
+	key[key_len] = 0;
+	
+	db = &databases[request->db];
+	
+	// the client uses a different directory, it has to look it up itself
+	if (request->dir_hash != db->dir_hash) {
+		r = -EXDEV;
+		goto send;
+	}
+	
+	// only root can read the shadow database through us
+	if (request->db == CACHED_SHADOW && client->uid != 0) {
+		r = -EACCES;
+		goto send;
+	}
+	
+	if ((request->type == CACHED_BY_NAME || request->type == CACHED_INITGROUPS) && (key_len == 0 || strlen(key) != key_len)) {
+		r = -EINVAL;
+		goto send;
+	}
+	
+	check_database(db);
+	
+	switch (request->type) {
+		case CACHED_BY_NAME:
+		case CACHED_BY_ID:
+			if (request->db == CACHED_PASSWD)
+				r = lookup_passwd(request, key);
+			else if (request->db == CACHED_GROUP)
+				r = lookup_group(request, key);
+			else
+				r = lookup_shadow(request, key);
+			break;
+		case CACHED_INITGROUPS:
+			if (request->db == CACHED_GROUP)
+				r = lookup_initgroups(key);
+			else
+				r = -EINVAL;
+			break;
+		default:
+			r = -EINVAL;
+	}
+	
+send:
+	if (r)
+		out_size = sizeof(struct cached_response);
+	
+	response = (struct cached_response *) out;
+	response->status = r;
+	response->size = out_size - sizeof(struct cached_response);
+	
+	if (send(client->fd, out, out_size, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		return -errno;
+	
+	return 0;
+}
+
+static int create_socket(const char *path) {
+	struct sockaddr_un addr;
+	char *dir, *slash;
+	int fd;
+	
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path \"%s\" is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	
+	// create the directory of the socket, e.g. /run/nss-confd
+	dir = strdup(path);
+	if (dir) {
+		slash = strrchr(dir, '/');
+		if (slash && slash != dir) {
+			*slash = 0;
+			if (mkdir(dir, 0755) && errno != EEXIST)
+				fprintf(stderr, "cannot create \"%s\": %s\n", dir, strerror(errno));
+		}
+		free(dir);
+	}
+	
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	
+	unlink(path);
+	
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) ||
+		chmod(path, 0666) ||
+		listen(fd, 128))
+	{
+		fprintf(stderr, "cannot listen on \"%s\": %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+static void handle_signal(int sig) {
+	if (sig == SIGHUP)
+		reload = 1;
+	else
+		terminate = 1;
+}
+
+int main(int argc, char **argv) {
+	struct sigaction sa;
+	struct pollfd *pfds;
+	struct client *clients;
+	const char *path;
+	char *msg;
+	size_t i, n_clients, clients_alloc, max_clients, msg_alloc;
+	uint64_t seq;
+	ssize_t len;
+	int listen_fd, accepting, debounce, c, r;
+	
+	path = cached_socket_path();
+	max_clients = MAX_CLIENTS;
+	
+	while ((c = getopt(argc, argv, "hs:c:")) != -1) {
+		switch (c) {
+			case 's':
+				path = optarg;
+				break;
+			case 'c':
+				max_clients = strtoul(optarg, 0, 0);
+				break;
+			default:
+				printf("Usage: %s [-s socket] [-c max clients]\n", argv[0]);
+				printf("\n");
+				printf("Answers the lookups of the nss-confd module over a UNIX socket.\n");
+				printf("At most <max clients> (default: %d) clients stay connected.\n", MAX_CLIENTS);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (max_clients == 0) {
+		fprintf(stderr, "invalid number of clients\n");
+		return 1;
+	}
+	
+	if (!path) {
+		fprintf(stderr, "no socket path given\n");
+		return 1;
+	}
+	
+	// we are the daemon and publish the copies in NSS_CONFD_SHM for the processes that do not ask us
+	cached_enabled = 0;
+	shm_publish = 1;
+	
+	if (getenv("NSS_CONFD_DEBUG")) {
+		long long value;
+		
+		if (parse_llong(getenv("NSS_CONFD_DEBUG"), &value) == 0)
+			log_level = value;
+	}
+	
+	// we are long-running, hence we always watch the directories
+	debounce = watch_debounce();
+	if (debounce < 0)
+		debounce = 100;
+	
+	for (i=0; i < N_DATABASES; i++) {
+		databases[i].dirpath = getenv(databases[i].dir_env);
+		if (!databases[i].dirpath)
+			databases[i].dirpath = databases[i].dir;
+		
+		databases[i].dir_hash = index_hash_dir(databases[i].dirpath);
+		
+		databases[i].watch.fd = -1;
+		watch_init(&databases[i].watch, databases[i].dirpath, debounce);
+	}
+	
+	if (grow_buffer())
+		return 1;
+	
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGHUP, &sa, 0);
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	signal(SIGPIPE, SIG_IGN);
+	
+	listen_fd = create_socket(path);
+	if (listen_fd < 0)
+		return 1;
+	
+	// pfds[0] is the listening socket, pfds[i+1] belongs to clients[i]
+	n_clients = 0;
+	seq = 0;
+	accepting = 1;
+	clients_alloc = 16;
+	clients = (struct client *) malloc(sizeof(struct client) * clients_alloc);
+	pfds = (struct pollfd *) malloc(sizeof(struct pollfd) * (clients_alloc + 1));
+	msg_alloc = sizeof(struct cached_request) + CACHED_MAX_KEY;
+	msg = (char *) malloc(msg_alloc);
+	if (!clients || !pfds || !msg) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	
+	while (!terminate) {
+		if (reload) {
+			reload = 0;
+			
+			for (i=0; i < N_DATABASES; i++)
+				unload(&databases[i]);
+		}
+		
+		// poll() ignores the listening socket while accepting is paused
+		pfds[0].fd = accepting ? listen_fd : -1;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		for (i=0; i < n_clients; i++) {
+			pfds[i+1].fd = clients[i].fd;
+			pfds[i+1].events = POLLIN;
+		}
+		
+		r = poll(pfds, n_clients + 1, accepting ? -1 : ACCEPT_PAUSE_MS);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			break;
+		}
+		if (r == 0)
+			accepting = 1;
+		
+		for (i=n_clients; i > 0; i--) {
+			struct client *client = &clients[i-1];
+			
+			if (!pfds[i].revents)
+				continue;
+			
+			len = -1;
+			if (pfds[i].revents & POLLIN)
+				len = recv(client->fd, msg, msg_alloc, MSG_DONTWAIT | MSG_TRUNC);
+			
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			
+			client->last_used = ++seq;
+			
+			if (len <= 0 || handle_request(client, msg, len)) {
+				close(client->fd);
+				clients[i-1] = clients[n_clients-1];
+				n_clients -= 1;
+				accepting = 1;
+			}
+		}
+		
+		if (pfds[0].revents & POLLIN) {
+			struct ucred cred;
+			socklen_t cred_len;
+			int fd;
+			
+			fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+			if (fd < 0) {
+				// the connection stays pending, retrying right away would spin until a descriptor is free
+				if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+					if (log_level >= LL_DBG)
+						DBG("accept() failed: %s, pausing\n", strerror(errno));
+					accepting = 0;
+				}
+				continue;
+			}
+			
+			cred_len = sizeof(struct ucred);
+			if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len)) {
+				close(fd);
+				continue;
+			}
+			
+			// the client reconnects once if its connection was closed
+			if (n_clients >= max_clients) {
+				size_t oldest = 0;
+				
+				for (i=1; i < n_clients; i++)
+					if (clients[i].last_used < clients[oldest].last_used)
+						oldest = i;
+				
+				if (log_level >= LL_DBG)
+					DBG("closing the idle connection of uid %u, %zu clients\n", (unsigned int) clients[oldest].uid, n_clients);
+				
+				close(clients[oldest].fd);
+				clients[oldest] = clients[n_clients-1];
+				n_clients -= 1;
+			}
+			
+			if (n_clients == clients_alloc) {
+				struct client *new_clients;
+				struct pollfd *new_pfds;
+				
+				new_clients = (struct client *) realloc(clients, sizeof(struct client) * clients_alloc * 2);
+				if (new_clients)
+					clients = new_clients;
+				new_pfds = (struct pollfd *) realloc(pfds, sizeof(struct pollfd) * (clients_alloc * 2 + 1));
+				if (new_pfds)
+					pfds = new_pfds;
+				
+				if (!new_clients || !new_pfds) {
+					close(fd);
+					continue;
+				}
+				
+				clients_alloc *= 2;
+			}
+			
+			clients[n_clients].fd = fd;
+			clients[n_clients].uid = cred.uid;
+			clients[n_clients].last_used = ++seq;
+			n_clients += 1;
+		}
+	}
+	
+	unlink(path);
+	
+	return 0;
+}
@@ -0,0 +1,1656 @@
+/*
+ * nss-confd-cdb
+ * -------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file implements the compiled database: a single file that contains the
+ * already parsed records of a directory together with minimal perfect hash
+ * tables for the names and ids. nss-confd-mkindex creates it and the modules
+ * use it instead of scanning the directory as long as the directory and the
+ * files in it did not change.
+ * 
+ * The records are encoded in groups of CDB_RESTART_INTERVAL records. Values that
+ * occur often are interned in a dictionary, the other strings are front-coded
+ * against the first record of their group and numbers are stored as the
+ * difference to it, see parse_fields(). Decoding a record only has to look at
+ * its group and writes the strings directly into the buffer of the caller.
+ * 
+ * For the group database, a sorted array maps every member to the records of
+ * the groups that list it, which answers initgroups_dyn() without reading all
+ * records.
+ * 
+ * A Bloom filter for the names and one for the ids reject most unknown keys
+ * before the perfect hash tables and the records are read.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "nss-confd.h"
+
+// can be disabled by nss-confd-mkindex which needs the records from the directory
+int cdb_enabled = 1;
+
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	
+	return x;
+}
+
+static uint64_t cdb_hash_name(const char *name, size_t len, uint64_t seed) {
+	uint64_t hash;
+	size_t i;
+	
+	hash = 14695981039346656037ull ^ seed;
+	for (i=0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 1099511628211ull;
+	}
+	
+	return mix64(hash);
+}
+
+static uint64_t cdb_hash_id(id_t id, uint64_t seed) {
+	return mix64((uint64_t) id ^ seed);
+}
+
+// maps a key hash to its slot, see mphf_build() for details
+static uint32_t mphf_slot(uint64_t hash, uint32_t n_buckets, uint32_t n_slots, struct cdb_disp *disp) {
+	uint64_t g;
+	uint32_t bucket, f1, f2;
+	
+	g = mix64(hash);
+	bucket = (uint32_t) (hash >> 32) % n_buckets;
+	f1 = (uint32_t) g % n_slots;
+	f2 = (uint32_t) (g >> 32) % n_slots;
+	
+	return ((uint64_t) f1 + (uint64_t) disp[bucket].d0 * f2 + disp[bucket].d1) % n_slots;
+}
+
+static const char *db_section(struct cdb *cdb, uint64_t offset, uint64_t n, size_t size) {
+	if (offset > cdb->size || offset % 8 || (cdb->size - offset) / size < n)
+		return 0;
+	
+	return cdb->data + offset;
+}
+
+// returns the malloc'ed path of the compiled database or 0 if disabled
+char *cdb_path(const char *path, const char *dirpath) {
+	char *result;
+	size_t len;
+	
+	if (path) {
+		if (path[0] == 0)
+			return 0;
+		
+		return strdup(path);
+	}
+	
+	// "/etc/passwd.d/" -> "/etc/passwd.d.index"
+	len = strlen(dirpath);
+	while (len > 1 && dirpath[len-1] == '/')
+		len -= 1;
+	
+	if (asprintf(&result, "%.*s.index", (int) len, dirpath) < 0)
+		return 0;
+	
+	return result;
+}
+
+// returns 0 if the directory and all files are still in the state the database was compiled from
+static int cdb_verify(struct cdb *cdb, const char *dirpath) {
+	struct stat st;
+	uint32_t i;
+	char *verify;
+	int dirfd;
+	
+	dirfd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return -errno;
+	
+	if (fstat(dirfd, &st) == -1 ||
+		(uint64_t) st.st_ino != cdb->header->dir_ino ||
+		(uint64_t) st.st_mtim.tv_sec != cdb->header->dir_mtime_sec ||
+		(uint64_t) st.st_mtim.tv_nsec != cdb->header->dir_mtime_nsec)
+	{
+		if (log_level >= LL_DBG)
+			DBG("directory \"%s\" changed since the index was created\n", dirpath);
+		
+		close(dirfd);
+		return -ESTALE;
+	}
+	
+	// changes to the content of a file do not update the mtime of the directory
+	verify = secure_getenv("NSS_CONFD_INDEX_VERIFY");
+	if (verify && !strcmp(verify, "dir")) {
+		close(dirfd);
+		return 0;
+	}
+	
+	for (i=0; i < cdb->header->n_files; i++) {
+		struct cdb_file *file = &cdb->files[i];
+		
+		if (file->name >= cdb->header->strings_size || memchr(cdb->strings + file->name, 0, cdb->header->strings_size - file->name) == 0) {
+			close(dirfd);
+			return -EINVAL;
+		}
+		
+		if (fstatat(dirfd, cdb->strings + file->name, &st, 0) == -1 ||
+			(uint64_t) st.st_ino != file->ino ||
+			(uint64_t) st.st_size != file->size ||
+			(uint64_t) st.st_mtim.tv_sec != file->mtime_sec ||
+			(uint64_t) st.st_mtim.tv_nsec != file->mtime_nsec)
+		{
+			if (log_level >= LL_DBG)
+				DBG("file \"%s\" changed since the index was created\n", cdb->strings + file->name);
+			
+			close(dirfd);
+			return -ESTALE;
+		}
+	}
+	
+	close(dirfd);
+	
+	return 0;
+}
+
+/*
+ * Maps the compiled database $path and checks if it belongs to the database $db
+ * and if it is still up to date with $dirpath.
+ */
+int cdb_open(struct cdb *cdb, const char *path, const char *db, unsigned int n_fields, const char *dirpath) {
+	struct cdb_header *header;
+	struct stat st;
+	int fd, r;
+	
+	memset(cdb, 0, sizeof(struct cdb));
+	
+	if (!cdb_enabled)
+		return -ENOENT;
+	
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	
+	if (fstat(fd, &st) == -1) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+	
+	// do not trust an index that could have been modified by someone else
+	if ((st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		if (log_level >= LL_ERROR)
+			ERROR("ignoring index \"%s\" with unsafe owner or mode\n", path);
+		
+		close(fd);
+		return -EPERM;
+	}
+	
+	if ((size_t) st.st_size < sizeof(struct cdb_header)) {
+		close(fd);
+		return -EINVAL;
+	}
+	
+	cdb->data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cdb->data == MAP_FAILED) {
+		cdb->data = 0;
+		return -errno;
+	}
+	cdb->size = st.st_size;
+	
+	header = (struct cdb_header *) cdb->data;
+	cdb->header = header;
+	
+	if (memcmp(header->magic, CDB_MAGIC, sizeof(header->magic)) ||
+		header->version != CDB_VERSION ||
+		strncmp(header->db, db, sizeof(header->db)) ||
+		header->n_fields != n_fields ||
+		header->n_fields > DB_MAX_FIELDS ||
+		header->id_field >= (int32_t) n_fields ||
+		header->list_field >= (int32_t) n_fields ||
+		(header->id_field < 0 && header->n_ids > 0) ||
+		((header->list_field < 0 || header->id_field < 0) && header->n_members > 0) ||
+		header->size != cdb->size)
+	{
+		if (log_level >= LL_ERROR)
+			ERROR("ignoring invalid index \"%s\"\n", path);
+		
+		cdb_close(cdb);
+		return -EINVAL;
+	}
+	
+	cdb->files = (struct cdb_file *) db_section(cdb, header->files_off, header->n_files, sizeof(struct cdb_file));
+	cdb->restarts = (uint32_t *) db_section(cdb, header->restarts_off, header->n_restarts, sizeof(uint32_t));
+	cdb->records = (const unsigned char *) db_section(cdb, header->records_off, header->records_size, 1);
+	cdb->dict = (struct cdb_string *) db_section(cdb, header->dict_off, header->n_dict, sizeof(struct cdb_string));
+	cdb->name_disp = (struct cdb_disp *) db_section(cdb, header->name_disp_off, header->n_name_buckets, sizeof(struct cdb_disp));
+	cdb->name_slots = (uint32_t *) db_section(cdb, header->name_slots_off, header->n_names, sizeof(uint32_t));
+	cdb->id_disp = (struct cdb_disp *) db_section(cdb, header->id_disp_off, header->n_id_buckets, sizeof(struct cdb_disp));
+	cdb->id_slots = (uint32_t *) db_section(cdb, header->id_slots_off, header->n_ids, sizeof(uint32_t));
+	cdb->members = (struct cdb_member *) db_section(cdb, header->members_off, header->n_members, sizeof(struct cdb_member));
+	cdb->name_bloom.bits = (uint64_t *) db_section(cdb, header->name_bloom_off, (uint64_t) header->n_name_blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+	cdb->name_bloom.n_blocks = header->n_name_blocks;
+	cdb->id_bloom.bits = (uint64_t *) db_section(cdb, header->id_bloom_off, (uint64_t) header->n_id_blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+	cdb->id_bloom.n_blocks = header->n_id_blocks;
+	cdb->strings = db_section(cdb, header->strings_off, header->strings_size, 1);
+	
+	if (!cdb->files || !cdb->restarts || !cdb->records || !cdb->dict || !cdb->name_disp || !cdb->name_slots || !cdb->id_disp || !cdb->id_slots || !cdb->members || !cdb->strings ||
+		!cdb->name_bloom.bits || !cdb->id_bloom.bits ||
+		header->n_restarts != (header->n_records + CDB_RESTART_INTERVAL - 1) / CDB_RESTART_INTERVAL ||
+		(header->n_name_blocks & (header->n_name_blocks - 1)) ||
+		(header->n_id_blocks & (header->n_id_blocks - 1)) ||
+		(header->n_names > 0 && header->n_name_buckets == 0) ||
+		(header->n_ids > 0 && header->n_id_buckets == 0))
+	{
+		if (log_level >= LL_ERROR)
+			ERROR("ignoring invalid index \"%s\"\n", path);
+		
+		cdb_close(cdb);
+		return -EINVAL;
+	}
+	
+	r = cdb_verify(cdb, dirpath);
+	if (r) {
+		cdb_close(cdb);
+		return r;
+	}
+	
+	if (log_level >= LL_DBG)
+		DBG("using index \"%s\" with %u records\n", path, header->n_records);
+	
+	return 0;
+}
+
+void cdb_close(struct cdb *cdb) {
+	if (cdb->data)
+		munmap(cdb->data, cdb->size);
+	
+	memset(cdb, 0, sizeof(struct cdb));
+}
+
+// a field of a record, a string consists of the prefix it shares with the first record of its group and the rest
+struct cdb_value {
+	const char *prefix;
+	const char *suffix;
+	uint32_t prefix_len;
+	uint32_t suffix_len;
+	int64_t value;
+};
+
+static uint64_t zigzag(int64_t value) {
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// reads a little-endian base-128 number at *pos and advances *pos
+static int read_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+	unsigned int shift;
+	
+	*value = 0;
+	for (shift=0; shift < 64; shift += 7) {
+		if (*pos >= end)
+			return -EINVAL;
+		
+		*value |= (uint64_t) (**pos & 0x7f) << shift;
+		if (!(*(*pos)++ & 0x80))
+			return 0;
+	}
+	
+	return -EINVAL;
+}
+
+/*
+ * Parses the fields of a record between $pos and $end. A numeric field is the
+ * zigzag-encoded difference to the same field of $first, the first record of
+ * the group, or to 0 for the first record itself. A string field starts with
+ * a tag: an odd tag is the index of an interned string in the dictionary
+ * shifted by one, an even tag is the length of the prefix shared with $first,
+ * shifted by one, which is followed by the length and the bytes of the rest.
+ */
+static int parse_fields(struct cdb *cdb, const unsigned char *pos, const unsigned char *end, struct cdb_value *first, struct cdb_value *values) {
+	struct cdb_string *string;
+	uint64_t tag, len;
+	unsigned int i;
+	
+	for (i=0; i < cdb->header->n_fields; i++) {
+		if (read_varint(&pos, end, &tag))
+			return -EINVAL;
+		
+		values[i].prefix = "";
+		values[i].prefix_len = 0;
+		values[i].suffix = "";
+		values[i].suffix_len = 0;
+		values[i].value = 0;
+		
+		if (cdb->header->numeric & (1 << i)) {
+			// the builder calculated the difference with the same wrap-around
+			values[i].value = (int64_t) ((uint64_t) unzigzag(tag) + (first ? (uint64_t) first[i].value : 0));
+			continue;
+		}
+		
+		if (tag & 1) {
+			if ((tag >> 1) >= cdb->header->n_dict)
+				return -EINVAL;
+			
+			string = &cdb->dict[tag >> 1];
+			if (string->str > cdb->header->strings_size || cdb->header->strings_size - string->str < string->len)
+				return -EINVAL;
+			
+			values[i].suffix = cdb->strings + string->str;
+			values[i].suffix_len = string->len;
+			continue;
+		}
+		
+		// the string of the first record of a group consists only of the "suffix"
+		if (tag >> 1) {
+			if (!first || (tag >> 1) > first[i].suffix_len)
+				return -EINVAL;
+			
+			values[i].prefix = first[i].suffix;
+			values[i].prefix_len = tag >> 1;
+		}
+		
+		if (read_varint(&pos, end, &len) || len > (uint64_t) (end - pos))
+			return -EINVAL;
+		
+		values[i].suffix = (const char *) pos;
+		values[i].suffix_len = len;
+		pos += len;
+	}
+	
+	return 0;
+}
+
+/*
+ * Parses the i-th record. Every record starts with its length, hence reaching
+ * it from the start of its group skips at most CDB_RESTART_INTERVAL - 1
+ * records after the first one.
+ */
+static int parse_record(struct cdb *cdb, uint32_t i, struct cdb_value *values) {
+	struct cdb_value first[DB_MAX_FIELDS];
+	const unsigned char *pos, *end;
+	uint32_t restart, k;
+	uint64_t len;
+	
+	if (i >= cdb->header->n_records)
+		return -ENOENT;
+	
+	restart = cdb->restarts[i / CDB_RESTART_INTERVAL];
+	if (restart >= cdb->header->records_size)
+		return -EINVAL;
+	
+	pos = cdb->records + restart;
+	end = cdb->records + cdb->header->records_size;
+	
+	for (k=0; ; k++) {
+		if (read_varint(&pos, end, &len) || len > (uint64_t) (end - pos))
+			return -EINVAL;
+		
+		if (k == i % CDB_RESTART_INTERVAL)
+			return parse_fields(cdb, pos, pos + len, k ? first : 0, values);
+		
+		if (k == 0 && parse_fields(cdb, pos, pos + len, 0, first))
+			return -EINVAL;
+		
+		pos += len;
+	}
+}
+
+/*
+ * Decodes the i-th record into $fields. The strings are copied zero-terminated
+ * and in the order of the fields to the start of $buffer, *size is set to the
+ * number of bytes they need. Returns -ERANGE if $buffer is too small.
+ */
+int cdb_decode(struct cdb *cdb, uint32_t i, struct field *fields, char *buffer, size_t buflen, size_t *size) {
+	struct cdb_value values[DB_MAX_FIELDS];
+	unsigned int j;
+	size_t pos;
+	int r;
+	
+	r = parse_record(cdb, i, values);
+	if (r)
+		return r;
+	
+	*size = 0;
+	for (j=0; j < cdb->header->n_fields; j++) {
+		if (!(cdb->header->numeric & (1 << j)))
+			*size += (size_t) values[j].prefix_len + values[j].suffix_len + 1;
+	}
+	
+	PROBE(record_decode, cdb->header->db, i, *size);
+	
+	if (buflen < *size)
+		return -ERANGE;
+	
+	pos = 0;
+	for (j=0; j < cdb->header->n_fields; j++) {
+		fields[j].value = values[j].value;
+		
+		if (cdb->header->numeric & (1 << j)) {
+			fields[j].str = "";
+			fields[j].len = 0;
+			continue;
+		}
+		
+		memcpy(buffer + pos, values[j].prefix, values[j].prefix_len);
+		memcpy(buffer + pos + values[j].prefix_len, values[j].suffix, values[j].suffix_len);
+		
+		fields[j].str = buffer + pos;
+		fields[j].len = (size_t) values[j].prefix_len + values[j].suffix_len;
+		
+		pos += fields[j].len;
+		buffer[pos++] = 0;
+	}
+	
+	return 0;
+}
+
+/*
+ * Reports the id of the i-th record and the length of its name and, if
+ * $buffer is not 0, copies the zero-terminated name into $buffer. Returns
+ * -ERANGE if the name does not fit.
+ */
+int cdb_decode_key(struct cdb *cdb, uint32_t i, char *buffer, size_t buflen, size_t *len, id_t *id) {
+	struct cdb_value values[DB_MAX_FIELDS];
+	int r;
+	
+	r = parse_record(cdb, i, values);
+	if (r)
+		return r;
+	
+	*len = (size_t) values[0].prefix_len + values[0].suffix_len;
+	*id = cdb->header->id_field >= 0 ? (id_t) values[cdb->header->id_field].value : 0;
+	
+	if (!buffer)
+		return 0;
+	
+	if (buflen <= *len)
+		return -ERANGE;
+	
+	memcpy(buffer, values[0].prefix, values[0].prefix_len);
+	memcpy(buffer + values[0].prefix_len, values[0].suffix, values[0].suffix_len);
+	buffer[*len] = 0;
+	
+	return 0;
+}
+
+// loads the filter block and the displacement that cdb_find_name() reads for $name into the cache
+void cdb_prefetch_name(struct cdb *cdb, const char *name) {
+	uint64_t hash;
+	
+	if (cdb->header->n_names == 0)
+		return;
+	
+	hash = cdb_hash_name(name, strlen(name), cdb->header->seed);
+	
+	bloom_prefetch(&cdb->name_bloom, hash);
+	__builtin_prefetch(&cdb->name_disp[(uint32_t) (hash >> 32) % cdb->header->n_name_buckets]);
+}
+
+// loads the filter block and the displacement that cdb_find_id() reads for $id into the cache
+void cdb_prefetch_id(struct cdb *cdb, id_t id) {
+	uint64_t hash;
+	
+	if (cdb->header->n_ids == 0)
+		return;
+	
+	hash = cdb_hash_id(id, cdb->header->seed);
+	
+	bloom_prefetch(&cdb->id_bloom, hash);
+	__builtin_prefetch(&cdb->id_disp[(uint32_t) (hash >> 32) % cdb->header->n_id_buckets]);
+}
+
+int cdb_find_name(struct cdb *cdb, const char *name, uint32_t *record) {
+	struct cdb_value values[DB_MAX_FIELDS];
+	uint64_t hash;
+	uint32_t slot;
+	size_t len;
+	
+	if (cdb->header->n_names == 0)
+		return -ENOENT;
+	
+	len = strlen(name);
+	hash = cdb_hash_name(name, len, cdb->header->seed);
+	
+	if (!bloom_check(&cdb->name_bloom, hash))
+		return -ENOENT;
+	
+	slot = mphf_slot(hash, cdb->header->n_name_buckets, cdb->header->n_names, cdb->name_disp);
+	
+	// the perfect hash maps unknown names to an arbitrary slot, the name is compared without decoding it
+	if (parse_record(cdb, cdb->name_slots[slot], values))
+		return -ENOENT;
+	
+	if ((size_t) values[0].prefix_len + values[0].suffix_len != len ||
+		memcmp(name, values[0].prefix, values[0].prefix_len) ||
+		memcmp(name + values[0].prefix_len, values[0].suffix, values[0].suffix_len))
+	{
+		return -ENOENT;
+	}
+	
+	*record = cdb->name_slots[slot];
+	
+	return 0;
+}
+
+int cdb_find_id(struct cdb *cdb, id_t id, uint32_t *record) {
+	struct cdb_value values[DB_MAX_FIELDS];
+	uint64_t hash;
+	uint32_t slot;
+	
+	if (cdb->header->n_ids == 0)
+		return -ENOENT;
+	
+	hash = cdb_hash_id(id, cdb->header->seed);
+	
+	if (!bloom_check(&cdb->id_bloom, hash))
+		return -ENOENT;
+	
+	slot = mphf_slot(hash, cdb->header->n_id_buckets, cdb->header->n_ids, cdb->id_disp);
+	
+	if (parse_record(cdb, cdb->id_slots[slot], values))
+		return -ENOENT;
+	
+	if ((id_t) values[cdb->header->id_field].value != id)
+		return -ENOENT;
+	
+	*record = cdb->id_slots[slot];
+	
+	return 0;
+}
+
+// compares $name with the name of $member, an invalid member is larger than any name
+static int cmp_member(struct cdb *cdb, struct cdb_member *member, const char *name, size_t len) {
+	int r;
+	
+	if (member->str > cdb->header->strings_size || cdb->header->strings_size - member->str < member->len)
+		return 1;
+	
+	r = memcmp(cdb->strings + member->str, name, member->len < len ? member->len : len);
+	if (r)
+		return r;
+	
+	return (member->len > len) - (member->len < len);
+}
+
+// returns the number of groups that list $name as member and the first of them
+size_t cdb_find_members(struct cdb *cdb, const char *name, struct cdb_member **first) {
+	size_t lo, hi, mid, len;
+	
+	len = strlen(name);
+	
+	lo = 0;
+	hi = cdb->header->n_members;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp_member(cdb, &cdb->members[mid], name, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	*first = &cdb->members[lo];
+	
+	for (hi=lo; hi < cdb->header->n_members && cmp_member(cdb, &cdb->members[hi], name, len) == 0; hi++);
+	
+	return hi - lo;
+}
+
+/*
+ * Initializes a builder for a database with $n_fields fields. $numeric is a
+ * bit mask of the numeric fields, $id_field the field with the id or -1 and
+ * $list_field the comma-separated member list of a group or -1.
+ */
+int cdb_builder_init(struct cdb_builder *b, const char *db, unsigned int n_fields, unsigned int numeric, int id_field, int list_field, struct stat *dir_stat) {
+	memset(b, 0, sizeof(struct cdb_builder));
+	
+	b->db = db;
+	b->n_fields = n_fields;
+	b->numeric = numeric;
+	b->id_field = id_field;
+	b->list_field = list_field;
+	b->dir_stat = *dir_stat;
+	
+	return 0;
+}
+
+void cdb_builder_free(struct cdb_builder *b) {
+	free(b->files);
+	free(b->records);
+	free(b->values);
+	free(b->strings);
+	
+	memset(b, 0, sizeof(struct cdb_builder));
+}
+
+static int grow(void **array, size_t *alloc, size_t needed, size_t size) {
+	size_t new_alloc;
+	void *new_array;
+	
+	if (needed <= *alloc)
+		return 0;
+	
+	new_alloc = *alloc ? *alloc : 64;
+	while (new_alloc < needed)
+		new_alloc *= 2;
+	
+	new_array = realloc(*array, new_alloc * size);
+	if (!new_array) {
+		if (log_level >= LL_ERROR)
+			ERROR("realloc(%zu) failed: %s\n", new_alloc * size, strerror(errno));
+		return -ENOMEM;
+	}
+	
+	*array = new_array;
+	*alloc = new_alloc;
+	
+	return 0;
+}
+
+// appends a zero-terminated copy of the string to $pool and returns its offset
+static int pool_add(char **pool, size_t *size, size_t *alloc, const char *str, size_t len, uint32_t *offset) {
+	int r;
+	
+	if (*size + len + 1 > UINT32_MAX)
+		return -EFBIG;
+	
+	r = grow((void **) pool, alloc, *size + len + 1, 1);
+	if (r)
+		return r;
+	
+	memcpy(*pool + *size, str, len);
+	(*pool)[*size + len] = 0;
+	
+	*offset = *size;
+	*size += len + 1;
+	
+	return 0;
+}
+
+// appends a string to the string pool of the image
+static int add_string(struct cdb_builder *b, const char *str, size_t len, uint32_t *offset) {
+	return pool_add(&b->strings, &b->strings_size, &b->strings_alloc, str, len, offset);
+}
+
+// appends a string field of a record to the values that are only used while building
+static int add_value(struct cdb_builder *b, const char *str, size_t len, uint32_t *offset) {
+	return pool_add(&b->values, &b->values_size, &b->values_alloc, str, len, offset);
+}
+
+int cdb_builder_add_file(struct cdb_builder *b, const char *name, struct stat *st) {
+	struct cdb_file *file;
+	uint32_t offset;
+	int r;
+	
+	r = grow((void **) &b->files, &b->files_alloc, b->n_files + 1, sizeof(struct cdb_file));
+	if (r)
+		return r;
+	
+	r = add_string(b, name, strlen(name), &offset);
+	if (r)
+		return r;
+	
+	file = &b->files[b->n_files];
+	memset(file, 0, sizeof(struct cdb_file));
+	file->name = offset;
+	file->ino = st->st_ino;
+	file->size = st->st_size;
+	file->mtime_sec = st->st_mtim.tv_sec;
+	file->mtime_nsec = st->st_mtim.tv_nsec;
+	
+	b->n_files += 1;
+	b->files_size += st->st_size;
+	
+	return 0;
+}
+
+int cdb_builder_add_record(struct cdb_builder *b, struct field *fields) {
+	struct cdb_field *record;
+	unsigned int i;
+	int r;
+	
+	if (b->n_records >= UINT32_MAX)
+		return -EFBIG;
+	
+	r = grow((void **) &b->records, &b->records_alloc, (b->n_records + 1) * b->n_fields, sizeof(struct cdb_field));
+	if (r)
+		return r;
+	
+	// the records are encoded by cdb_builder_finish() once all of them are known
+	record = &b->records[b->n_records * b->n_fields];
+	for (i=0; i < b->n_fields; i++) {
+		memset(&record[i], 0, sizeof(struct cdb_field));
+		record[i].value = fields[i].value;
+		
+		if (b->numeric & (1 << i))
+			continue;
+		
+		r = add_value(b, fields[i].str, fields[i].len, &record[i].str);
+		if (r)
+			return r;
+		record[i].len = fields[i].len;
+	}
+	
+	b->n_records += 1;
+	
+	return 0;
+}
+
+struct mphf_key {
+	uint64_t hash;
+	uint32_t record;
+	uint32_t bucket;
+};
+
+static int cmp_key_bucket(const void *a, const void *b) {
+	const struct mphf_key *ka = a, *kb = b;
+	
+	if (ka->bucket != kb->bucket)
+		return ka->bucket < kb->bucket ? -1 : 1;
+	
+	return 0;
+}
+
+static int cmp_key_hash(const void *a, const void *b) {
+	const struct mphf_key *ka = a, *kb = b;
+	
+	if (ka->hash != kb->hash)
+		return ka->hash < kb->hash ? -1 : 1;
+	
+	return 0;
+}
+
+struct mphf_bucket {
+	uint32_t first;
+	uint32_t size;
+};
+
+static int cmp_bucket_size(const void *a, const void *b) {
+	const struct mphf_bucket *ba = a, *bb = b;
+	
+	if (ba->size != bb->size)
+		return ba->size > bb->size ? -1 : 1;
+	
+	return ba->first < bb->first ? -1 : (ba->first > bb->first);
+}
+
+/*
+ * Builds a minimal perfect hash function for $n keys using the "hash, displace
+ * and compress" scheme: the keys are distributed into buckets of about four
+ * keys and, starting with the largest bucket, a displacement (d0, d1) is
+ * searched for every bucket that moves all its keys into free slots with
+ * slot = (f1 + d0 * f2 + d1) % n.
+ * 
+ * Only a d1 that moves the first key of a bucket into a free slot can work,
+ * hence the search tries the free slots instead of all n values of d1. Once
+ * most slots are taken, trying every d1 took most of the time.
+ * 
+ * Returns -EAGAIN if the hashes of two keys collide or if no displacement
+ * was found, the caller should try again with another seed.
+ */
+static int mphf_build(struct mphf_key *keys, uint32_t n, uint32_t n_buckets, struct cdb_disp *disp, uint32_t *slots) {
+	struct mphf_bucket *buckets;
+	uint32_t i, j, k, f, base, n_free, *bucket_slots, *free_slots, *free_pos;
+	uint8_t *taken;
+	int r;
+	
+	if (n == 0)
+		return 0;
+	
+	// identical hashes can never be separated
+	qsort(keys, n, sizeof(struct mphf_key), cmp_key_hash);
+	for (i=1; i < n; i++) {
+		if (keys[i].hash == keys[i-1].hash)
+			return -EAGAIN;
+	}
+	
+	for (i=0; i < n; i++)
+		keys[i].bucket = (uint32_t) (keys[i].hash >> 32) % n_buckets;
+	qsort(keys, n, sizeof(struct mphf_key), cmp_key_bucket);
+	
+	buckets = (struct mphf_bucket *) calloc(n_buckets, sizeof(struct mphf_bucket));
+	taken = (uint8_t *) calloc(n, 1);
+	bucket_slots = (uint32_t *) malloc(sizeof(uint32_t) * n);
+	free_slots = (uint32_t *) malloc(sizeof(uint32_t) * n);
+	free_pos = (uint32_t *) malloc(sizeof(uint32_t) * n);
+	if (!buckets || !taken || !bucket_slots || !free_slots || !free_pos) {
+		free(buckets);
+		free(taken);
+		free(bucket_slots);
+		free(free_slots);
+		free(free_pos);
+		return -ENOMEM;
+	}
+	
+	// the free slots in any order, free_pos[slot] is the position of a free slot in this list
+	for (i=0; i < n; i++) {
+		free_slots[i] = i;
+		free_pos[i] = i;
+	}
+	n_free = n;
+	
+	for (i=0; i < n_buckets; i++)
+		buckets[i].first = UINT32_MAX;
+	for (i=0; i < n; i++) {
+		if (buckets[keys[i].bucket].size == 0)
+			buckets[keys[i].bucket].first = i;
+		buckets[keys[i].bucket].size += 1;
+	}
+	
+	// buckets without keys keep the displacement 0
+	for (i=0; i < n_buckets; i++) {
+		disp[i].d0 = 0;
+		disp[i].d1 = 0;
+	}
+	
+	qsort(buckets, n_buckets, sizeof(struct mphf_bucket), cmp_bucket_size);
+	
+	r = 0;
+	for (i=0; i < n_buckets && buckets[i].size > 0; i++) {
+		struct mphf_key *bkeys = &keys[buckets[i].first];
+		uint32_t size = buckets[i].size;
+		uint32_t bucket = bkeys[0].bucket;
+		uint32_t d0, d1;
+		int found = 0;
+		
+		// a single key can be moved directly into the next free slot
+		if (size == 1) {
+			disp[bucket].d0 = 0;
+			disp[bucket].d1 = 0;
+			disp[bucket].d1 = (free_slots[0] + n - mphf_slot(bkeys[0].hash, n_buckets, n, disp)) % n;
+			
+			bucket_slots[0] = free_slots[0];
+			found = 1;
+		}
+		
+		for (d0 = 0; d0 < 64 && !found; d0++) {
+			disp[bucket].d0 = d0;
+			disp[bucket].d1 = 0;
+			base = mphf_slot(bkeys[0].hash, n_buckets, n, disp);
+			
+			for (f=0; f < n_free && !found; f++) {
+				d1 = (free_slots[f] + n - base) % n;
+				disp[bucket].d1 = d1;
+				
+				for (j=0; j < size; j++) {
+					bucket_slots[j] = mphf_slot(bkeys[j].hash, n_buckets, n, disp);
+					if (taken[bucket_slots[j]])
+						break;
+					
+					for (k=0; k < j; k++) {
+						if (bucket_slots[k] == bucket_slots[j])
+							break;
+					}
+					if (k < j)
+						break;
+				}
+				
+				if (j == size)
+					found = 1;
+			}
+		}
+		
+		if (!found) {
+			r = -EAGAIN;
+			break;
+		}
+		
+		for (j=0; j < size; j++) {
+			taken[bucket_slots[j]] = 1;
+			slots[bucket_slots[j]] = bkeys[j].record;
+			
+			// replace the slot in the list of free slots with the last one
+			n_free -= 1;
+			free_slots[free_pos[bucket_slots[j]]] = free_slots[n_free];
+			free_pos[free_slots[n_free]] = free_pos[bucket_slots[j]];
+		}
+	}
+	
+	free(buckets);
+	free(taken);
+	free(bucket_slots);
+	free(free_slots);
+	free(free_pos);
+	
+	return r;
+}
+
+/*
+ * Collects the hash of the first record for every distinct name ($id_field < 0)
+ * or id and builds the perfect hash tables and the Bloom filter for them.
+ */
+static int build_key_table(struct cdb_builder *b, int id_field, uint64_t seed, uint32_t *n_keys, uint32_t *n_buckets,
+	struct cdb_disp **disp, uint32_t **slots, struct bloom *bloom)
+{
+	struct mphf_key *keys;
+	struct index seen;
+	uint32_t i, n;
+	int r;
+	
+	*disp = 0;
+	*slots = 0;
+	
+	r = index_init(&seen, b->n_records);
+	if (r)
+		return r;
+	
+	keys = (struct mphf_key *) malloc(sizeof(struct mphf_key) * (b->n_records + 1));
+	if (!keys) {
+		index_free(&seen);
+		return -ENOMEM;
+	}
+	
+	// only the first record of a name or id is found by a lookup
+	n = 0;
+	for (i=0; i < b->n_records; i++) {
+		struct cdb_field *record = &b->records[i * b->n_fields];
+		struct index_entry *entry;
+		uint32_t hash;
+		size_t pos;
+		
+		if (id_field < 0)
+			hash = index_hash_name(b->values + record[0].str, record[0].len);
+		else
+			hash = index_hash_id((id_t) record[id_field].value);
+		
+		pos = INDEX_START;
+		while ((entry = index_next(&seen, hash, &pos))) {
+			struct cdb_field *other = &b->records[entry->offset * b->n_fields];
+			
+			if (id_field < 0) {
+				if (other[0].len == record[0].len && !memcmp(b->values + other[0].str, b->values + record[0].str, record[0].len))
+					break;
+			} else {
+				if ((id_t) other[id_field].value == (id_t) record[id_field].value)
+					break;
+			}
+		}
+		if (entry)
+			continue;
+		
+		index_add(&seen, hash, 0, i);
+		
+		if (id_field < 0)
+			keys[n].hash = cdb_hash_name(b->values + record[0].str, record[0].len, seed);
+		else
+			keys[n].hash = cdb_hash_id((id_t) record[id_field].value, seed);
+		keys[n].record = i;
+		n += 1;
+	}
+	
+	index_free(&seen);
+	
+	*n_keys = n;
+	*n_buckets = n / 4 + 1;
+	
+	*disp = (struct cdb_disp *) malloc(sizeof(struct cdb_disp) * *n_buckets);
+	*slots = (uint32_t *) malloc(sizeof(uint32_t) * (n + 1));
+	if (!*disp || !*slots || bloom_init(bloom, n)) {
+		free(keys);
+		free(*disp);
+		free(*slots);
+		*disp = 0;
+		*slots = 0;
+		return -ENOMEM;
+	}
+	
+	for (i=0; i < n; i++)
+		bloom_add(bloom, keys[i].hash);
+	
+	r = mphf_build(keys, n, *n_buckets, *disp, *slots);
+	
+	free(keys);
+	
+	if (r) {
+		free(*disp);
+		free(*slots);
+		*disp = 0;
+		*slots = 0;
+		bloom_free(bloom);
+	}
+	
+	return r;
+}
+
+// an entry of a hash set of strings in one of the pools of the builder
+struct string_entry {
+	uint32_t str;
+	uint32_t len;
+	uint32_t count;
+	uint32_t id;
+};
+
+struct string_set {
+	struct string_entry *entries;
+	size_t n_slots;
+	size_t n_entries;
+};
+
+// initializes a set for up to $n strings
+static int string_set_init(struct string_set *set, size_t n) {
+	set->n_slots = 16;
+	while (set->n_slots < 2 * n)
+		set->n_slots *= 2;
+	
+	set->n_entries = 0;
+	set->entries = (struct string_entry *) calloc(set->n_slots, sizeof(struct string_entry));
+	if (!set->entries)
+		return -ENOMEM;
+	
+	return 0;
+}
+
+static void string_set_free(struct string_set *set) {
+	free(set->entries);
+	
+	memset(set, 0, sizeof(struct string_set));
+}
+
+// returns the entry of $str in $set or the free entry for it whose count is 0
+static struct string_entry *string_set_get(struct string_set *set, const char *pool, const char *str, size_t len) {
+	size_t i;
+	
+	i = cdb_hash_name(str, len, 0) & (set->n_slots - 1);
+	while (set->entries[i].count) {
+		if (set->entries[i].len == len && !memcmp(pool + set->entries[i].str, str, len))
+			return &set->entries[i];
+		
+		i = (i + 1) & (set->n_slots - 1);
+	}
+	
+	return &set->entries[i];
+}
+
+static int cmp_builder_member(const void *a, const void *b, void *arg) {
+	const struct cdb_member *ma = a, *mb = b;
+	const char *strings = (const char *) arg;
+	int r;
+	
+	r = memcmp(strings + ma->str, strings + mb->str, ma->len < mb->len ? ma->len : mb->len);
+	if (r)
+		return r;
+	
+	if (ma->len != mb->len)
+		return (ma->len > mb->len) - (ma->len < mb->len);
+	
+	return (ma->record > mb->record) - (ma->record < mb->record);
+}
+
+/*
+ * Collects the members of the comma-separated lists in the member list field
+ * and sorts them by name, the groups of a member stay in the record order.
+ * Every name is stored once in the string pool.
+ */
+static int build_members(struct cdb_builder *b, uint32_t *n_members, struct cdb_member **members) {
+	struct cdb_field *record;
+	struct string_entry *entry;
+	struct string_set names;
+	uint64_t n, alloc;
+	uint32_t i, j, k;
+	int r;
+	
+	*n_members = 0;
+	*members = 0;
+	
+	if (b->list_field < 0 || b->id_field < 0)
+		return 0;
+	
+	// a list with n commas contains at most n+1 members
+	alloc = 0;
+	for (i=0; i < b->n_records; i++) {
+		record = &b->records[i * b->n_fields];
+		
+		alloc += 1;
+		for (j=0; j < record[b->list_field].len; j++) {
+			if (b->values[record[b->list_field].str + j] == ',')
+				alloc += 1;
+		}
+	}
+	if (alloc >= UINT32_MAX)
+		return -EFBIG;
+	
+	*members = (struct cdb_member *) malloc(sizeof(struct cdb_member) * (alloc + 1));
+	if (!*members)
+		return -ENOMEM;
+	
+	r = string_set_init(&names, alloc);
+	if (r) {
+		free(*members);
+		*members = 0;
+		return r;
+	}
+	
+	n = 0;
+	for (i=0; i < b->n_records && r == 0; i++) {
+		const char *list;
+		uint32_t len;
+		
+		record = &b->records[i * b->n_fields];
+		list = b->values + record[b->list_field].str;
+		len = record[b->list_field].len;
+		
+		for (j=0; j < len && r == 0; j = k + 1) {
+			for (k=j; k < len && list[k] != ','; k++);
+			
+			if (k == j)
+				continue;
+			
+			entry = string_set_get(&names, b->strings, &list[j], k - j);
+			if (entry->count == 0) {
+				r = add_string(b, &list[j], k - j, &entry->str);
+				if (r)
+					break;
+				
+				entry->len = k - j;
+				entry->count = 1;
+			}
+			
+			(*members)[n].str = entry->str;
+			(*members)[n].len = entry->len;
+			(*members)[n].id = (uint32_t) record[b->id_field].value;
+			(*members)[n].record = i;
+			n += 1;
+		}
+	}
+	
+	string_set_free(&names);
+	
+	if (r) {
+		free(*members);
+		*members = 0;
+		return r;
+	}
+	
+	qsort_r(*members, n, sizeof(struct cdb_member), cmp_builder_member, b->strings);
+	
+	*n_members = n;
+	
+	return 0;
+}
+
+static int cmp_entry_count(const void *a, const void *b) {
+	const struct string_entry *ea = *(const struct string_entry **) a;
+	const struct string_entry *eb = *(const struct string_entry **) b;
+	
+	if (ea->count != eb->count)
+		return ea->count > eb->count ? -1 : 1;
+	
+	return (ea->str > eb->str) - (ea->str < eb->str);
+}
+
+/*
+ * Counts how often every value of a string field occurs in $values and
+ * interns the values whose copies take more space than their entry in the
+ * dictionary, e.g., the password placeholder "x" or a common shell. The most
+ * frequent values get the smallest indexes and hence the shortest tags.
+ */
+static int build_dict(struct cdb_builder *b, struct string_set *values, uint32_t *n_dict, struct cdb_string **dict) {
+	struct string_entry *entry, **interned;
+	struct cdb_field *record;
+	size_t i, j, n;
+	int r;
+	
+	*n_dict = 0;
+	*dict = 0;
+	
+	r = string_set_init(values, b->n_records * b->n_fields);
+	if (r)
+		return r;
+	
+	for (i=0; i < b->n_records; i++) {
+		record = &b->records[i * b->n_fields];
+		
+		for (j=0; j < b->n_fields; j++) {
+			if (b->numeric & (1 << j))
+				continue;
+			
+			entry = string_set_get(values, b->values, b->values + record[j].str, record[j].len);
+			if (entry->count == 0) {
+				entry->str = record[j].str;
+				entry->len = record[j].len;
+				entry->id = UINT32_MAX;
+				values->n_entries += 1;
+			}
+			entry->count += 1;
+		}
+	}
+	
+	interned = (struct string_entry **) malloc(sizeof(struct string_entry *) * (values->n_entries + 1));
+	if (!interned)
+		return -ENOMEM;
+	
+	n = 0;
+	for (i=0; i < values->n_slots; i++) {
+		entry = &values->entries[i];
+		
+		if (entry->count > 1 && (uint64_t) (entry->count - 1) * (entry->len + 1) > sizeof(struct cdb_string))
+			interned[n++] = entry;
+	}
+	
+	qsort(interned, n, sizeof(struct string_entry *), cmp_entry_count);
+	
+	*dict = (struct cdb_string *) malloc(sizeof(struct cdb_string) * (n + 1));
+	if (!*dict) {
+		free(interned);
+		return -ENOMEM;
+	}
+	
+	for (i=0; i < n; i++) {
+		r = add_string(b, b->values + interned[i]->str, interned[i]->len, &(*dict)[i].str);
+		if (r) {
+			free(interned);
+			free(*dict);
+			*dict = 0;
+			return r;
+		}
+		
+		(*dict)[i].len = interned[i]->len;
+		interned[i]->id = i;
+	}
+	
+	free(interned);
+	
+	*n_dict = n;
+	
+	return 0;
+}
+
+// stores $value as little-endian base-128 number at $out and returns its length
+static size_t put_varint(unsigned char *out, uint64_t value) {
+	size_t n;
+	
+	n = 0;
+	while (value >= 0x80) {
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	
+	return n;
+}
+
+/*
+ * Encodes the records in the format that parse_fields() describes, every record
+ * is preceded by its length. The offset of the first record of every group is
+ * stored in $restarts.
+ */
+static int encode_records(struct cdb_builder *b, struct string_set *values, uint32_t *restarts, unsigned char **records, size_t *records_size) {
+	struct cdb_field *record, *first;
+	struct string_entry *entry;
+	unsigned char *encoded, len_buf[10];
+	size_t size, alloc, max, pos, n;
+	uint32_t i, j, prefix;
+	int r;
+	
+	*records = 0;
+	size = 0;
+	alloc = 0;
+	
+	for (i=0; i < b->n_records; i++) {
+		record = &b->records[i * b->n_fields];
+		first = &b->records[(i - i % CDB_RESTART_INTERVAL) * b->n_fields];
+		
+		if (size > UINT32_MAX) {
+			free(*records);
+			*records = 0;
+			return -EFBIG;
+		}
+		
+		if (i % CDB_RESTART_INTERVAL == 0)
+			restarts[i / CDB_RESTART_INTERVAL] = size;
+		
+		// every field needs at most two numbers of 10 bytes and its string
+		max = 0;
+		for (j=0; j < b->n_fields; j++)
+			max += 20 + record[j].len;
+		
+		// the record is encoded behind the space for its length and moved once the length is known
+		r = grow((void **) records, &alloc, size + sizeof(len_buf) + max, 1);
+		if (r) {
+			free(*records);
+			*records = 0;
+			return r;
+		}
+		encoded = *records + size + sizeof(len_buf);
+		
+		pos = 0;
+		for (j=0; j < b->n_fields; j++) {
+			if (b->numeric & (1 << j)) {
+				pos += put_varint(encoded + pos, zigzag((int64_t) ((uint64_t) record[j].value - (record == first ? 0 : (uint64_t) first[j].value))));
+				continue;
+			}
+			
+			entry = string_set_get(values, b->values, b->values + record[j].str, record[j].len);
+			if (entry->id != UINT32_MAX) {
+				pos += put_varint(encoded + pos, ((uint64_t) entry->id << 1) | 1);
+				continue;
+			}
+			
+			prefix = 0;
+			if (record != first) {
+				while (prefix < record[j].len && prefix < first[j].len && b->values[record[j].str + prefix] == b->values[first[j].str + prefix])
+					prefix += 1;
+			}
+			
+			pos += put_varint(encoded + pos, (uint64_t) prefix << 1);
+			pos += put_varint(encoded + pos, record[j].len - prefix);
+			memcpy(encoded + pos, b->values + record[j].str + prefix, record[j].len - prefix);
+			pos += record[j].len - prefix;
+		}
+		
+		n = put_varint(len_buf, pos);
+		memcpy(*records + size, len_buf, n);
+		memmove(*records + size + n, encoded, pos);
+		size += n + pos;
+	}
+	
+	if (size > UINT32_MAX) {
+		free(*records);
+		*records = 0;
+		return -EFBIG;
+	}
+	
+	*records_size = size;
+	
+	return 0;
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t) 7)
+
+/*
+ * Creates the image of the compiled database in a malloc'ed buffer. The image
+ * does not contain pointers and can be used at any address.
+ */
+int cdb_builder_finish(struct cdb_builder *b, char **image, size_t *image_size) {
+	struct cdb_header header;
+	struct cdb_disp *name_disp, *id_disp;
+	uint32_t *name_slots, *id_slots, *restarts;
+	struct cdb_member *members;
+	struct cdb_string *dict;
+	struct bloom name_bloom, id_bloom;
+	struct string_set values;
+	unsigned char *records;
+	size_t records_size;
+	uint64_t offset, seed;
+	unsigned int attempt;
+	char *data;
+	int r;
+	
+	name_disp = id_disp = 0;
+	name_slots = id_slots = restarts = 0;
+	members = 0;
+	dict = 0;
+	records = 0;
+	records_size = 0;
+	memset(&name_bloom, 0, sizeof(struct bloom));
+	memset(&id_bloom, 0, sizeof(struct bloom));
+	memset(&values, 0, sizeof(struct string_set));
+	
+	memset(&header, 0, sizeof(struct cdb_header));
+	memcpy(header.magic, CDB_MAGIC, sizeof(header.magic));
+	header.version = CDB_VERSION;
+	strncpy(header.db, b->db, sizeof(header.db));
+	header.n_fields = b->n_fields;
+	header.numeric = b->numeric;
+	header.id_field = b->id_field;
+	header.list_field = b->list_field;
+	header.dir_ino = b->dir_stat.st_ino;
+	header.dir_mtime_sec = b->dir_stat.st_mtim.tv_sec;
+	header.dir_mtime_nsec = b->dir_stat.st_mtim.tv_nsec;
+	header.n_files = b->n_files;
+	header.n_records = b->n_records;
+	header.n_restarts = (b->n_records + CDB_RESTART_INTERVAL - 1) / CDB_RESTART_INTERVAL;
+	
+	r = -EAGAIN;
+	seed = 0x9e3779b97f4a7c15ull;
+	for (attempt = 0; attempt < 16 && r == -EAGAIN; attempt++) {
+		seed = mix64(seed + attempt);
+		
+		r = build_key_table(b, -1, seed, &header.n_names, &header.n_name_buckets, &name_disp, &name_slots, &name_bloom);
+		if (r)
+			continue;
+		
+		if (b->id_field >= 0) {
+			r = build_key_table(b, b->id_field, seed, &header.n_ids, &header.n_id_buckets, &id_disp, &id_slots, &id_bloom);
+			if (r) {
+				free(name_disp);
+				free(name_slots);
+				name_disp = 0;
+				name_slots = 0;
+				bloom_free(&name_bloom);
+			}
+		}
+	}
+	if (r) {
+		if (log_level >= LL_ERROR)
+			ERROR("cannot build the perfect hash tables: %s\n", strerror(-r));
+		return r;
+	}
+	header.seed = seed;
+	header.n_name_blocks = name_bloom.n_blocks;
+	header.n_id_blocks = id_bloom.n_blocks;
+	
+	r = build_members(b, &header.n_members, &members);
+	if (r)
+		goto out;
+	
+	r = build_dict(b, &values, &header.n_dict, &dict);
+	if (r)
+		goto out;
+	
+	restarts = (uint32_t *) malloc(sizeof(uint32_t) * (header.n_restarts + 1));
+	if (!restarts) {
+		r = -ENOMEM;
+		goto out;
+	}
+	
+	r = encode_records(b, &values, restarts, &records, &records_size);
+	if (r)
+		goto out;
+	
+	offset = ALIGN8(sizeof(struct cdb_header));
+	header.files_off = offset;
+	offset = ALIGN8(offset + sizeof(struct cdb_file) * (uint64_t) header.n_files);
+	header.restarts_off = offset;
+	offset = ALIGN8(offset + sizeof(uint32_t) * (uint64_t) header.n_restarts);
+	header.records_off = offset;
+	header.records_size = records_size;
+	offset = ALIGN8(offset + records_size);
+	header.dict_off = offset;
+	offset = ALIGN8(offset + sizeof(struct cdb_string) * (uint64_t) header.n_dict);
+	header.name_disp_off = offset;
+	offset = ALIGN8(offset + sizeof(struct cdb_disp) * (uint64_t) header.n_name_buckets);
+	header.name_slots_off = offset;
+	offset = ALIGN8(offset + sizeof(uint32_t) * (uint64_t) header.n_names);
+	header.id_disp_off = offset;
+	offset = ALIGN8(offset + sizeof(struct cdb_disp) * (uint64_t) header.n_id_buckets);
+	header.id_slots_off = offset;
+	offset = ALIGN8(offset + sizeof(uint32_t) * (uint64_t) header.n_ids);
+	header.members_off = offset;
+	offset = ALIGN8(offset + sizeof(struct cdb_member) * (uint64_t) header.n_members);
+	header.name_bloom_off = offset;
+	offset = ALIGN8(offset + sizeof(uint64_t) * BLOOM_BLOCK_WORDS * (uint64_t) header.n_name_blocks);
+	header.id_bloom_off = offset;
+	offset = ALIGN8(offset + sizeof(uint64_t) * BLOOM_BLOCK_WORDS * (uint64_t) header.n_id_blocks);
+	header.strings_off = offset;
+	header.strings_size = b->strings_size;
+	offset = ALIGN8(offset + b->strings_size);
+	header.size = offset;
+	
+	data = (char *) calloc(1, offset);
+	if (!data) {
+		r = -ENOMEM;
+		goto out;
+	}
+	
+	memcpy(data, &header, sizeof(struct cdb_header));
+	if (header.n_files)
+		memcpy(data + header.files_off, b->files, sizeof(struct cdb_file) * header.n_files);
+	if (header.n_restarts)
+		memcpy(data + header.restarts_off, restarts, sizeof(uint32_t) * header.n_restarts);
+	if (records_size)
+		memcpy(data + header.records_off, records, records_size);
+	if (header.n_dict)
+		memcpy(data + header.dict_off, dict, sizeof(struct cdb_string) * header.n_dict);
+	if (header.n_names) {
+		memcpy(data + header.name_disp_off, name_disp, sizeof(struct cdb_disp) * header.n_name_buckets);
+		memcpy(data + header.name_slots_off, name_slots, sizeof(uint32_t) * header.n_names);
+	}
+	if (header.n_ids) {
+		memcpy(data + header.id_disp_off, id_disp, sizeof(struct cdb_disp) * header.n_id_buckets);
+		memcpy(data + header.id_slots_off, id_slots, sizeof(uint32_t) * header.n_ids);
+	}
+	if (header.n_members)
+		memcpy(data + header.members_off, members, sizeof(struct cdb_member) * header.n_members);
+	if (header.n_name_blocks)
+		memcpy(data + header.name_bloom_off, name_bloom.bits, sizeof(uint64_t) * BLOOM_BLOCK_WORDS * header.n_name_blocks);
+	if (header.n_id_blocks)
+		memcpy(data + header.id_bloom_off, id_bloom.bits, sizeof(uint64_t) * BLOOM_BLOCK_WORDS * header.n_id_blocks);
+	if (b->strings_size)
+		memcpy(data + header.strings_off, b->strings, b->strings_size);
+	
+	*image = data;
+	*image_size = offset;
+	
+	b->size = offset;
+	b->records_size = records_size;
+	
+out:
+	free(name_disp);
+	free(name_slots);
+	free(id_disp);
+	free(id_slots);
+	free(members);
+	free(dict);
+	free(restarts);
+	free(records);
+	bloom_free(&name_bloom);
+	bloom_free(&id_bloom);
+	string_set_free(&values);
+	
+	return r;
+}
+
+// writes the image into a temporary file and atomically replaces $path with it
+int cdb_write(const char *path, char *image, size_t size, mode_t mode) {
+	char *tmppath;
+	size_t written;
+	ssize_t r;
+	int fd, err;
+	
+	if (asprintf(&tmppath, "%s.XXXXXX", path) < 0)
+		return -ENOMEM;
+	
+	fd = mkostemp(tmppath, O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("cannot create \"%s\": %s\n", tmppath, strerror(errno));
+		free(tmppath);
+		return err;
+	}
+	
+	written = 0;
+	while (written < size) {
+		r = write(fd, image + written, size - written);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += r;
+	}
+	
+	if (written < size || fchmod(fd, mode) || fsync(fd)) {
+		err = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("cannot write \"%s\": %s\n", tmppath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(tmppath);
+		return err;
+	}
+	
+	if (close(fd)) {
+		err = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("cannot write \"%s\": %s\n", tmppath, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		return err;
+	}
+	
+	if (rename(tmppath, path)) {
+		err = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("cannot rename \"%s\" to \"%s\": %s\n", tmppath, path, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		return err;
+	}
+	
+	free(tmppath);
+	
+	return 0;
+}
+
+// creates the image of the database and writes it to $path
+int cdb_publish(struct cdb_builder *b, const char *path, mode_t mode) {
+	char *image;
+	size_t size;
+	int r;
+	
+	r = cdb_builder_finish(b, &image, &size);
+	if (r)
+		return r;
+	
+	r = cdb_write(path, image, size, mode);
+	free(image);
+	
+	return r;
+}
+
+/*
+ * Returns the path of the copy of the database that $uid published in shared
+ * memory if NSS_CONFD_SHM is set to a directory like /dev/shm or 0 if sharing
+ * is disabled.
+ * 
+ * nss-confd-mkindex --shm and nss-confd-cached publish their parsed copy
+ * under this path and the module maps it like a compiled database, i.e. the
+ * same owner, mode and stat checks apply. The path contains the uid as
+ * cdb_open() only accepts files of root and of the caller, and a hash of the
+ * directory as different processes might use different directories.
+ */
+char *cdb_shm_path(const char *db, const char *dirpath, uid_t uid) {
+	char *shmdir, *result;
+	
+	shmdir = secure_getenv("NSS_CONFD_SHM");
+	if (!shmdir || shmdir[0] == 0)
+		return 0;
+	
+	if (asprintf(&result, "%s/nss-confd-%s-%u-%08x", shmdir, db, (unsigned int) uid, index_hash_dir(dirpath)) < 0)
+		return 0;
+	
+	return result;
+}
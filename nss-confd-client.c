@@ -0,0 +1,343 @@
+/*
+ * nss-confd-client
+ * ----------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file implements the client side of the protocol that is used to query
+ * the optional caching daemon nss-confd-cached. If the daemon is not running,
+ * the lookups fail and the modules continue with their own copy of the data.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "nss-confd.h"
+
+// disabled by nss-confd-cached to avoid asking itself
+int cached_enabled = 1;
+
+// every thread has its own connection, hence threads do not wait for each other
+struct cached_conn {
+	int sock;
+	pid_t sock_pid;
+	
+	// set if the daemon runs as root or as our effective user and may answer shadow lookups
+	int trusted;
+	
+	char *response;
+	size_t response_alloc;
+};
+
+static pthread_key_t conn_key;
+static pthread_once_t conn_once = PTHREAD_ONCE_INIT;
+static int conn_key_valid;
+static time_t retry_after;
+
+// returns the path of the socket or 0 if the daemon should not be used
+const char *cached_socket_path(void) {
+	const char *path;
+	
+	path = secure_getenv("NSS_CONFD_SOCKET");
+	if (!path)
+		return CACHED_SOCKET;
+	
+	if (path[0] == 0)
+		return 0;
+	
+	return path;
+}
+
+static void cached_disconnect(struct cached_conn *conn) {
+	if (conn->sock >= 0)
+		close(conn->sock);
+	
+	conn->sock = -1;
+}
+
+// closes the connection of a thread when it exits
+static void conn_free(void *arg) {
+	struct cached_conn *conn = (struct cached_conn *) arg;
+	
+	cached_disconnect(conn);
+	free(conn->response);
+	free(conn);
+}
+
+static void conn_key_create(void) {
+	conn_key_valid = (pthread_key_create(&conn_key, conn_free) == 0);
+}
+
+// returns the connection state of the calling thread
+static struct cached_conn *cached_conn(void) {
+	struct cached_conn *conn;
+	
+	pthread_once(&conn_once, conn_key_create);
+	if (!conn_key_valid)
+		return 0;
+	
+	conn = (struct cached_conn *) pthread_getspecific(conn_key);
+	if (conn)
+		return conn;
+	
+	conn = (struct cached_conn *) calloc(1, sizeof(struct cached_conn));
+	if (!conn)
+		return 0;
+	
+	conn->sock = -1;
+	
+	if (pthread_setspecific(conn_key, conn)) {
+		free(conn);
+		
+		return 0;
+	}
+	
+	return conn;
+}
+
+static int cached_connect(struct cached_conn *conn) {
+	struct sockaddr_un addr;
+	struct timeval timeout;
+	struct timespec now;
+	struct ucred cred;
+	socklen_t cred_len;
+	const char *path;
+	
+	// a forked child must not share the connection with its parent
+	if (conn->sock >= 0 && conn->sock_pid != getpid())
+		cached_disconnect(conn);
+	
+	if (conn->sock >= 0)
+		return 0;
+	
+	// do not pay for a failing connect() on every lookup if the daemon is not running
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec < __atomic_load_n(&retry_after, __ATOMIC_RELAXED))
+		return -ENOTCONN;
+	
+	// -ENOENT is reserved for "not found", everything else means we cannot use the daemon
+	path = cached_socket_path();
+	if (!path)
+		return -ENOTCONN;
+	
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+	
+	conn->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (conn->sock < 0)
+		return -ENOTCONN;
+	
+	// do not let a stuck daemon block the caller, connect() also waits at most this long if the backlog of the daemon is full
+	timeout.tv_sec = CACHED_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+	setsockopt(conn->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval));
+	
+	if (connect(conn->sock, (struct sockaddr *) &addr, sizeof(struct sockaddr_un))) {
+		cached_disconnect(conn);
+		__atomic_store_n(&retry_after, now.tv_sec + CACHED_RETRY, __ATOMIC_RELAXED);
+		
+		return -ENOTCONN;
+	}
+	
+	conn->sock_pid = getpid();
+	
+	// anybody can listen on a socket in a directory they own
+	cred_len = sizeof(struct ucred);
+	conn->trusted = getsockopt(conn->sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 &&
+		(cred.uid == 0 || cred.uid == geteuid());
+	
+	if (log_level >= LL_DBG)
+		DBG("connected to \"%s\"\n", path);
+	
+	return 0;
+}
+
+static int cached_send(struct cached_conn *conn, struct cached_request *request, const char *key, size_t key_len) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t r;
+	
+	iov[0].iov_base = request;
+	iov[0].iov_len = sizeof(struct cached_request);
+	iov[1].iov_base = (void *) key;
+	iov[1].iov_len = key_len;
+	
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = key_len ? 2 : 1;
+	
+	r = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+	if (r < 0)
+		return -errno;
+	
+	return 0;
+}
+
+static int cached_recv(struct cached_conn *conn, size_t *size) {
+	ssize_t r;
+	
+	// get the size of the message first, a record can be of arbitrary size
+	r = recv(conn->sock, 0, 0, MSG_PEEK | MSG_TRUNC);
+	if (r < 0)
+		return -errno;
+	if (r == 0)
+		return -ECONNRESET;
+	
+	if ((size_t) r > conn->response_alloc) {
+		char *new_response;
+		
+		new_response = (char *) realloc(conn->response, r);
+		if (!new_response)
+			return -ENOMEM;
+		
+		conn->response = new_response;
+		conn->response_alloc = r;
+	}
+	
+	r = recv(conn->sock, conn->response, conn->response_alloc, 0);
+	if (r < 0)
+		return -errno;
+	if (r == 0)
+		return -ECONNRESET;
+	
+	*size = r;
+	
+	return 0;
+}
+
+/*
+ * Sends a request to the daemon and receives the response into the buffer of
+ * the calling thread. Returns the status of the response, i.e. 0 if the daemon
+ * found an entry and -ENOENT if it did not, or another negative errno value
+ * if the daemon cannot be used.
+ */
+static int cached_request(uint8_t db, const char *dirpath, uint8_t type, const char *key, uint32_t id, char **payload, size_t *payload_size) {
+	struct cached_request request;
+	struct cached_response *resp;
+	struct cached_conn *conn;
+	size_t key_len, size;
+	int r, attempt;
+	
+	if (!cached_enabled)
+		return -ENOTCONN;
+	
+	conn = cached_conn();
+	if (!conn)
+		return -ENOTCONN;
+	
+	memset(&request, 0, sizeof(struct cached_request));
+	request.version = CACHED_VERSION;
+	request.db = db;
+	request.type = type;
+	request.id = id;
+	request.dir_hash = index_hash_dir(dirpath);
+	key_len = key ? strlen(key) : 0;
+	
+	if (key_len > CACHED_MAX_KEY)
+		return -EINVAL;
+	
+	// reconnect once if the daemon was restarted since the last request
+	for (attempt = 0; attempt < 2; attempt++) {
+		r = cached_connect(conn);
+		if (r)
+			return r;
+		
+		if (db == CACHED_SHADOW && !conn->trusted) {
+			if (log_level >= LL_DBG)
+				DBG("the daemon runs as another user, not asking it for shadow entries\n");
+			return -ENOTCONN;
+		}
+		
+		r = cached_send(conn, &request, key, key_len);
+		if (r == 0)
+			r = cached_recv(conn, &size);
+		if (r == 0)
+			break;
+		
+		cached_disconnect(conn);
+		
+		if (r != -EPIPE && r != -ECONNRESET)
+			return -ENOTCONN;
+	}
+	if (r)
+		return -ENOTCONN;
+	
+	if (size < sizeof(struct cached_response)) {
+		cached_disconnect(conn);
+		
+		return -EPROTO;
+	}
+	
+	resp = (struct cached_response *) conn->response;
+	if (resp->size != size - sizeof(struct cached_response)) {
+		cached_disconnect(conn);
+		
+		return -EPROTO;
+	}
+	
+	if (resp->status)
+		return resp->status;
+	
+	*payload = conn->response + sizeof(struct cached_response);
+	*payload_size = resp->size;
+	
+	return 0;
+}
+
+/*
+ * Looks up a record by name or, if $name is 0, by id. The daemon only answers
+ * if it serves the same directory as $dirpath. The fields point into a buffer
+ * of the calling thread and stay valid until its next request.
+ */
+int cached_lookup(uint8_t db, const char *dirpath, const char *name, uint32_t id, struct field *fields, unsigned int n_fields, unsigned int numeric) {
+	const char *next;
+	char *payload;
+	size_t size;
+	int r;
+	
+	r = cached_request(db, dirpath, name ? CACHED_BY_NAME : CACHED_BY_ID, name, id, &payload, &size);
+	if (r)
+		return r;
+	
+	if (parse_line(payload, payload + size, fields, n_fields, numeric, &next))
+		return -EPROTO;
+	
+	return 0;
+}
+
+// returns the gids of all groups that list $user as a member
+int cached_initgroups(const char *dirpath, const char *user, gid_t **gids, size_t *n_gids) {
+	char *payload;
+	size_t size;
+	int r;
+	
+	r = cached_request(CACHED_GROUP, dirpath, CACHED_INITGROUPS, user, 0, &payload, &size);
+	if (r)
+		return r;
+	
+	if (size % sizeof(uint32_t))
+		return -EPROTO;
+	
+	*gids = (gid_t *) payload;
+	*n_gids = size / sizeof(uint32_t);
+	
+	return 0;
+}
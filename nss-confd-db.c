@@ -0,0 +1,1353 @@
+/*
+ * nss-confd-db
+ * ------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file implements the parts that all databases share: loading the
+ * directory into a snapshot, the lookups by name and id, the enumeration and
+ * building a compiled database. A database is described by a struct db whose
+ * schema lists where every field of a line is stored in the result struct of
+ * glibc, e.g. in a struct passwd. nss-confd-pw.c, nss-confd-gr.c and
+ * nss-confd-sp.c only provide such a description and the NSS entry points.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <nss.h>
+
+#include "nss-confd.h"
+
+static void publish_shm(struct db *db, struct snapshot *snap, const char *dirpath);
+static void track_db(struct db *db);
+
+char *db_dirpath(struct db *db) {
+	char *dirpath;
+	
+	dirpath = getenv(db->dir_env);
+	
+	if (dirpath == 0)
+		dirpath = (char *) db->default_dir;
+	
+	return dirpath;
+}
+
+// opens the compiled database of $db or the copy in shared memory, the caller holds load_lock
+static int open_cdb(struct db *db, struct snapshot *snap, const char *dirpath) {
+	char *index_path;
+	int r;
+	
+	// use the compiled database if it is still up to date
+	index_path = cdb_path(secure_getenv(db->index_env), dirpath);
+	if (index_path) {
+		r = cdb_open(&snap->cdb, index_path, db->name, db->n_fields, dirpath);
+		free(index_path);
+		
+		if (r == 0)
+			return 0;
+	}
+	
+	// attach to the copy that nss-confd-mkindex --shm or the daemon published in shared memory, of this user or of root
+	index_path = cdb_shm_path(db->name, dirpath, geteuid());
+	if (index_path) {
+		r = cdb_open(&snap->cdb, index_path, db->name, db->n_fields, dirpath);
+		free(index_path);
+		
+		if (r == 0)
+			return 0;
+	}
+	
+	index_path = geteuid() != 0 ? cdb_shm_path(db->name, dirpath, 0) : 0;
+	if (index_path) {
+		r = cdb_open(&snap->cdb, index_path, db->name, db->n_fields, dirpath);
+		free(index_path);
+		
+		if (r == 0)
+			return 0;
+	}
+	
+	return -ENOENT;
+}
+
+// reports the number of files and bytes of the loaded snapshot
+static void count_snapshot(struct db *db, struct snapshot *snap) {
+	uint64_t bytes;
+	size_t i;
+	
+	if (snap->cdb.data) {
+		stats_set(db->cached_db, STATS_FILES, snap->cdb.header->n_files);
+		stats_set(db->cached_db, STATS_BYTES, snap->cdb.size);
+		
+		return;
+	}
+	
+	bytes = 0;
+	for (i=0; i < snap->n_tables; i++)
+		bytes += snap->tables[i].stat.st_size;
+	
+	stats_set(db->cached_db, STATS_FILES, snap->n_tables);
+	stats_set(db->cached_db, STATS_BYTES, bytes);
+}
+
+// loads the directory into a new snapshot, the caller holds load_lock
+static enum nss_status load(struct db *db, struct snapshot *old) {
+	struct snapshot *snap;
+	uint64_t start, phase;
+	int r, changed;
+	char *dirpath;
+	int debounce;
+	
+	start = stats_start();
+	
+	if (getenv("NSS_CONFD_DEBUG")) {
+		long long value;
+		
+		r = parse_llong(getenv("NSS_CONFD_DEBUG"), &value);
+		if (r == 0) {
+			log_level = value;
+		}
+	}
+	
+	dirpath = db_dirpath(db);
+	
+	// a reload has the previous snapshot
+	PROBE(load_start, db->name, dirpath, old != 0);
+	
+	// watch the directory before reading it to not miss a change
+	debounce = watch_debounce();
+	if (debounce >= 0)
+		watch_init(&db->watch, dirpath, debounce);
+	
+	snap = snapshot_new();
+	if (!snap) {
+		stats_add(db->cached_db, STATS_LOAD_ERRORS, 1);
+		PROBE(load_done, db->name, -ENOMEM, 0, 0);
+		
+		return NSS_STATUS_UNAVAIL;
+	}
+	
+	stats_add(db->cached_db, old ? STATS_RELOADS : STATS_LOADS, 1);
+	
+	// only a reload of the directory itself has tables already, then we only load the changed files
+	if (!old || !old->tables) {
+		phase = stats_start();
+		r = open_cdb(db, snap, dirpath);
+		stats_time(db->cached_db, STATS_TIME_OPEN_INDEX, phase);
+		
+		if (r == 0) {
+			stats_add(db->cached_db, STATS_INDEX_LOADS, 1);
+			count_snapshot(db, snap);
+			snapshot_publish(&db->current, snap);
+			stats_time(db->cached_db, STATS_TIME_LOAD, start);
+			PROBE(load_done, db->name, 0, 1, snap->cdb.header->n_records);
+			
+			return NSS_STATUS_SUCCESS;
+		}
+	}
+	
+	if (log_level >= LL_DBG)
+		DBG("open dir \"%s\"\n", dirpath);
+	
+	if (stat(dirpath, &snap->dir_stat) == -1)
+		memset(&snap->dir_stat, 0, sizeof(struct stat));
+	
+	// the keys of unchanged files are shared with $old, hence only new and changed files are parsed
+	phase = stats_start();
+	r = tables_load(dirpath, db->filter, old ? old->tables : 0, old ? old->n_tables : 0, &snap->tables, &snap->n_tables, &changed);
+	if (r == 0 && db->load_extra)
+		r = db->load_extra(snap, old, dirpath, &changed);
+	stats_time(db->cached_db, STATS_TIME_SCAN, phase);
+	
+	if (r == 0) {
+		phase = stats_start();
+		r = index_build(snap->tables, snap->n_tables, db->n_fields, db->numeric, db->id_field,
+			&snap->name_index, db->id_field >= 0 ? &snap->id_index : 0);
+		stats_time(db->cached_db, STATS_TIME_BUILD_INDEX, phase);
+	}
+	if (r) {
+		stats_add(db->cached_db, STATS_LOAD_ERRORS, 1);
+		snapshot_publish(&db->current, 0);
+		snapshot_put(snap);
+		PROBE(load_done, db->name, r, 0, 0);
+		
+		return NSS_STATUS_UNAVAIL;
+	}
+	
+	count_snapshot(db, snap);
+	snapshot_publish(&db->current, snap);
+	
+	if (shm_publish && (changed || !old))
+		publish_shm(db, snap, dirpath);
+	
+	stats_time(db->cached_db, STATS_TIME_LOAD, start);
+	PROBE(load_done, db->name, 0, 0, snap->name_index.n_entries);
+	
+	return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Makes sure that the database is loaded. Only the first lookup has to wait,
+ * later lookups continue with the current snapshot while another thread checks
+ * for changes or loads the directory again.
+ */
+enum nss_status db_update(struct db *db) {
+	enum nss_status retval;
+	struct snapshot *old;
+	
+	if (snapshot_current(&db->current)) {
+		if (!watch_due(&db->watch))
+			return NSS_STATUS_SUCCESS;
+		
+		if (pthread_mutex_trylock(&db->load_lock))
+			return NSS_STATUS_SUCCESS;
+	} else {
+		track_db(db);
+		pthread_mutex_lock(&db->load_lock);
+	}
+	
+	// only the writers change $current and they hold load_lock
+	old = db->current;
+	
+	retval = NSS_STATUS_SUCCESS;
+	if (!old || watch_changed(&db->watch))
+		retval = load(db, old);
+	
+	pthread_mutex_unlock(&db->load_lock);
+	
+	return retval;
+}
+
+// starts the enumeration at the first record of the current snapshot, the caller holds ent_lock
+static void rewind_ent(struct db *db) {
+	if (db->ent_snap)
+		snapshot_put(db->ent_snap);
+	
+	db->ent_snap = snapshot_get(&db->current);
+	db->cur_table = db->ent_snap ? db->ent_snap->tables : 0;
+	db->cur_pos = db->cur_table && db->ent_snap->n_tables ? db->cur_table->data : 0;
+	db->cur_record = 0;
+}
+
+enum nss_status db_setent(struct db *db) {
+	enum nss_status retval;
+	uint64_t start;
+	
+	start = stats_start();
+	stats_add(db->cached_db, STATS_SETENT, 1);
+	
+	retval = db_update(db);
+	if (retval == NSS_STATUS_SUCCESS) {
+		if (log_level >= LL_DBG)
+			DBG("setent(%s)\n", db->name);
+		
+		pthread_mutex_lock(&db->ent_lock);
+		rewind_ent(db);
+		pthread_mutex_unlock(&db->ent_lock);
+	}
+	
+	stats_time(db->cached_db, STATS_TIME_SETENT, start);
+	
+	return retval;
+}
+
+enum nss_status db_endent(struct db *db) {
+	if (log_level >= LL_DBG)
+		DBG("endent(%s)\n", db->name);
+	
+	track_db(db);
+	
+	pthread_mutex_lock(&db->ent_lock);
+	
+	if (db->ent_snap)
+		snapshot_put(db->ent_snap);
+	
+	db->ent_snap = 0;
+	db->cur_table = 0;
+	db->cur_pos = 0;
+	db->cur_record = 0;
+	
+	pthread_mutex_unlock(&db->ent_lock);
+	
+	// lookups in other threads keep using the snapshot until they are finished
+	pthread_mutex_lock(&db->load_lock);
+	
+	PROBE(teardown, db->name, db->current != 0);
+	
+	snapshot_publish(&db->current, 0);
+	watch_close(&db->watch);
+	
+	pthread_mutex_unlock(&db->load_lock);
+	
+	return NSS_STATUS_SUCCESS;
+}
+
+// stores the value of a numeric field in the result
+static void store_value(const struct db_field *field, void *result, long long value) {
+	char *dest = (char *) result + field->offset;
+	
+	switch (field->type) {
+		case DB_ID:
+			*(id_t *) dest = value;
+			break;
+		case DB_LONG:
+			*(long *) dest = value;
+			break;
+		case DB_ULONG:
+			*(unsigned long *) dest = value;
+			break;
+	}
+}
+
+// returns the number of entries in the comma-separated list $str
+static size_t list_count(const char *str, size_t len) {
+	size_t i, count;
+	
+	if (len == 0)
+		return 0;
+	
+	count = 1;
+	for (i=0; i < len; i++) {
+		if (str[i] == ',')
+			count += 1;
+	}
+	
+	return count;
+}
+
+// returns the buffer size db_fill() needs for a record with an already merged list
+static size_t record_size(struct db *db, struct field *fields) {
+	size_t size;
+	
+	size = fields_size(fields, db->n_fields, db->numeric);
+	if (db->list_field < 0)
+		return size;
+	
+	// the string list is aligned for a pointer, assuming an aligned buffer
+	size += (sizeof(char *) - size % sizeof(char *)) % sizeof(char *);
+	
+	return size + (list_count(fields[db->list_field].str, fields[db->list_field].len) + 1) * sizeof(char *);
+}
+
+/*
+ * Replaces the list field in $fields with the list that also contains the
+ * entries that db->list_extra() returns for the record and that are not in the
+ * list already. The merged list is stored in *list which is reallocated as
+ * necessary. Without extra entries, the field stays as it is and nothing is
+ * allocated.
+ */
+static int merge_list(struct db *db, struct snapshot *snap, struct field *fields, char **list, size_t *list_size) {
+	struct field *field = &fields[db->list_field];
+	const char *extra;
+	size_t extra_len, len;
+	char *new_list;
+	ssize_t r;
+	
+	if (db->list_extra(snap, fields, &extra, &extra_len))
+		return 0;
+	
+	// the existing entries, a ',' and the extra entries
+	len = field->len + 1 + extra_len;
+	
+	if (*list_size < len + 1) {
+		new_list = (char *) realloc(*list, len + 1);
+		if (!new_list)
+			return -ENOMEM;
+		
+		*list = new_list;
+		*list_size = len + 1;
+	}
+	
+	memcpy(*list, field->str, field->len);
+	
+	r = members_append(*list, field->len, extra, extra_len);
+	if (r < 0)
+		return r;
+	(*list)[r] = 0;
+	
+	field->str = *list;
+	field->len = r;
+	
+	return 0;
+}
+
+/*
+ * Splits the comma-separated $list in place and stores the array of its
+ * entries at *array_dest, the array is placed at $bufpos, aligned for a
+ * pointer.
+ */
+static enum nss_status split_list(char *list, size_t list_len, char ***array_dest, char *bufpos, char *bufend, int *errnop) {
+	char **array;
+	size_t j, k, count;
+	
+	count = list_count(list, list_len);
+	
+	// "allocate" the string list behind the strings, aligned for a pointer
+	bufpos += (sizeof(char *) - ((uintptr_t) bufpos % sizeof(char *))) % sizeof(char *);
+	if (bufpos > bufend || (size_t) (bufend - bufpos) < (count + 1) * sizeof(char *)) {
+		*errnop = ERANGE;
+		
+		return NSS_STATUS_TRYAGAIN;
+	}
+	
+	array = (char **) bufpos;
+	*array_dest = array;
+	
+	// fill the string list with pointers and replace ',' with 0
+	k = 0;
+	if (count > 0) {
+		array[k++] = list;
+		
+		for (j=0; j < list_len; j++) {
+			if (list[j] == ',') {
+				array[k++] = &list[j+1];
+				list[j] = 0;
+			}
+		}
+	}
+	
+	array[k] = 0;
+	
+	return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Copies the fields of a record into $result as described by the schema of
+ * $db. The list field is copied as string and split into an array of
+ * pointers behind the strings. The entries of db->list_extra() are only
+ * appended if $snap is set as the compiled database and the daemon provide
+ * the already merged list.
+ */
+static enum nss_status db_fill(struct db *db, struct snapshot *snap, void *result, struct field *fields, char *buffer, size_t buflen, int *errnop) {
+	const struct db_field *field;
+	char *bufpos, *bufend, *str, *list, ***array_dest;
+	const char *extra;
+	size_t i, list_len, extra_len;
+	ssize_t r;
+	
+	bufpos = buffer;
+	bufend = buffer + buflen;
+	list = 0;
+	list_len = 0;
+	array_dest = 0;
+	
+	for (i=0; i < db->n_fields; i++) {
+		field = &db->schema[i];
+		
+		if (field->type != DB_STR && field->type != DB_LIST) {
+			store_value(field, result, fields[i].value);
+			continue;
+		}
+		
+		str = copy_field(&fields[i], &bufpos, bufend);
+		if (!str) {
+			*errnop = ERANGE;
+			
+			return NSS_STATUS_TRYAGAIN;
+		}
+		
+		if (field->type == DB_STR) {
+			*(char **) ((char *) result + field->offset) = str;
+		} else {
+			list = str;
+			list_len = fields[i].len;
+			array_dest = (char ***) ((char *) result + field->offset);
+		}
+	}
+	
+	if (!list)
+		return NSS_STATUS_SUCCESS;
+	
+	// the list is the last string in $buffer, hence further entries are appended in place
+	if (snap && db->list_extra && db->list_extra(snap, fields, &extra, &extra_len) == 0) {
+		if (list + list_len + 1 != bufpos || (size_t) (bufend - (list + list_len)) < extra_len + 2) {
+			*errnop = ERANGE;
+			
+			return NSS_STATUS_TRYAGAIN;
+		}
+		
+		r = members_append(list, list_len, extra, extra_len);
+		if (r < 0) {
+			*errnop = ENOMEM;
+			
+			return NSS_STATUS_TRYAGAIN;
+		}
+		list_len = r;
+		list[list_len] = 0;
+		
+		bufpos = list + list_len + 1;
+	}
+	
+	return split_list(list, list_len, array_dest, bufpos, bufend, errnop);
+}
+
+/*
+ * Fills $result with the i-th record of the compiled database. The record is
+ * decoded directly into $buffer, hence only the pointers have to be set
+ * afterwards. *size is set to the size the strings of the record need.
+ */
+static enum nss_status db_fill_cdb(struct db *db, struct cdb *cdb, uint32_t i, void *result, struct field *fields, char *buffer, size_t buflen, size_t *size, int *errnop) {
+	const struct db_field *field;
+	char *pos, *list, ***array_dest;
+	size_t j, list_len;
+	int r;
+	
+	r = cdb_decode(cdb, i, fields, buffer, buflen, size);
+	if (r == -ERANGE) {
+		*errnop = ERANGE;
+		
+		return NSS_STATUS_TRYAGAIN;
+	}
+	if (r) {
+		*errnop = ENOENT;
+		
+		return NSS_STATUS_NOTFOUND;
+	}
+	
+	pos = buffer;
+	list = 0;
+	list_len = 0;
+	array_dest = 0;
+	for (j=0; j < db->n_fields; j++) {
+		field = &db->schema[j];
+		
+		if (field->type == DB_STR) {
+			*(char **) ((char *) result + field->offset) = pos;
+		} else if (field->type == DB_LIST) {
+			list = pos;
+			list_len = fields[j].len;
+			array_dest = (char ***) ((char *) result + field->offset);
+		} else {
+			store_value(field, result, fields[j].value);
+			continue;
+		}
+		
+		pos += fields[j].len + 1;
+	}
+	
+	if (!list)
+		return NSS_STATUS_SUCCESS;
+	
+	return split_list(list, list_len, array_dest, pos, buffer + buflen, errnop);
+}
+
+// this function is called to iterate through all entries
+enum nss_status db_getent(struct db *db, void *result, char *buffer, size_t buflen, int *errnop) {
+	struct field fields[DB_MAX_FIELDS];
+	enum nss_status retval;
+	uint64_t start;
+	size_t size;
+	char *next;
+	
+	if (log_level >= LL_DBG)
+		DBG("getent(%s)\n", db->name);
+	
+	start = stats_start();
+	stats_add(db->cached_db, STATS_GETENT, 1);
+	
+	track_db(db);
+	
+	pthread_mutex_lock(&db->ent_lock);
+	
+	if (!db->ent_snap) {
+		retval = db_update(db);
+		if (retval == NSS_STATUS_SUCCESS)
+			rewind_ent(db);
+		
+		if (!db->ent_snap) {
+			pthread_mutex_unlock(&db->ent_lock);
+			*errnop = ENOENT;
+			stats_time(db->cached_db, STATS_TIME_GETENT, start);
+			
+			return retval == NSS_STATUS_SUCCESS ? NSS_STATUS_UNAVAIL : retval;
+		}
+	}
+	
+	if (db->ent_snap->cdb.data) {
+		retval = db_fill_cdb(db, &db->ent_snap->cdb, db->cur_record, result, fields, buffer, buflen, &size, errnop);
+		if (retval == NSS_STATUS_SUCCESS)
+			db->cur_record += 1;
+	} else if (!db->cur_table || next_record(db->ent_snap->tables, db->ent_snap->n_tables, &db->cur_table, &db->cur_pos,
+		fields, db->n_fields, db->numeric, &next))
+	{
+		*errnop = ENOENT;
+		retval = NSS_STATUS_NOTFOUND;
+	} else {
+		// a caller that gets ERANGE receives the same record again
+		retval = db_fill(db, db->ent_snap, result, fields, buffer, buflen, errnop);
+		if (retval == NSS_STATUS_SUCCESS)
+			db->cur_pos = next;
+	}
+	
+	pthread_mutex_unlock(&db->ent_lock);
+	
+	stats_time(db->cached_db, STATS_TIME_GETENT, start);
+	
+	return retval;
+}
+
+/*
+ * finds the record of $name or, if $name is 0, of $id in the tables of $snap,
+ * the caller is between snapshot_enter() and snapshot_leave(). *scanned is
+ * increased by the number of records that were parsed.
+ */
+static int find_key(struct db *db, struct snapshot *snap, const char *name, id_t id, struct field *fields, size_t *scanned) {
+	struct table *cur_table;
+	char *cur_pos, *next;
+	struct index_entry *entry;
+	struct index *idx;
+	uint32_t hash;
+	size_t pos, len;
+	
+	len = 0;
+	if (name) {
+		len = strlen(name);
+		hash = index_hash_name(name, len);
+		idx = &snap->name_index;
+	} else {
+		hash = index_hash_id(id);
+		idx = &snap->id_index;
+	}
+	pos = INDEX_START;
+	
+	// the index only contains candidates, hence we parse the record and compare the key
+	while ((entry = index_next(idx, hash, &pos))) {
+		cur_table = &snap->tables[entry->table];
+		cur_pos = cur_table->data + entry->offset;
+		
+		if (next_record(snap->tables, snap->n_tables, &cur_table, &cur_pos, fields, db->n_fields, db->numeric, &next))
+			continue;
+		
+		*scanned += 1;
+		
+		if (name) {
+			if (fields[0].len == len && !memcmp(fields[0].str, name, len))
+				return 0;
+		} else {
+			if ((id_t) fields[db->id_field].value == id)
+				return 0;
+		}
+	}
+	
+	return -ENOENT;
+}
+
+/*
+ * copies the record of $name or $id into the result or keeps it for the retry
+ * with a larger buffer, the kept record already contains the merged list of
+ * $snap if $snap is set
+ */
+static enum nss_status fill_key(struct db *db, struct snapshot *snap, const char *name, id_t id, struct field *fields,
+	void *result, char *buffer, size_t buflen, int *errnop)
+{
+	enum nss_status retval;
+	char *list;
+	size_t list_size;
+	
+	retval = db_fill(db, snap, result, fields, buffer, buflen, errnop);
+	if (retval != NSS_STATUS_TRYAGAIN || *errnop != ERANGE)
+		return retval;
+	
+	if (snap && db->list_extra) {
+		list = 0;
+		list_size = 0;
+		
+		if (merge_list(db, snap, fields, &list, &list_size) == 0)
+			retry_store(db->cached_db, name, id, fields, db->n_fields, record_size(db, fields));
+		free(list);
+		
+		return retval;
+	}
+	
+	retry_store(db->cached_db, name, id, fields, db->n_fields, record_size(db, fields));
+	
+	return retval;
+}
+
+/*
+ * looks up $name or $id in the compiled database of $snap and decodes the
+ * record into the result or, if $buffer is too small, into a temporary buffer
+ * to keep it for the retry with a larger buffer
+ */
+static enum nss_status fill_cdb_key(struct db *db, struct snapshot *snap, const char *name, id_t id, void *result, char *buffer, size_t buflen, int *errnop) {
+	struct field fields[DB_MAX_FIELDS];
+	enum nss_status retval;
+	uint32_t record;
+	size_t size;
+	char *copy;
+	
+	if (name ? cdb_find_name(&snap->cdb, name, &record) : cdb_find_id(&snap->cdb, id, &record)) {
+		*errnop = ENOENT;
+		
+		return NSS_STATUS_NOTFOUND;
+	}
+	
+	size = 0;
+	retval = db_fill_cdb(db, &snap->cdb, record, result, fields, buffer, buflen, &size, errnop);
+	if (retval != NSS_STATUS_TRYAGAIN || *errnop != ERANGE)
+		return retval;
+	
+	// the strings fit but not the list, the decoded fields are still valid
+	if (size <= buflen) {
+		retry_store(db->cached_db, name, id, fields, db->n_fields, record_size(db, fields));
+		
+		return retval;
+	}
+	
+	copy = (char *) malloc(size);
+	if (copy && cdb_decode(&snap->cdb, record, fields, copy, size, &size) == 0)
+		retry_store(db->cached_db, name, id, fields, db->n_fields, record_size(db, fields));
+	free(copy);
+	
+	return retval;
+}
+
+// looks up the record of $name or, if $name is 0, of $id and counts the parsed records in *scanned
+static enum nss_status lookup(struct db *db, const char *name, id_t id, void *result, char *buffer, size_t buflen, int *errnop, size_t *scanned) {
+	enum nss_status retval;
+	struct field fields[DB_MAX_FIELDS];
+	struct snapshot *snap;
+	unsigned int token;
+	int r;
+	
+	if (log_level >= LL_DBG) {
+		if (name)
+			DBG("lookup(%s, \"%s\")\n", db->name, name);
+		else
+			DBG("lookup(%s, %u)\n", db->name, (unsigned int) id);
+	}
+	
+	// glibc repeats the lookup with a larger buffer after ERANGE, the kept record is already merged
+	if (retry_find(db->cached_db, name, id, fields, db->n_fields) == 0) {
+		stats_add(db->cached_db, STATS_RETRIES, 1);
+		
+		// keep the record only as long as the buffer is still too small
+		retval = db_fill(db, 0, result, fields, buffer, buflen, errnop);
+		if (retval != NSS_STATUS_TRYAGAIN || *errnop != ERANGE)
+			retry_clear();
+		
+		return retval;
+	}
+	
+	// ask the caching daemon first, then we do not have to load the directory at all
+	r = cached_lookup(db->cached_db, db_dirpath(db), name, id, fields, db->n_fields, db->numeric);
+	if (r == 0 || r == -ENOENT)
+		stats_add(db->cached_db, STATS_CACHED, 1);
+	if (r == 0)
+		return fill_key(db, 0, name, id, fields, result, buffer, buflen, errnop);
+	if (r == -ENOENT) {
+		*errnop = ENOENT;
+		
+		return NSS_STATUS_NOTFOUND;
+	}
+	
+	// until the directory is loaded, try the file named after the name first, a merged list can come from any file though
+	if (name && !db->list_extra && table_by_filename() && !snapshot_current(&db->current)) {
+		struct table table;
+		
+		if (table_find_file(db_dirpath(db), name, db->filter, &table, fields, db->n_fields, db->numeric) == 0) {
+			stats_add(db->cached_db, STATS_BY_FILENAME, 1);
+			*scanned = 1;
+			retval = fill_key(db, 0, name, id, fields, result, buffer, buflen, errnop);
+			table_close(&table);
+			
+			return retval;
+		}
+	}
+	
+	retval = db_update(db);
+	if (retval != NSS_STATUS_SUCCESS) {
+		*errnop = ENOENT;
+		
+		return retval;
+	}
+	
+	token = snapshot_enter();
+	
+	// endent() in another thread might have dropped the database in the meantime
+	snap = snapshot_current(&db->current);
+	if (!snap) {
+		*errnop = ENOENT;
+		retval = NSS_STATUS_UNAVAIL;
+	} else if (snap->cdb.data) {
+		// the compiled database contains the already merged list
+		retval = fill_cdb_key(db, snap, name, id, result, buffer, buflen, errnop);
+	} else if (find_key(db, snap, name, id, fields, scanned)) {
+		*errnop = ENOENT;
+		retval = NSS_STATUS_NOTFOUND;
+	} else {
+		retval = fill_key(db, snap, name, id, fields, result, buffer, buflen, errnop);
+	}
+	
+	snapshot_leave(token);
+	
+	return retval;
+}
+
+enum nss_status db_lookup(struct db *db, const char *name, id_t id, void *result, char *buffer, size_t buflen, int *errnop) {
+	enum nss_status retval;
+	uint64_t start;
+	size_t scanned;
+	
+	PROBE(lookup_entry, db->name, name, id);
+	
+	start = stats_start();
+	scanned = 0;
+	
+	retval = lookup(db, name, id, result, buffer, buflen, errnop, &scanned);
+	
+	stats_add(db->cached_db, STATS_LOOKUPS, 1);
+	if (retval == NSS_STATUS_SUCCESS)
+		stats_add(db->cached_db, STATS_HITS, 1);
+	else if (retval == NSS_STATUS_NOTFOUND)
+		stats_add(db->cached_db, STATS_MISSES, 1);
+	else if (retval == NSS_STATUS_TRYAGAIN && *errnop == ERANGE)
+		stats_add(db->cached_db, STATS_ERANGE, 1);
+	stats_time(db->cached_db, STATS_TIME_LOOKUP, start);
+	
+	// the status tells hits (1) from misses (0) and errors, ERANGE is a negative errno
+	PROBE(lookup_return, db->name, name, id, retval, retval == NSS_STATUS_TRYAGAIN ? -*errnop : 0, scanned);
+	
+	return retval;
+}
+
+/*
+ * Reports the buffer size that db_lookup() needs for $name or $id, $result
+ * is only used as scratch space. The record is kept for the following lookup,
+ * hence it does not search again.
+ */
+enum nss_status db_lookup_size(struct db *db, const char *name, id_t id, void *result, size_t *size, int *errnop) {
+	enum nss_status retval;
+	char buffer;
+	
+	retval = db_lookup(db, name, id, result, &buffer, 0, errnop);
+	if (retval != NSS_STATUS_TRYAGAIN || *errnop != ERANGE)
+		return retval;
+	
+	*size = retry_size();
+	if (*size == 0) {
+		*errnop = ENOMEM;
+		
+		return NSS_STATUS_TRYAGAIN;
+	}
+	
+	return NSS_STATUS_SUCCESS;
+}
+
+// the number of keys whose index entries are prefetched ahead of the current key
+#define BATCH_PREFETCH 8
+
+// the free space in the pool before a name is decoded from the compiled database
+#define BATCH_NAME_RESERVE 256
+
+struct batch_key {
+	const char *name;
+	id_t id;
+};
+
+struct batch_result {
+	int found;
+	id_t id;
+	// offset of the name in the pool
+	size_t name;
+};
+
+// collects the names of a batch in one buffer
+struct batch_pool {
+	char *data;
+	size_t size;
+	size_t alloc;
+};
+
+// makes room for $len more bytes in $pool
+static int pool_reserve(struct batch_pool *pool, size_t len) {
+	size_t alloc;
+	char *data;
+	
+	if (pool->alloc - pool->size >= len)
+		return 0;
+	
+	alloc = pool->alloc ? pool->alloc * 2 : 4096;
+	while (alloc - pool->size < len)
+		alloc *= 2;
+	
+	data = (char *) realloc(pool->data, alloc);
+	if (!data)
+		return -ENOMEM;
+	
+	pool->data = data;
+	pool->alloc = alloc;
+	
+	return 0;
+}
+
+static void batch_prefetch(struct db *db, struct snapshot *snap, struct batch_key *key) {
+	if (snap->cdb.data) {
+		if (key->name)
+			cdb_prefetch_name(&snap->cdb, key->name);
+		else
+			cdb_prefetch_id(&snap->cdb, key->id);
+	} else {
+		if (key->name)
+			index_prefetch(&snap->name_index, index_hash_name(key->name, strlen(key->name)));
+		else
+			index_prefetch(&snap->id_index, index_hash_id(key->id));
+	}
+}
+
+/*
+ * Looks up $key in $snap and stores its id and, if $pool is set, appends its
+ * name to $pool. The caller is between snapshot_enter() and snapshot_leave().
+ */
+static int batch_find(struct db *db, struct snapshot *snap, struct batch_key *key, struct batch_result *result, struct batch_pool *pool, size_t *scanned) {
+	struct field fields[DB_MAX_FIELDS];
+	uint32_t record;
+	size_t len;
+	int r;
+	
+	result->found = 0;
+	
+	if (snap->cdb.data) {
+		if (key->name ? cdb_find_name(&snap->cdb, key->name, &record) : cdb_find_id(&snap->cdb, key->id, &record))
+			return -ENOENT;
+		
+		if (!pool) {
+			r = cdb_decode_key(&snap->cdb, record, 0, 0, &len, &result->id);
+			result->found = r == 0;
+			
+			return r;
+		}
+		
+		// most names fit, then the record is only parsed once
+		r = pool_reserve(pool, BATCH_NAME_RESERVE);
+		if (r == 0)
+			r = cdb_decode_key(&snap->cdb, record, pool->data + pool->size, pool->alloc - pool->size, &len, &result->id);
+		if (r == -ERANGE) {
+			r = pool_reserve(pool, len + 1);
+			if (r == 0)
+				r = cdb_decode_key(&snap->cdb, record, pool->data + pool->size, pool->alloc - pool->size, &len, &result->id);
+		}
+		if (r)
+			return r;
+	} else {
+		if (find_key(db, snap, key->name, key->id, fields, scanned))
+			return -ENOENT;
+		
+		result->id = (id_t) fields[db->id_field].value;
+		if (!pool) {
+			result->found = 1;
+			
+			return 0;
+		}
+		
+		len = fields[0].len;
+		r = pool_reserve(pool, len + 1);
+		if (r)
+			return r;
+		
+		memcpy(pool->data + pool->size, fields[0].str, len);
+		pool->data[pool->size + len] = 0;
+	}
+	
+	result->found = 1;
+	result->name = pool->size;
+	pool->size += len + 1;
+	
+	return 0;
+}
+
+/*
+ * Looks up the $n distinct $keys in the current snapshot, sorted keys let the
+ * lookups prefetch the index entries of the following keys. Unlike db_lookup(),
+ * this does not ask the caching daemon, the database is loaded once for the
+ * whole batch instead.
+ */
+static int batch_lookup(struct db *db, struct batch_key *keys, size_t n, struct batch_result *results, struct batch_pool *pool) {
+	struct snapshot *snap;
+	unsigned int token;
+	size_t i, hits, scanned;
+	int r;
+	
+	if (db_update(db) != NSS_STATUS_SUCCESS)
+		return -ENOENT;
+	
+	token = snapshot_enter();
+	
+	// endent() in another thread might have dropped the database in the meantime
+	snap = snapshot_current(&db->current);
+	if (!snap) {
+		snapshot_leave(token);
+		
+		return -ENOENT;
+	}
+	
+	for (i=0; i < n && i < BATCH_PREFETCH; i++)
+		batch_prefetch(db, snap, &keys[i]);
+	
+	r = 0;
+	hits = 0;
+	scanned = 0;
+	for (i=0; i < n; i++) {
+		if (i + BATCH_PREFETCH < n)
+			batch_prefetch(db, snap, &keys[i + BATCH_PREFETCH]);
+		
+		r = batch_find(db, snap, &keys[i], &results[i], pool, &scanned);
+		if (r == 0)
+			hits += 1;
+		else if (r != -ENOENT)
+			break;
+		r = 0;
+	}
+	
+	snapshot_leave(token);
+	
+	stats_add(db->cached_db, STATS_LOOKUPS, i);
+	stats_add(db->cached_db, STATS_HITS, hits);
+	stats_add(db->cached_db, STATS_MISSES, i - hits);
+	
+	PROBE(batch_return, db->name, n, hits, r, scanned);
+	
+	return r;
+}
+
+/*
+ * Sorts the values by their upper 32 bits with a radix sort, the lower 32 bits
+ * are the position of the key in the array of the caller. A batch has many
+ * keys but only 32-bit ones, hence this is much faster than qsort().
+ */
+static int batch_sort(uint64_t *values, size_t n) {
+	uint64_t *tmp, *src, *dst, *swap;
+	size_t count[256], i, sum, c;
+	unsigned int shift;
+	
+	tmp = (uint64_t *) malloc(sizeof(uint64_t) * (n ? n : 1));
+	if (!tmp)
+		return -ENOMEM;
+	
+	// an even number of passes, hence the result ends up in $values
+	src = values;
+	dst = tmp;
+	for (shift=32; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i=0; i < n; i++)
+			count[(src[i] >> shift) & 0xff] += 1;
+		
+		sum = 0;
+		for (i=0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		
+		for (i=0; i < n; i++)
+			dst[count[(src[i] >> shift) & 0xff]++] = src[i];
+		
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	
+	free(tmp);
+	
+	return 0;
+}
+
+/*
+ * Collects the distinct keys of the sorted $values in $keys and returns their
+ * number, unique_of[pos] is set to the distinct key of the key at $pos. Names
+ * are sorted by their hash and compared in addition, equal names are adjacent
+ * then. Different names with the same hash might alternate, which only costs
+ * another lookup.
+ */
+static size_t batch_unique(uint64_t *values, size_t n, const id_t *ids, const char *const *names, struct batch_key *keys, size_t *unique_of) {
+	size_t i, pos, n_unique;
+	uint32_t last;
+	
+	n_unique = 0;
+	last = 0;
+	for (i=0; i < n; i++) {
+		pos = (uint32_t) values[i];
+		
+		if (n_unique == 0 || (uint32_t) (values[i] >> 32) != last || (names && strcmp(names[pos], keys[n_unique - 1].name))) {
+			keys[n_unique].name = names ? names[pos] : 0;
+			keys[n_unique].id = ids ? ids[pos] : 0;
+			last = (uint32_t) (values[i] >> 32);
+			n_unique += 1;
+		}
+		
+		unique_of[pos] = n_unique - 1;
+	}
+	
+	return n_unique;
+}
+
+/*
+ * Looks up the $n $ids or, if $ids is 0, $names. Every distinct key is only
+ * looked up once, the caller frees the allocated *unique_of and *results.
+ */
+static int batch_run(struct db *db, const id_t *ids, const char *const *names, size_t n, size_t **unique_of, struct batch_result **results, struct batch_pool *pool) {
+	struct batch_key *keys;
+	uint64_t *values;
+	size_t i, n_unique;
+	int r;
+	
+	// the position of a key has to fit into the lower half of its sort value
+	if (n > UINT32_MAX)
+		return -EINVAL;
+	
+	// malloc(0) might return 0
+	values = (uint64_t *) malloc(sizeof(uint64_t) * (n ? n : 1));
+	keys = (struct batch_key *) malloc(sizeof(struct batch_key) * (n ? n : 1));
+	*unique_of = (size_t *) malloc(sizeof(size_t) * (n ? n : 1));
+	*results = (struct batch_result *) malloc(sizeof(struct batch_result) * (n ? n : 1));
+	if (!values || !keys || !*unique_of || !*results) {
+		r = -ENOMEM;
+		goto out;
+	}
+	
+	for (i=0; i < n; i++) {
+		if (ids)
+			values[i] = (uint64_t) ids[i] << 32 | i;
+		else
+			values[i] = (uint64_t) index_hash_name(names[i], strlen(names[i])) << 32 | i;
+	}
+	
+	r = batch_sort(values, n);
+	if (r)
+		goto out;
+	
+	n_unique = batch_unique(values, n, ids, names, keys, *unique_of);
+	
+	r = batch_lookup(db, keys, n_unique, *results, pool);
+	
+out:
+	free(values);
+	free(keys);
+	if (r) {
+		free(*unique_of);
+		free(*results);
+	}
+	
+	return r;
+}
+
+/*
+ * Resolves $n ids to names with one call. *names is set to a malloc'ed array
+ * of $n pointers followed by the names, the caller frees it at once. The
+ * pointer of an id that was not found is 0 and repeated ids share one name.
+ * Returns 0 or a negative errno, -ENOENT if the database cannot be loaded.
+ */
+int db_ids_to_names(struct db *db, const id_t *ids, size_t n, char ***names) {
+	struct batch_result *results;
+	struct batch_pool pool;
+	size_t i, *unique_of;
+	char **array, *strings;
+	int r;
+	
+	memset(&pool, 0, sizeof(struct batch_pool));
+	
+	r = batch_run(db, ids, 0, n, &unique_of, &results, &pool);
+	if (r) {
+		free(pool.data);
+		return r;
+	}
+	
+	array = (char **) malloc(sizeof(char *) * n + pool.size + 1);
+	if (array) {
+		strings = (char *) (array + n);
+		if (pool.size)
+			memcpy(strings, pool.data, pool.size);
+		
+		for (i=0; i < n; i++)
+			array[i] = results[unique_of[i]].found ? strings + results[unique_of[i]].name : 0;
+		
+		*names = array;
+	} else {
+		r = -ENOMEM;
+	}
+	
+	free(pool.data);
+	free(unique_of);
+	free(results);
+	
+	return r;
+}
+
+/*
+ * Resolves $n names to ids with one call, the id of a name that was not found
+ * is set to (id_t) -1. Returns 0 or a negative errno, -ENOENT if the database
+ * cannot be loaded.
+ */
+int db_names_to_ids(struct db *db, const char *const *names, size_t n, id_t *ids) {
+	struct batch_result *results;
+	size_t i, *unique_of;
+	int r;
+	
+	for (i=0; i < n; i++) {
+		if (!names[i])
+			return -EINVAL;
+	}
+	
+	r = batch_run(db, 0, names, n, &unique_of, &results, 0);
+	if (r)
+		return r;
+	
+	for (i=0; i < n; i++)
+		ids[i] = results[unique_of[i]].found ? results[unique_of[i]].id : (id_t) -1;
+	
+	free(unique_of);
+	free(results);
+	
+	return 0;
+}
+
+// adds all files and records of the tables of $snap to $b
+static int add_tables(struct db *db, struct snapshot *snap, struct cdb_builder *b) {
+	struct field fields[DB_MAX_FIELDS];
+	struct table *l_cur_table;
+	char *l_cur_pos, *next, *list;
+	size_t i, list_size;
+	int r;
+	
+	cdb_builder_init(b, db->name, db->n_fields, db->numeric, db->id_field, db->list_field, &snap->dir_stat);
+	
+	for (i=0; i < snap->n_tables; i++) {
+		r = cdb_builder_add_file(b, strrchr(snap->tables[i].filepath, '/') + 1, &snap->tables[i].stat);
+		if (r)
+			return r;
+	}
+	
+	if (db->add_extra_files) {
+		r = db->add_extra_files(snap, b);
+		if (r)
+			return r;
+	}
+	
+	list = 0;
+	list_size = 0;
+	
+	l_cur_table = snap->tables;
+	l_cur_pos = snap->n_tables ? snap->tables->data : 0;
+	
+	r = 0;
+	while (next_record(snap->tables, snap->n_tables, &l_cur_table, &l_cur_pos, fields, db->n_fields, db->numeric, &next) == 0) {
+		// store the list with the extra entries already merged
+		if (db->list_extra) {
+			r = merge_list(db, snap, fields, &list, &list_size);
+			if (r)
+				break;
+		}
+		
+		r = cdb_builder_add_record(b, fields);
+		if (r)
+			break;
+		
+		l_cur_pos = next;
+	}
+	
+	free(list);
+	
+	return r;
+}
+
+/*
+ * Building the copy takes longer than scanning the directory, about 1 s for
+ * 200,000 records, hence only long-running processes like nss-confd-cached
+ * set this and publish a copy after every change. The module in other
+ * processes only attaches to it.
+ */
+int shm_publish = 0;
+
+// lets the following processes attach to a copy instead of scanning the directory again
+static void publish_shm(struct db *db, struct snapshot *snap, const char *dirpath) {
+	struct cdb_builder b;
+	char *shm_path;
+	uint64_t start;
+	
+	shm_path = cdb_shm_path(db->name, dirpath, geteuid());
+	if (!shm_path)
+		return;
+	
+	start = stats_start();
+	
+	if (add_tables(db, snap, &b) == 0)
+		cdb_publish(&b, shm_path, db->shm_mode);
+	
+	cdb_builder_free(&b);
+	free(shm_path);
+	
+	stats_time(db->cached_db, STATS_TIME_PUBLISH_SHM, start);
+}
+
+/*
+ * A forked child only has the thread that called fork(). A lock that another
+ * thread held at that moment would stay locked in the child, hence the child
+ * initializes the locks of all databases that were used so far again.
+ */
+static pthread_mutex_t tracked_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tracked_once = PTHREAD_ONCE_INIT;
+static struct db *tracked_dbs;
+
+static void db_atfork_child(void) {
+	struct db *db;
+	
+	pthread_mutex_init(&tracked_lock, 0);
+	
+	for (db = tracked_dbs; db; db = db->next_tracked) {
+		pthread_mutex_init(&db->load_lock, 0);
+		pthread_mutex_init(&db->ent_lock, 0);
+	}
+}
+
+static void tracked_init(void) {
+	pthread_atfork(0, 0, db_atfork_child);
+}
+
+// adds $db to the databases of db_atfork_child() before its locks are taken for the first time
+static void track_db(struct db *db) {
+	if (__atomic_load_n(&db->tracked, __ATOMIC_ACQUIRE))
+		return;
+	
+	pthread_once(&tracked_once, tracked_init);
+	
+	pthread_mutex_lock(&tracked_lock);
+	if (!db->tracked) {
+		db->next_tracked = tracked_dbs;
+		tracked_dbs = db;
+		__atomic_store_n(&db->tracked, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&tracked_lock);
+}
+
+// adds all files and records of the directory to the compiled database
+int db_compile(struct db *db, struct cdb_builder *b) {
+	struct snapshot *snap;
+	int r;
+	
+	if (db_update(db) != NSS_STATUS_SUCCESS)
+		return -ENOENT;
+	
+	snap = snapshot_get(&db->current);
+	if (!snap)
+		return -ENOENT;
+	
+	// the records have to come from the directory itself
+	if (snap->cdb.data)
+		r = -EBUSY;
+	else
+		r = add_tables(db, snap, b);
+	
+	snapshot_put(snap);
+	
+	return r;
+}
@@ -15,639 +15,379 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <errno.h>
-#include <limits.h>
+#include <stddef.h>
 
 #include <sys/types.h>
-#include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
-#include <regex.h>
 
 #include <nss.h>
 #include <grp.h>
 
 #include "nss-confd.h"
+#include "nss-confd-batch.h"
 
-static struct table *tables = 0;
-static size_t n_tables = 0;
-static struct table *cur_table = 0;
-static char *cur_pos = 0;
-
-static regex_t gr_regex;
+#define N_FIELDS 4
+#define NUMERIC_FIELDS (1 << 2)
 
 #ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
-static struct table *split_members = 0;
-static size_t n_split_members = 0;
+static int is_membership(const struct dirent *ep) {
+	size_t slen;
+	
+	slen = strlen(ep->d_name);
+	
+	return slen > 11 && !strcmp(&ep->d_name[slen - 11], ".membership");
+}
 
-static regex_t gm_regex;
+static int select_split_members(const struct dirent *ep) {
+	return ep->d_type == DT_REG && is_membership(ep);
+}
 #endif
 
-// initialize this module - e.g., open all files
-enum nss_status _nss_confd_setgrent(void) {
-	struct dirent *ep;
-	int i, r, n_entries, abort;
-	char *dirpath;
-	struct dirent **namelist;
+static int select_table(const struct dirent *ep) {
+	if (ep->d_type != DT_REG)
+		return 0;
 	
+	#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
+	if (is_membership(ep))
+		return 0;
+	#endif
 	
-	if (tables)
-		return NSS_STATUS_SUCCESS;
+	return 1;
+}
+
+#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
+// loads the .membership files of the directory and merges their members by group
+static int load_split_members(struct snapshot *snap, struct snapshot *old, const char *dirpath, int *changed) {
+	int r, members_changed;
 	
-	if (getenv("NSS_CONFD_DEBUG")) {
-		long long value;
-		
-		r = parse_llong(getenv("NSS_CONFD_DEBUG"), &value);
-		if (r == 0) {
-			log_level = value;
-		}
-	}
+	r = tables_load(dirpath, select_split_members, old ? old->split_members : 0, old ? old->n_split_members : 0,
+		&snap->split_members, &snap->n_split_members, &members_changed);
+	if (r)
+		return r;
 	
-	if (log_level >= LL_DBG)
-		DBG("_nss_confd_setgrent()\n");
+	*changed |= members_changed;
 	
-	dirpath = getenv("NSS_CONFD_GROUP_DIR");
+	// parse the .membership files once instead of for every group that is returned
+	return members_map_build(&snap->split_map, snap->split_members, snap->n_split_members);
+}
+
+// adds the .membership files to the compiled database, so it is rebuilt if one of them changes
+static int add_split_files(struct snapshot *snap, struct cdb_builder *b) {
+	size_t i;
+	int r;
 	
-	if (dirpath == 0)
-		dirpath = GROUP_DIR;
+	for (i=0; i < snap->n_split_members; i++) {
+		r = cdb_builder_add_file(b, strrchr(snap->split_members[i].filepath, '/') + 1, &snap->split_members[i].stat);
+		if (r)
+			return r;
+	}
 	
-	if (log_level >= LL_DBG)
-		DBG("open dir \"%s\"\n", dirpath);
+	return 0;
+}
+
+// returns the split members of the group in $fields
+static int split_members(struct snapshot *snap, struct field *fields, const char **members, size_t *members_len) {
+	return members_map_find(&snap->split_map, fields[0].str, fields[0].len, members, members_len);
+}
+#endif
+
+static const struct db_field schema[N_FIELDS] = {
+	{ DB_STR, offsetof(struct group, gr_name) },
+	{ DB_STR, offsetof(struct group, gr_passwd) },
+	{ DB_ID, offsetof(struct group, gr_gid) },
+	{ DB_LIST, offsetof(struct group, gr_mem) },
+};
+
+static struct db db = {
+	.name = "group",
+	.cached_db = CACHED_GROUP,
+	.dir_env = "NSS_CONFD_GROUP_DIR",
+	.default_dir = GROUP_DIR,
+	.index_env = "NSS_CONFD_GROUP_INDEX",
+	.shm_mode = 0644,
+	.schema = schema,
+	.n_fields = N_FIELDS,
+	.numeric = NUMERIC_FIELDS,
+	.id_field = 2,
+	.list_field = 3,
+	.filter = select_table,
+	#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
+	.load_extra = load_split_members,
+	.add_extra_files = add_split_files,
+	.list_extra = split_members,
+	#endif
+	DB_STATE_INIT,
+};
+
+// initialize this module - e.g., open all files
+enum nss_status _nss_confd_setgrent(void) {
+	return db_setent(&db);
+}
+
+// shutdown this module
+enum nss_status _nss_confd_endgrent(void) {
+	return db_endent(&db);
+}
+
+// this function is called to iterate through all entries
+enum nss_status _nss_confd_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop) {
+	return db_getent(&db, result, buffer, buflen, errnop);
+}
+
+enum nss_status _nss_confd_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop) {
+	return db_lookup(&db, 0, gid, result, buffer, buflen, errnop);
+}
+
+enum nss_status _nss_confd_getgrnam_r(const char *name, struct group *result, char *buffer, size_t buflen, int *errnop) {
+	return db_lookup(&db, name, 0, result, buffer, buflen, errnop);
+}
+
+/*
+ * Reports the buffer size that _nss_confd_getgrnam_r() needs for $name. The
+ * record is kept for the following lookup, hence it does not search again.
+ */
+enum nss_status _nss_confd_getgrnam_size(const char *name, size_t *size, int *errnop) {
+	struct group result;
 	
-	n_entries = scandir(dirpath, &namelist, 0, alphasort);
-	if (n_entries < 0) {
-		if (log_level >= LL_ERROR)
-			ERROR("scandir(%s) failed: %s\n", dirpath, strerror(errno));
-		
-		return NSS_STATUS_UNAVAIL;
-	}
+	return db_lookup_size(&db, name, 0, &result, size, errnop);
+}
+
+// reports the buffer size that _nss_confd_getgrgid_r() needs for $gid
+enum nss_status _nss_confd_getgrgid_size(gid_t gid, size_t *size, int *errnop) {
+	struct group result;
 	
-	abort = 0;
-	for (i = 0; i < n_entries; i++) {
-		ep = namelist[i];
-		
-		if (ep->d_type != DT_REG)
-			continue;
+	return db_lookup_size(&db, 0, gid, &result, size, errnop);
+}
+
+// builds the index from every member to its groups from the tables of $snap
+static struct member_index *build_users(struct snapshot *snap) {
+	struct field fields[N_FIELDS];
+	struct member_index *users;
+	struct table *l_cur_table;
+	char *l_cur_pos, *next;
+	int r;
+	
+	users = (struct member_index *) calloc(1, sizeof(struct member_index));
+	if (!users)
+		return 0;
+	
+	l_cur_table = snap->tables;
+	l_cur_pos = snap->n_tables ? snap->tables->data : 0;
+	
+	r = 0;
+	while (r == 0 && next_record(snap->tables, snap->n_tables, &l_cur_table, &l_cur_pos, fields, N_FIELDS, NUMERIC_FIELDS, &next) == 0) {
+		r = member_index_add(users, fields[3].str, fields[3].len, fields[2].value);
 		
 		#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
-		size_t slen;
-		
-		slen = strlen(ep->d_name);
-		
-		if (slen > 11) {
-			if (!strcmp(&ep->d_name[slen - 11], ".membership")) {
-				n_split_members += 1;
-				split_members = (struct table *) realloc(split_members, sizeof(struct table) * n_split_members);
-				if (!split_members) {
-					if (log_level >= LL_ERROR)
-						ERROR("realloc(%zu) failed: %s\n", sizeof(struct table) * n_split_members, strerror(errno));
-					
-					abort = 1;
-					break;
-				}
-				
-				cur_table = &split_members[n_split_members-1];
-				
-				asprintf(&cur_table->filepath, "%s/%s", dirpath, ep->d_name);
-				
-				cur_table->fd = open(cur_table->filepath, O_RDONLY);
-				
-				if (fstat(cur_table->fd, &cur_table->stat) == -1) {
-					close(cur_table->fd);
-					free(cur_table->filepath);
-					
-					n_split_members -= 1;
-					
-					continue;
-				}
-				
-				cur_table->data = mmap(0, cur_table->stat.st_size, PROT_READ, MAP_SHARED, cur_table->fd, 0);
-				if (cur_table->data == MAP_FAILED) {
-					close(cur_table->fd);
-					free(cur_table->filepath);
-					
-					n_split_members -= 1;
-					
-					continue;
-				}
-				
-				continue;
-			}
-		}
-		#endif
-		
-		n_tables += 1;
-		tables = (struct table *) realloc(tables, sizeof(struct table) * n_tables);
-		if (!tables) {
-			if (log_level >= LL_ERROR)
-				ERROR("realloc(%zu) failed: %s\n", sizeof(struct table) * n_tables, strerror(errno));
+		{
+			const char *split;
+			size_t split_len;
 			
-			abort = 1;
-			break;
-		}
-		
-		cur_table = &tables[n_tables-1];
-		
-		asprintf(&cur_table->filepath, "%s/%s", dirpath, ep->d_name);
-		
-		cur_table->fd = open(cur_table->filepath, O_RDONLY);
-		
-		if (fstat(cur_table->fd, &cur_table->stat) == -1) {
-			close(cur_table->fd);
-			free(cur_table->filepath);
-			
-			n_tables -= 1;
-			
-			continue;
+			if (r == 0 && members_map_find(&snap->split_map, fields[0].str, fields[0].len, &split, &split_len) == 0)
+				r = member_index_add(users, split, split_len, fields[2].value);
 		}
+		#endif
 		
-		cur_table->data = mmap(0, cur_table->stat.st_size, PROT_READ, MAP_SHARED, cur_table->fd, 0);
-		if (cur_table->data == MAP_FAILED) {
-			close(cur_table->fd);
-			free(cur_table->filepath);
-			
-			n_tables -= 1;
-			
-			continue;
-		}
-	}
-	
-	for (i = 0; i < n_entries; i++) {
-		free(namelist[i]);
+		l_cur_pos = next;
 	}
-	free(namelist);
-	
-	if (abort)
-		return NSS_STATUS_UNAVAIL;
-	
-	cur_table = tables;
-	if (cur_table)
-		cur_pos = cur_table->data;
 	
-	#define COLUMN "([^:]*)"
-	r = regcomp(&gr_regex, "^" COLUMN ":" COLUMN ":" COLUMN ":" COLUMN "$", REG_EXTENDED | REG_NEWLINE);
 	if (r) {
-		if (log_level >= LL_ERROR)
-			ERROR("regcomp gr_regex failed: %s\n", strerror(r));
-		
-		// TODO should we free $tables or is a caller expected to call _nss_confd_endgrent()?
-		
-		return NSS_STATUS_UNAVAIL;
-	} else {
-		// although regcomp does not use errno, it might be set afterwards
-		// which is permitted by the errno convention
-		errno = 0;
+		member_index_free(users);
+		free(users);
+		return 0;
 	}
 	
-	#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
-	r = regcomp(&gm_regex, "^" COLUMN ":" COLUMN "$", REG_EXTENDED | REG_NEWLINE);
-	if (r) {
-		if (log_level >= LL_ERROR)
-			ERROR("regcomp gr_regex failed: %s\n", strerror(r));
-		
-		// TODO should we free $tables or is a caller expected to call _nss_confd_endgrent()?
-		
-		return NSS_STATUS_UNAVAIL;
-	} else {
-		// although regcomp does not use errno, it might be set afterwards
-		// which is permitted by the errno convention
-		errno = 0;
-	}
-	#endif
+	member_index_sort(users);
 	
-	return NSS_STATUS_SUCCESS;
+	if (log_level >= LL_DBG)
+		DBG("indexed %zu memberships\n", users->n_entries);
+	
+	return users;
 }
 
-// shutdown this module
-enum nss_status _nss_confd_endgrent(void) {
-	size_t i;
+/*
+ * Returns the member index of $snap and builds it on the first call. The
+ * snapshot is immutable otherwise, hence concurrent callers might both build
+ * it and the one that loses the race frees its copy.
+ */
+static struct member_index *get_users(struct snapshot *snap) {
+	struct member_index *users, *expected;
 	
-	if (log_level >= LL_DBG)
-		DBG("_nss_confd_endgrent()\n");
+	users = __atomic_load_n(&snap->users, __ATOMIC_ACQUIRE);
+	if (users)
+		return users;
 	
-	regfree(&gr_regex);
+	users = build_users(snap);
+	if (!users)
+		return 0;
 	
-	for (i=0; i < n_tables; i++) {
-		cur_table = &tables[i];
-		
-		munmap(cur_table->data, cur_table->stat.st_size);
-		close(cur_table->fd);
-		
-		free(cur_table->filepath);
+	expected = 0;
+	if (!__atomic_compare_exchange_n(&snap->users, &expected, users, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		member_index_free(users);
+		free(users);
+		users = expected;
 	}
 	
-	if (tables)
-		free(tables);
-	
-	tables = 0;
-	n_tables = 0;
-	cur_table = 0;
-	cur_pos = 0;
-	
-	return NSS_STATUS_SUCCESS;
+	return users;
 }
 
-#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
-// this function parses the split_members files and appends the members of the given group to the buffer
-int find_members(char *gr_name, char *buffer, char *bufpos, size_t buflen, size_t *new_slen) {
-	struct table *cur_sm_table;
-	char *cur_sm_pos;
-	
-	
-	*new_slen = 0;
+/*
+ * Appends $gid to the groups of the caller unless it is the primary $group
+ * or already in the list. The list is grown up to $limit if it is full.
+ * Returns -ENOSPC if $limit is reached.
+ */
+static int add_group(gid_t gid, gid_t group, long int *start, long int *size, gid_t **groupsp, long int limit) {
+	gid_t *groups;
+	long int i, new_size;
 	
-	cur_sm_table = split_members;
-	if (split_members)
-		cur_sm_pos = split_members->data;
-	else
+	if (gid == group)
 		return 0;
 	
-	while (1) {
-		int r;
-		char errbuf[128];
-		#define N_MEMBERS_GROUPS 3
-		regmatch_t rmatch[N_MEMBERS_GROUPS];
-		size_t slen;
+	for (i=0; i < *start; i++) {
+		if ((*groupsp)[i] == gid)
+			return 0;
+	}
+	
+	if (*start == *size) {
+		if (limit > 0 && *size >= limit)
+			return -ENOSPC;
 		
+		new_size = 2 * *size;
+		if (limit > 0 && new_size > limit)
+			new_size = limit;
 		
-		if (cur_sm_table >= split_members + n_split_members) {
-			break;
-		}
+		groups = (gid_t *) realloc(*groupsp, new_size * sizeof(gid_t));
+		if (!groups)
+			return -ENOMEM;
 		
-		r = regexec(&gm_regex, cur_sm_pos, N_MEMBERS_GROUPS, rmatch, 0);
-		if (!r) {
-			int i, skip;
-			
-			skip = 1;
-			
-			if (log_level >= LL_DBG)
-				DBG("%s: |", cur_sm_table->filepath);
-			
-			for (i=1; i < N_MEMBERS_GROUPS; i++) {
-				if (rmatch[i].rm_so == (size_t)-1) {
-					// TODO can this still happen?
-					
-					break;
-				}
-				
-				slen = rmatch[i].rm_eo - rmatch[i].rm_so;
-				
-				if ((bufpos - buffer) + slen + 1 >= buflen) {
-					return NSS_STATUS_TRYAGAIN;
-				}
-				
-				memcpy(bufpos, &cur_sm_pos[rmatch[i].rm_so], slen);
-				bufpos[slen] = 0;
-				
-				if (log_level >= LL_DBG)
-					DBG("%s|", bufpos);
-				
-				switch (i) {
-					case 1:
-						if (!strcmp(gr_name, bufpos))
-							skip = 0;
-						
-						break;
-					case 2: {
-						// add additional ',', the calling function will remove the last one later
-						bufpos[slen] = ',';
-						bufpos[slen+1] = 0;
-						bufpos += slen + 1;
-						*new_slen += slen + 1;
-					}
-				}
-				
-				if (skip)
-					break;
-			}
-			
-			if (log_level >= LL_DBG)
-				DBG("\n");
-			
-			cur_sm_pos += rmatch[N_MEMBERS_GROUPS-1].rm_eo + 1;
-			
-			if (cur_sm_pos >= cur_sm_table->data + cur_sm_table->stat.st_size) {
-				if (log_level >= LL_DBG)
-					DBG("EOF\n");
-				
-				cur_sm_table += 1;
-				if (cur_sm_table < split_members + n_split_members)
-					cur_sm_pos = cur_sm_table->data;
-			}
-		} else
-		if (r == REG_NOMATCH) {
-			if (log_level >= LL_DBG)
-				DBG("EOF\n");
-			
-			cur_sm_table += 1;
-			if (cur_sm_table < split_members + n_split_members)
-				cur_sm_pos = cur_sm_table->data;
-		} else {
-			regerror(r, &gr_regex, errbuf, sizeof(errbuf));
-			
-			if (log_level >= LL_ERROR)
-				ERROR("regexec failed: %s\n", errbuf);
-			
-			return -1;
-		}
+		*groupsp = groups;
+		*size = new_size;
 	}
 	
+	(*groupsp)[*start] = gid;
+	*start += 1;
+	
 	return 0;
 }
-#endif
 
-// this function is called to iterate through all entries
-enum nss_status _nss_confd_getgrent_r_helper(
-	struct group *result, char *buffer, size_t buflen, int *errnop,
-	struct table **l_cur_table, char **l_cur_pos
-	)
-{
-	enum nss_status retval;
-	
-	if (log_level >= LL_DBG)
-		DBG("_nss_confd_getgrent_r()\n");
-	
-	retval = NSS_STATUS_NOTFOUND;
-	
-	if (!tables) {
-		enum nss_status r;
+// returns the status of initgroups_dyn() after $n groups were added with the result $r of the last one
+static enum nss_status initgroups_status(int r, size_t n, int *errnop) {
+	if (r == -ENOMEM) {
+		*errnop = ENOMEM;
 		
-		r = _nss_confd_setgrent();
-		if (r != NSS_STATUS_SUCCESS) {
-			*errnop = ENOENT;
-			
-			return r;
-		}
+		return NSS_STATUS_TRYAGAIN;
 	}
 	
-	if (!(*l_cur_table)) {
+	if (n == 0) {
 		*errnop = ENOENT;
 		
 		return NSS_STATUS_NOTFOUND;
 	}
 	
-	while (1) {
-		int r;
-		char errbuf[128];
-		#define N_GROUPS 5
-		regmatch_t rmatch[N_GROUPS];
-		size_t slen;
-		char *bufpos;
-		
-		
-		if ((*l_cur_table) >= tables + n_tables) {
-			*errnop = ENOENT;
-			
-			return NSS_STATUS_NOTFOUND;
-		}
-		
-		bufpos = buffer;
-		
-		r = regexec(&gr_regex, (*l_cur_pos), N_GROUPS, rmatch, 0);
-		if (!r) {
-			int i, valid;
-			
-			valid = 1;
-			
-			if (log_level >= LL_DBG)
-				DBG("%s: |", (*l_cur_table)->filepath);
-			
-			for (i=1; i < N_GROUPS; i++) {
-				if (rmatch[i].rm_so == (size_t)-1) {
-					// TODO can this still happen?
-					
-					valid = 0;
-					
-					break;
-				}
-				
-				slen = rmatch[i].rm_eo - rmatch[i].rm_so;
-				
-				if ((bufpos - buffer) + slen + 1 >= buflen) {
-					*errnop = ERANGE;
-					
-					return NSS_STATUS_TRYAGAIN;
-				}
-				
-				memcpy(bufpos, &(*l_cur_pos)[rmatch[i].rm_so], slen);
-				bufpos[slen] = 0;
-				
-				if (log_level >= LL_DBG)
-					DBG("%s|", bufpos);
-				
-				switch (i) {
-					case 1: result->gr_name = bufpos; break;
-					case 2: result->gr_passwd = bufpos; break;
-					
-					SWITCH_ENTRY(3, gr_gid)
-					
-					case 4: {
-						size_t j, k, member_count, last_valid;
-						
-						/*
-						 * the member list is already stored in the buffer, we just
-						 * have to replace the "," with zeroes to generate valid strings
-						 * and to store pointers into the string list
-						 */
-						
-						#ifdef NSS_CONFD_WITH_SPLIT_MEMBERS
-						size_t new_slen;
-						char *start_pos;
-						
-						start_pos = bufpos + slen;
-						// if there is already a member, leave space for a ','
-						if (slen > 0)
-							start_pos += 1;
-						
-						// get the list of additional members and append it to the member list in $buffer
-						r = find_members(result->gr_name, buffer, start_pos, buflen, &new_slen);
-						if (r == 0) {
-							if (new_slen > 0) {
-								// replace null termination with ','
-								if (slen > 0)
-									bufpos[slen] = ',';
-								
-								// set new null terminator
-								start_pos[new_slen -1] = 0;
-								
-								slen += new_slen;
-							}
-						} else {
-							if (r == NSS_STATUS_TRYAGAIN) {
-								*errnop = ERANGE;
-								
-								return NSS_STATUS_TRYAGAIN;
-							}
-						}
-						#endif
-						
-						// get the number of ',' = number of members - 1
-						last_valid = ( slen > 0 );
-						member_count = 0;
-						for (j=0; j < slen; j++) {
-							if (bufpos[j] == ',') {
-								member_count += 1;
-								if (j < slen)
-									last_valid = 1;
-								else
-									last_valid = 0;
-							}
-						}
-						if (last_valid)
-							member_count += 1;
-						
-						// "allocate" the string list
-						result->gr_mem = (char **) (bufpos + slen + 1);
-						
-						// fill the string list with pointers and replace ',' with 0
-						k = 0;
-						if (member_count > 0) {
-							result->gr_mem[k] = bufpos;
-							k += 1;
-							
-							for (j=0; j < slen; j++) {
-								if (bufpos[j] == ',') {
-									result->gr_mem[k] = &bufpos[j+1];
-									k += 1;
-									
-									bufpos[j] = 0;
-								}
-							}
-						}
-						
-						result->gr_mem[k] = 0;
-						member_count += 1;
-						
-						bufpos += member_count * sizeof(char*);
-						
-						break;
-					}
-				}
-				
-				bufpos += slen + 1;
-			}
-			
-			if (log_level >= LL_DBG)
-				DBG("\n");
-			
-			(*l_cur_pos) += rmatch[N_GROUPS-1].rm_eo + 1;
-			
-			if ((*l_cur_pos) >= (*l_cur_table)->data + (*l_cur_table)->stat.st_size) {
-				if (log_level >= LL_DBG)
-					DBG("EOF\n");
-				
-				(*l_cur_table) += 1;
-				if ((*l_cur_table) < tables + n_tables)
-					(*l_cur_pos) = (*l_cur_table)->data;
-			}
-			
-			if (valid) {
-				retval = NSS_STATUS_SUCCESS;
-			} else {
-				if (log_level >= LL_ERROR)
-					ERROR("ignoring invalid entry\n");
-				continue;
-			}
-		} else
-		if (r == REG_NOMATCH) {
-			if (log_level >= LL_DBG)
-				DBG("EOF\n");
-			
-			(*l_cur_table) += 1;
-			if ((*l_cur_table) < tables + n_tables)
-				(*l_cur_pos) = (*l_cur_table)->data;
-			
-			continue;
-		} else {
-			regerror(r, &gr_regex, errbuf, sizeof(errbuf));
-			
-			if (log_level >= LL_ERROR)
-				ERROR("regexec failed: %s\n", errbuf);
-			
-			*errnop = ENOENT;
-			return NSS_STATUS_UNAVAIL;
-		}
-		
-		break;
-	}
-	
-	if (retval == NSS_STATUS_NOTFOUND)
-		*errnop = ENOENT;
-	
-	return retval;
-}
-
-// this function is called to iterate through all entries
-enum nss_status _nss_confd_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop) {
-	return _nss_confd_getgrent_r_helper(result, buffer, buflen, errnop, &cur_table, &cur_pos);
+	return NSS_STATUS_SUCCESS;
 }
 
-enum nss_status _nss_confd_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop) {
+/*
+ * Adds the gids of all groups that list $user as member to *groupsp. glibc
+ * calls this for initgroups() and getgrouplist(), without it glibc would
+ * enumerate all groups with getgrent_r().
+ */
+static enum nss_status initgroups_dyn(const char *user, gid_t group, long int *start, long int *size, gid_t **groupsp, long int limit, int *errnop) {
 	enum nss_status retval;
-	struct table *cur_table;
-	char *cur_pos;
+	struct snapshot *snap;
+	struct member_index *users;
+	struct member_entry *entry;
+	struct cdb_member *member;
+	gid_t *gids;
+	size_t i, n;
+	int r;
 	
 	if (log_level >= LL_DBG)
-		DBG("_nss_confd_getgruid_r()\n");
+		DBG("_nss_confd_initgroups_dyn()\n");
+	
+	// ask the caching daemon first, then we do not have to load the directory at all
+	r = cached_initgroups(db_dirpath(&db), user, &gids, &n);
+	if (r == 0) {
+		for (i=0; i < n && r == 0; i++)
+			r = add_group(gids[i], group, start, size, groupsp, limit);
+		
+		return initgroups_status(r, n, errnop);
+	}
 	
-	retval = _nss_confd_setgrent();
+	retval = db_update(&db);
 	if (retval != NSS_STATUS_SUCCESS) {
 		*errnop = ENOENT;
 		
 		return retval;
 	}
 	
-	cur_table = tables;
-	if (tables) {
-		cur_pos = cur_table->data;
-	} else {
+	// building the member index takes a while, hence we hold a reference instead of delaying a reload
+	snap = snapshot_get(&db.current);
+	if (!snap) {
 		*errnop = ENOENT;
 		
-		return NSS_STATUS_NOTFOUND;
+		return NSS_STATUS_UNAVAIL;
 	}
 	
-	while (1) {
-		retval = _nss_confd_getgrent_r_helper(result, buffer, buflen, errnop, &cur_table, &cur_pos);
-		if (retval != NSS_STATUS_SUCCESS)
-			return retval;
+	r = 0;
+	if (snap->cdb.data) {
+		// the compiled database contains the member index with the split members already merged
+		n = cdb_find_members(&snap->cdb, user, &member);
+		for (i=0; i < n && r == 0; i++)
+			r = add_group(member[i].id, group, start, size, groupsp, limit);
+	} else {
+		users = get_users(snap);
+		if (!users) {
+			snapshot_put(snap);
+			*errnop = ENOMEM;
+			
+			return NSS_STATUS_TRYAGAIN;
+		}
 		
-		if (result->gr_gid == gid)
-			return NSS_STATUS_SUCCESS;
+		n = member_index_find(users, user, &entry);
+		for (i=0; i < n && r == 0; i++)
+			r = add_group(entry[i].gid, group, start, size, groupsp, limit);
 	}
+	
+	PROBE(find_members, user, n, snap->cdb.data != 0);
+	
+	snapshot_put(snap);
+	
+	return initgroups_status(r, n, errnop);
 }
 
-enum nss_status _nss_confd_getgrnam_r(const char *name, struct group *result, char *buffer, size_t buflen, int *errnop) {
+enum nss_status _nss_confd_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size, gid_t **groupsp, long int limit, int *errnop) {
 	enum nss_status retval;
-	struct table *cur_table;
-	char *cur_pos;
+	uint64_t stats;
 	
-	if (log_level >= LL_DBG)
-		DBG("_nss_confd_getgrnam_r()\n");
+	stats = stats_start();
 	
-	retval = _nss_confd_setgrent();
-	if (retval != NSS_STATUS_SUCCESS) {
-		*errnop = ENOENT;
-		
-		return retval;
-	}
+	retval = initgroups_dyn(user, group, start, size, groupsp, limit, errnop);
 	
-	cur_table = tables;
-	if (tables) {
-		cur_pos = cur_table->data;
-	} else {
-		*errnop = ENOENT;
-		
-		return NSS_STATUS_NOTFOUND;
-	}
+	stats_add(db.cached_db, STATS_INITGROUPS, 1);
+	stats_time(db.cached_db, STATS_TIME_INITGROUPS, stats);
 	
-	while (1) {
-		retval = _nss_confd_getgrent_r_helper(result, buffer, buflen, errnop, &cur_table, &cur_pos);
-		if (retval != NSS_STATUS_SUCCESS)
-			return retval;
-		
-		if (!strcmp(result->gr_name, name))
-			return NSS_STATUS_SUCCESS;
-	}
+	return retval;
+}
+
+// resolves $n gids to names with one call, see nss-confd-batch.h
+int _nss_confd_gids_to_names(const gid_t *gids, size_t n, char ***names) {
+	return db_ids_to_names(&db, gids, n, names);
+}
+
+// resolves $n names to gids with one call, see nss-confd-batch.h
+int _nss_confd_names_to_gids(const char *const *names, size_t n, gid_t *gids) {
+	return db_names_to_ids(&db, names, n, gids);
+}
+
+// adds all files and records of the directory to the compiled database
+int compile_grent(struct cdb_builder *b) {
+	return db_compile(&db, b);
+}
+
+// registers the directory and its files with nscd
+void trace_grent(void (*cb)(size_t, struct traced_file *)) {
+	nscd_trace_db(&db, NSCD_GROUP, cb);
 }
@@ -0,0 +1,271 @@
+/*
+ * nss-confd-index
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file provides the hash index that maps names and ids to the position
+ * of the corresponding record in the mmapped tables.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+#define INDEX_EMPTY UINT32_MAX
+
+// FNV-1a, names are short and this is good enough to spread them
+uint32_t index_hash_name(const char *name, size_t len) {
+	uint32_t hash;
+	size_t i;
+	
+	hash = 2166136261u;
+	for (i=0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	
+	return hash;
+}
+
+// ids are often consecutive, hence we mix all bits into the lower ones
+uint32_t index_hash_id(id_t id) {
+	uint32_t hash;
+	
+	hash = id;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352du;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bu;
+	hash ^= hash >> 16;
+	
+	return hash;
+}
+
+// hashes a directory path, trailing slashes are ignored
+uint32_t index_hash_dir(const char *dirpath) {
+	size_t len;
+	
+	len = strlen(dirpath);
+	while (len > 1 && dirpath[len-1] == '/')
+		len -= 1;
+	
+	return index_hash_name(dirpath, len);
+}
+
+int index_init(struct index *idx, size_t n_entries) {
+	size_t size;
+	
+	memset(&idx->bloom, 0, sizeof(struct bloom));
+	
+	// keep the load factor below 50% to keep the probe sequences short
+	size = 8;
+	while (size < n_entries * 2)
+		size *= 2;
+	
+	idx->entries = (struct index_entry *) malloc(sizeof(struct index_entry) * size);
+	if (!idx->entries) {
+		if (log_level >= LL_ERROR)
+			ERROR("malloc(%zu) failed: %s\n", sizeof(struct index_entry) * size, strerror(errno));
+		
+		idx->size = 0;
+		idx->n_entries = 0;
+		
+		return -ENOMEM;
+	}
+	
+	memset(idx->entries, 0xff, sizeof(struct index_entry) * size);
+	idx->size = size;
+	idx->n_entries = 0;
+	
+	if (bloom_init(&idx->bloom, n_entries)) {
+		index_free(idx);
+		
+		return -ENOMEM;
+	}
+	
+	return 0;
+}
+
+void index_free(struct index *idx) {
+	if (idx->entries)
+		free(idx->entries);
+	
+	idx->entries = 0;
+	idx->size = 0;
+	idx->n_entries = 0;
+	
+	bloom_free(&idx->bloom);
+}
+
+/*
+ * The index does not grow, index_init() has to be called with the maximum
+ * number of entries. As there is no rehashing and there are no deletions,
+ * entries with the same hash are returned by index_next() in the order they
+ * were added, i.e. in file order.
+ */
+int index_add(struct index *idx, uint32_t hash, uint32_t table, size_t offset) {
+	size_t pos;
+	
+	if ((idx->n_entries + 1) * 2 > idx->size)
+		return -ENOSPC;
+	
+	pos = hash & (idx->size - 1);
+	while (idx->entries[pos].table != INDEX_EMPTY)
+		pos = (pos + 1) & (idx->size - 1);
+	
+	idx->entries[pos].hash = hash;
+	idx->entries[pos].table = table;
+	idx->entries[pos].offset = offset;
+	
+	bloom_add(&idx->bloom, hash);
+	
+	idx->n_entries += 1;
+	
+	return 0;
+}
+
+// loads the filter block and the first entry that index_next() reads for $hash into the cache
+void index_prefetch(struct index *idx, uint32_t hash) {
+	if (idx->size == 0)
+		return;
+	
+	bloom_prefetch(&idx->bloom, hash);
+	__builtin_prefetch(&idx->entries[hash & (idx->size - 1)]);
+}
+
+// returns the next entry with the given hash, *pos has to be INDEX_START for the first call
+struct index_entry *index_next(struct index *idx, uint32_t hash, size_t *pos) {
+	struct index_entry *entry;
+	
+	if (idx->size == 0)
+		return 0;
+	
+	if (*pos == INDEX_START) {
+		// most lookups are misses, the filter is much smaller than the entries
+		if (!bloom_check(&idx->bloom, hash))
+			return 0;
+		
+		*pos = hash & (idx->size - 1);
+	} else
+		*pos = (*pos + 1) & (idx->size - 1);
+	
+	while (1) {
+		entry = &idx->entries[*pos];
+		
+		if (entry->table == INDEX_EMPTY)
+			return 0;
+		
+		if (entry->hash == hash)
+			return entry;
+		
+		*pos = (*pos + 1) & (idx->size - 1);
+	}
+}
+
+/*
+ * Parses the records of a table and stores the hash of the first field and, if
+ * $id_field is not negative, the hash of the given numeric field together with
+ * the offset of every valid record in table->keys.
+ */
+static int table_index(struct table *table, unsigned int n_fields, unsigned int numeric, int id_field) {
+	struct field fields[n_fields];
+	struct table *cur_table;
+	char *cur_pos, *next, *pos, *end;
+	size_t n_lines;
+	
+	n_lines = 1;
+	pos = table->data;
+	end = table->data + table->stat.st_size;
+	while (pos < end) {
+		pos = memchr(pos, '\n', end - pos);
+		if (!pos)
+			break;
+		
+		pos += 1;
+		n_lines += 1;
+	}
+	
+	table->keys = (struct table_key *) malloc(sizeof(struct table_key) * n_lines);
+	if (!table->keys) {
+		if (log_level >= LL_ERROR)
+			ERROR("malloc(%zu) failed: %s\n", sizeof(struct table_key) * n_lines, strerror(errno));
+		return -ENOMEM;
+	}
+	table->n_keys = 0;
+	
+	cur_table = table;
+	cur_pos = table->data;
+	
+	while (next_record(table, 1, &cur_table, &cur_pos, fields, n_fields, numeric, &next) == 0) {
+		struct table_key *key = &table->keys[table->n_keys];
+		
+		key->name_hash = index_hash_name(fields[0].str, fields[0].len);
+		key->id_hash = id_field >= 0 ? index_hash_id((id_t) fields[id_field].value) : 0;
+		key->offset = cur_pos - table->data;
+		table->n_keys += 1;
+		
+		cur_pos = next;
+	}
+	
+	return 0;
+}
+
+/*
+ * Adds the position of every valid record in $tables to $name_index under the
+ * hash of its first field and, if $id_field is not negative, to $id_index
+ * under the hash of the given numeric field. Only tables without keys are
+ * parsed, the keys of the other tables are still valid.
+ */
+int index_build(struct table *tables, size_t n_tables, unsigned int n_fields, unsigned int numeric, int id_field, struct index *name_index, struct index *id_index) {
+	size_t i, j, n_keys;
+	int r;
+	
+	n_keys = 0;
+	for (i=0; i < n_tables; i++) {
+		if (!tables[i].keys) {
+			r = table_index(&tables[i], n_fields, numeric, id_field);
+			if (r)
+				return r;
+		}
+		
+		n_keys += tables[i].n_keys;
+	}
+	
+	r = index_init(name_index, n_keys);
+	if (r)
+		return r;
+	
+	if (id_field >= 0) {
+		r = index_init(id_index, n_keys);
+		if (r) {
+			index_free(name_index);
+			return r;
+		}
+	}
+	
+	for (i=0; i < n_tables; i++) {
+		for (j=0; j < tables[i].n_keys; j++) {
+			struct table_key *key = &tables[i].keys[j];
+			
+			index_add(name_index, key->name_hash, i, key->offset);
+			
+			if (id_field >= 0)
+				index_add(id_index, key->id_hash, i, key->offset);
+		}
+	}
+	
+	if (log_level >= LL_DBG)
+		DBG("indexed %zu records in %zu tables\n", name_index->n_entries, n_tables);
+	
+	return 0;
+}
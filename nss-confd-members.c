@@ -0,0 +1,471 @@
+/*
+ * nss-confd-members
+ * -----------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file aggregates the "group:member,..." lines of the .membership files
+ * of the group database into a map from the group name to the merged member
+ * list. The map is built once per loaded snapshot, hence looking up the split
+ * members of a group no longer has to parse all .membership files.
+ * 
+ * It also provides the reverse index from a user to the groups that list the
+ * user as member, which initgroups_dyn() searches instead of enumerating all
+ * groups.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+#define N_MEMBERS_FIELDS 2
+// members_append() only allocates its hash table for lists with more entries
+#define APPEND_STACK_ITEMS 32
+
+// a member of a group in file order, before the lists are merged
+struct members_item {
+	uint32_t group;
+	uint32_t hash;
+	const char *str;
+	size_t len;
+};
+
+// returns the position of the group $name in $map or -1
+static ssize_t find_group(struct members_map *map, const char *name, size_t len, uint32_t hash) {
+	struct index_entry *entry;
+	size_t pos;
+	
+	pos = INDEX_START;
+	while ((entry = index_next(&map->index, hash, &pos))) {
+		struct members_group *group = &map->groups[entry->offset];
+		
+		if (group->name_len == len && !memcmp(group->name, name, len))
+			return entry->offset;
+	}
+	
+	return -1;
+}
+
+/*
+ * Adds $items[i] to $slots, a hash table with $size slots that refers to
+ * $items. Returns 0 if an equal member is already in the table.
+ */
+static int insert_item(struct members_item *items, size_t i, uint32_t *slots, size_t size) {
+	size_t pos;
+	
+	pos = items[i].hash & (size - 1);
+	while (slots[pos]) {
+		struct members_item *other = &items[slots[pos] - 1];
+		
+		if (other->hash == items[i].hash && other->len == items[i].len && !memcmp(other->str, items[i].str, items[i].len))
+			return 0;
+		
+		pos = (pos + 1) & (size - 1);
+	}
+	
+	slots[pos] = i + 1;
+	
+	return 1;
+}
+
+/*
+ * Appends the members $items[0..n-1] of a group to $out and drops duplicates
+ * with the help of $slots, a hash table with $size slots that is empty on
+ * entry and on return. Returns the length of the comma-separated list.
+ */
+static size_t merge_group(struct members_item *items, size_t n, uint32_t *slots, size_t size, char *out) {
+	size_t i, pos, len;
+	
+	len = 0;
+	for (i=0; i < n; i++) {
+		if (!insert_item(items, i, slots, size))
+			continue;
+		
+		if (len > 0)
+			out[len++] = ',';
+		memcpy(out + len, items[i].str, items[i].len);
+		len += items[i].len;
+	}
+	
+	for (i=0; i < n; i++) {
+		pos = items[i].hash & (size - 1);
+		while (slots[pos]) {
+			slots[pos] = 0;
+			pos = (pos + 1) & (size - 1);
+		}
+	}
+	
+	return len;
+}
+
+// returns the number of entries in the comma-separated $list
+static size_t count_items(const char *list, size_t len) {
+	size_t i, n;
+	
+	n = 1;
+	for (i=0; i < len; i++) {
+		if (list[i] == ',')
+			n += 1;
+	}
+	
+	return n;
+}
+
+// appends the non-empty entries of the comma-separated $list to $items and returns their number
+static size_t split_items(const char *list, size_t len, uint32_t group, struct members_item *items) {
+	size_t i, j, n;
+	
+	n = 0;
+	for (i=0; i < len; i = j + 1) {
+		for (j=i; j < len && list[j] != ','; j++);
+		
+		// empty entries like in "user1,,user2" are dropped
+		if (j == i)
+			continue;
+		
+		items[n].group = group;
+		items[n].str = list + i;
+		items[n].len = j - i;
+		items[n].hash = index_hash_name(items[n].str, items[n].len);
+		n += 1;
+	}
+	
+	return n;
+}
+
+/*
+ * Appends the split members $extra that are not already in the members $list
+ * of a group line to $list, which has room for $list_len + $extra_len + 1
+ * bytes. Returns the new length of the list or a negative errno value.
+ * 
+ * $extra comes from a members_map and has no duplicates, hence it is only
+ * compared with $list if both are not empty. Lists of up to
+ * APPEND_STACK_ITEMS entries are merged without allocating.
+ */
+ssize_t members_append(char *list, size_t list_len, const char *extra, size_t extra_len) {
+	struct members_item stack_items[APPEND_STACK_ITEMS], *items;
+	uint32_t stack_slots[APPEND_STACK_ITEMS * 2], *slots;
+	size_t i, n, n_list, size, len;
+	
+	if (extra_len == 0)
+		return list_len;
+	
+	if (list_len == 0) {
+		memcpy(list, extra, extra_len);
+		return extra_len;
+	}
+	
+	n = count_items(list, list_len) + count_items(extra, extra_len);
+	
+	size = 8;
+	while (size < n * 2)
+		size *= 2;
+	
+	if (n <= APPEND_STACK_ITEMS) {
+		items = stack_items;
+		slots = stack_slots;
+		memset(slots, 0, sizeof(uint32_t) * size);
+	} else {
+		items = (struct members_item *) malloc(sizeof(struct members_item) * n);
+		slots = (uint32_t *) calloc(size, sizeof(uint32_t));
+		if (!items || !slots) {
+			if (log_level >= LL_ERROR)
+				ERROR("malloc() failed: %s\n", strerror(errno));
+			free(items);
+			free(slots);
+			return -ENOMEM;
+		}
+	}
+	
+	// the entries of $list stay as they are, only appended entries are written behind them
+	n_list = split_items(list, list_len, 0, items);
+	n = n_list + split_items(extra, extra_len, 0, items + n_list);
+	
+	for (i=0; i < n_list; i++)
+		insert_item(items, i, slots, size);
+	
+	len = list_len;
+	for (i=n_list; i < n; i++) {
+		if (!insert_item(items, i, slots, size))
+			continue;
+		
+		if (len > 0)
+			list[len++] = ',';
+		memcpy(list + len, items[i].str, items[i].len);
+		len += items[i].len;
+	}
+	
+	if (items != stack_items) {
+		free(items);
+		free(slots);
+	}
+	
+	return len;
+}
+
+/*
+ * Parses all records of $tables and stores the deduplicated members of every
+ * group in the order they appear in the files. The map points into $tables,
+ * hence it has to be freed before the tables are closed.
+ */
+int members_map_build(struct members_map *map, struct table *tables, size_t n_tables) {
+	struct field fields[N_MEMBERS_FIELDS];
+	struct table *cur_table;
+	char *cur_pos, *next;
+	struct members_item *items, *sorted;
+	size_t *first, n_records, n_members, n_items, data_size, max_count, size, i, n, pos;
+	uint32_t *slots;
+	int r;
+	
+	memset(map, 0, sizeof(struct members_map));
+	
+	if (n_tables == 0)
+		return 0;
+	
+	// the first pass only counts to allocate everything at once
+	n_records = 0;
+	n_members = 0;
+	cur_table = tables;
+	cur_pos = tables->data;
+	while (next_record(tables, n_tables, &cur_table, &cur_pos, fields, N_MEMBERS_FIELDS, 0, &next) == 0) {
+		n_records += 1;
+		n_members += count_items(fields[1].str, fields[1].len);
+		
+		cur_pos = next;
+	}
+	
+	map->groups = (struct members_group *) malloc(sizeof(struct members_group) * (n_records + 1));
+	items = (struct members_item *) malloc(sizeof(struct members_item) * (n_members + 1));
+	sorted = (struct members_item *) malloc(sizeof(struct members_item) * (n_members + 1));
+	first = (size_t *) malloc(sizeof(size_t) * (n_records + 1));
+	if (!map->groups || !items || !sorted || !first) {
+		if (log_level >= LL_ERROR)
+			ERROR("malloc() failed: %s\n", strerror(errno));
+		r = -ENOMEM;
+		goto out;
+	}
+	
+	r = index_init(&map->index, n_records);
+	if (r)
+		goto out;
+	
+	// collect the members in file order
+	n_items = 0;
+	data_size = 0;
+	cur_table = tables;
+	cur_pos = tables->data;
+	while (next_record(tables, n_tables, &cur_table, &cur_pos, fields, N_MEMBERS_FIELDS, 0, &next) == 0) {
+		uint32_t hash;
+		ssize_t g;
+		
+		cur_pos = next;
+		
+		hash = index_hash_name(fields[0].str, fields[0].len);
+		g = find_group(map, fields[0].str, fields[0].len, hash);
+		if (g < 0) {
+			g = map->n_groups;
+			
+			map->groups[g].name = fields[0].str;
+			map->groups[g].name_len = fields[0].len;
+			map->groups[g].members = 0;
+			map->groups[g].members_len = 0;
+			first[g] = 0;
+			
+			index_add(&map->index, hash, 0, g);
+			map->n_groups += 1;
+		}
+		
+		n = split_items(fields[1].str, fields[1].len, g, items + n_items);
+		for (i=0; i < n; i++)
+			data_size += items[n_items + i].len + 1;
+		
+		first[g] += n;
+		n_items += n;
+	}
+	
+	// sort the members by group, the order within a group stays the same
+	max_count = 0;
+	pos = 0;
+	for (i=0; i < map->n_groups; i++) {
+		size_t count = first[i];
+		
+		if (count > max_count)
+			max_count = count;
+		
+		first[i] = pos;
+		pos += count;
+	}
+	first[map->n_groups] = pos;
+	
+	for (i=0; i < n_items; i++)
+		sorted[first[items[i].group]++] = items[i];
+	
+	// first[g] now points behind the members of group g
+	
+	size = 8;
+	while (size < max_count * 2)
+		size *= 2;
+	
+	slots = (uint32_t *) calloc(size, sizeof(uint32_t));
+	map->data = (char *) malloc(data_size + 1);
+	if (!slots || !map->data) {
+		if (log_level >= LL_ERROR)
+			ERROR("malloc() failed: %s\n", strerror(errno));
+		free(slots);
+		r = -ENOMEM;
+		goto out;
+	}
+	
+	pos = 0;
+	for (i=0; i < map->n_groups; i++) {
+		size_t start = i > 0 ? first[i - 1] : 0;
+		
+		map->groups[i].members = map->data + pos;
+		map->groups[i].members_len = merge_group(&sorted[start], first[i] - start, slots, size, map->groups[i].members);
+		pos += map->groups[i].members_len;
+	}
+	
+	free(slots);
+	
+	if (log_level >= LL_DBG)
+		DBG("merged %zu members of %zu groups from %zu records\n", n_items, map->n_groups, n_records);
+	
+	r = 0;
+	
+out:
+	free(items);
+	free(sorted);
+	free(first);
+	
+	if (r)
+		members_map_free(map);
+	
+	return r;
+}
+
+void members_map_free(struct members_map *map) {
+	index_free(&map->index);
+	free(map->groups);
+	free(map->data);
+	
+	memset(map, 0, sizeof(struct members_map));
+}
+
+// returns 0 and the comma-separated split members of the group $name
+int members_map_find(struct members_map *map, const char *name, size_t len, const char **members, size_t *members_len) {
+	ssize_t g;
+	
+	if (map->n_groups == 0)
+		return -ENOENT;
+	
+	g = find_group(map, name, len, index_hash_name(name, len));
+	if (g < 0 || map->groups[g].members_len == 0)
+		return -ENOENT;
+	
+	*members = map->groups[g].members;
+	*members_len = map->groups[g].members_len;
+	
+	return 0;
+}
+
+/*
+ * Adds the members of the comma-separated list $members of the group $gid to
+ * $idx. The entries point into $members, hence the list has to stay valid as
+ * long as $idx is used.
+ */
+int member_index_add(struct member_index *idx, const char *members, size_t len, gid_t gid) {
+	struct member_entry *new_entries;
+	size_t i, j;
+	
+	for (i=0; i < len; i = j + 1) {
+		for (j=i; j < len && members[j] != ','; j++);
+		
+		// empty entries like in "user1,,user2" are dropped
+		if (j == i)
+			continue;
+		
+		if (idx->n_entries == idx->alloc) {
+			idx->alloc = idx->alloc ? idx->alloc * 2 : 256;
+			new_entries = (struct member_entry *) realloc(idx->entries, sizeof(struct member_entry) * idx->alloc);
+			if (!new_entries) {
+				if (log_level >= LL_ERROR)
+					ERROR("realloc() failed: %s\n", strerror(errno));
+				return -ENOMEM;
+			}
+			idx->entries = new_entries;
+		}
+		
+		idx->entries[idx->n_entries].user = members + i;
+		idx->entries[idx->n_entries].len = j - i;
+		idx->entries[idx->n_entries].gid = gid;
+		idx->entries[idx->n_entries].seq = idx->n_entries;
+		idx->n_entries += 1;
+	}
+	
+	return 0;
+}
+
+// compares $entry with the user $user of length $len
+static int cmp_entry_user(const struct member_entry *entry, const char *user, size_t len) {
+	int r;
+	
+	r = memcmp(entry->user, user, entry->len < len ? entry->len : len);
+	if (r)
+		return r;
+	
+	return (entry->len > len) - (entry->len < len);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+	const struct member_entry *ea = a, *eb = b;
+	int r;
+	
+	r = cmp_entry_user(ea, eb->user, eb->len);
+	if (r)
+		return r;
+	
+	return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+// sorts the entries by user, the groups of a user stay in the order they were added
+void member_index_sort(struct member_index *idx) {
+	qsort(idx->entries, idx->n_entries, sizeof(struct member_entry), cmp_entry);
+}
+
+// returns the number of groups that list $user as member and the first of them
+size_t member_index_find(struct member_index *idx, const char *user, struct member_entry **first) {
+	size_t lo, hi, mid, len;
+	
+	len = strlen(user);
+	
+	lo = 0;
+	hi = idx->n_entries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp_entry_user(&idx->entries[mid], user, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	*first = &idx->entries[lo];
+	
+	for (hi=lo; hi < idx->n_entries && cmp_entry_user(&idx->entries[hi], user, len) == 0; hi++);
+	
+	return hi - lo;
+}
+
+void member_index_free(struct member_index *idx) {
+	free(idx->entries);
+	
+	memset(idx, 0, sizeof(struct member_index));
+}
@@ -0,0 +1,142 @@
+/*
+ * nss-confd-mkindex
+ * -----------------
+ *
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ *
+ * This tool compiles the directories into index files that the module can
+ * use without scanning and parsing all files in the directory. With --shm, it
+ * publishes them as the copies in NSS_CONFD_SHM instead.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+struct database {
+	const char *name;
+	const char *dir_env;
+	const char *dir;
+	const char *index_env;
+	int (*compile)(struct cdb_builder *b);
+	mode_t mode;
+};
+
+static struct database databases[] = {
+	{ "passwd", "NSS_CONFD_PASSWD_DIR", PASSWD_DIR, "NSS_CONFD_PASSWD_INDEX", compile_pwent, 0644 },
+	{ "group", "NSS_CONFD_GROUP_DIR", GROUP_DIR, "NSS_CONFD_GROUP_INDEX", compile_grent, 0644 },
+	{ "shadow", "NSS_CONFD_SHADOW_DIR", SHADOW_DIR, "NSS_CONFD_SHADOW_INDEX", compile_spent, 0600 },
+};
+#define N_DATABASES (sizeof(databases) / sizeof(databases[0]))
+
+static int to_shm;
+
+static int compile(struct database *db) {
+	struct cdb_builder b;
+	char *dirpath, *path;
+	int r;
+
+	dirpath = getenv(db->dir_env);
+	if (!dirpath)
+		dirpath = (char *) db->dir;
+
+	if (to_shm)
+		path = cdb_shm_path(db->name, dirpath, geteuid());
+	else
+		path = cdb_path(getenv(db->index_env), dirpath);
+	if (!path) {
+		fprintf(stderr, "%s for %s is disabled\n", to_shm ? "NSS_CONFD_SHM" : "index", db->name);
+		return to_shm ? -1 : 0;
+	}
+
+	r = db->compile(&b);
+	if (r) {
+		fprintf(stderr, "cannot read %s from \"%s\": %s\n", db->name, dirpath, strerror(-r));
+		cdb_builder_free(&b);
+		free(path);
+		return -1;
+	}
+
+	r = cdb_publish(&b, path, db->mode);
+	if (r) {
+		fprintf(stderr, "cannot create index for %s: %s\n", db->name, strerror(-r));
+		cdb_builder_free(&b);
+		free(path);
+		return -1;
+	}
+
+	printf("%s: %zu records from %zu files -> %s\n", db->name, b.n_records, b.n_files, path);
+	if (b.n_records > 0) {
+		// the encoded records compared to the files they were parsed from
+		printf("  %llu bytes, records %.1f bytes per entry, index %.1f bytes per entry, files %.1f bytes per entry\n",
+			(unsigned long long) b.size, (double) b.records_size / b.n_records, (double) b.size / b.n_records,
+			(double) b.files_size / b.n_records);
+	}
+
+	cdb_builder_free(&b);
+	free(path);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t j;
+	int i, r, first;
+
+	if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		printf("Usage: %s [--shm] [passwd|group|shadow]...\n", argv[0]);
+		printf("\n");
+		printf("Compiles the given databases (default: all) into index files or, with --shm,\n");
+		printf("into the copies in NSS_CONFD_SHM that the module of this user and, if run as\n");
+		printf("root, of all users maps.\n");
+		return 0;
+	}
+
+	first = 1;
+	if (argc > 1 && !strcmp(argv[1], "--shm")) {
+		to_shm = 1;
+		first = 2;
+	}
+
+	// read the records from the directories and not from an existing index
+	cdb_enabled = 0;
+	log_level = LL_ERROR;
+
+	r = 0;
+	if (argc == first) {
+		for (j=0; j < N_DATABASES; j++) {
+			if (compile(&databases[j]))
+				r = 1;
+		}
+
+		return r;
+	}
+
+	for (i=first; i < argc; i++) {
+		for (j=0; j < N_DATABASES; j++) {
+			if (!strcmp(argv[i], databases[j].name))
+				break;
+		}
+
+		if (j == N_DATABASES) {
+			fprintf(stderr, "unknown database \"%s\"\n", argv[i]);
+			return 1;
+		}
+
+		if (compile(&databases[j]))
+			r = 1;
+	}
+
+	return r;
+}
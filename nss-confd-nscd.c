@@ -0,0 +1,152 @@
+/*
+ * nss-confd-nscd
+ * --------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file tells nscd which files it has to watch to know when its cached
+ * passwd and group entries are outdated, like nss_files does for /etc/passwd.
+ * 
+ * nscd watches a registered file with inotify for IN_CLOSE_WRITE,
+ * IN_DELETE_SELF and IN_MOVE_SELF and its parent directory for events that
+ * name the file. As inotify keeps only one mask per watched inode, the last
+ * registration of an inode decides which of the two masks it gets. Hence, we
+ * register the files of a directory first and the directory itself last.
+ * Then, writing a file in the directory, also a new one, as well as replacing,
+ * renaming or removing one of the registered files clears the cache of nscd.
+ * Only a new file that is renamed into the directory goes unnoticed until
+ * another change happens or the entries expire.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+// every file needs an inotify watch in nscd, larger directories only register the directory
+#define NSCD_MAX_FILES 1024
+
+/*
+ * The layout of struct traced_file in nscd/nscd.h of glibc, which has not
+ * changed since glibc 2.21. nscd keeps a pointer to the struct, hence it must
+ * never be freed.
+ */
+#define TRACED_FILE 0
+#define TRACED_DIR 1
+
+struct traced_file {
+	time_t mtime;
+	struct traced_file *next;
+	int call_res_init;
+	int inotify_descr[2];
+	char dname[PATH_MAX];
+	char *sfname;
+	char fname[];
+};
+
+// like init_traced_file() in nscd/nscd.h, $path must not end with a slash
+static struct traced_file *traced_file_new(const char *path) {
+	struct traced_file *file;
+	char *slash;
+	size_t len;
+	
+	len = strlen(path);
+	file = (struct traced_file *) calloc(1, sizeof(struct traced_file) + len + 1);
+	if (!file)
+		return 0;
+	
+	file->inotify_descr[TRACED_FILE] = -1;
+	file->inotify_descr[TRACED_DIR] = -1;
+	memcpy(file->fname, path, len + 1);
+	
+	slash = strrchr(file->fname, '/');
+	if (!slash || slash - file->fname >= PATH_MAX) {
+		free(file);
+		return 0;
+	}
+	
+	// the parent of "/etc" is "/"
+	memcpy(file->dname, file->fname, slash == file->fname ? 1 : slash - file->fname);
+	file->sfname = slash + 1;
+	
+	return file;
+}
+
+static void trace_path(size_t nscd_db, const char *path, void (*cb)(size_t, struct traced_file *)) {
+	struct traced_file *file;
+	
+	file = traced_file_new(path);
+	if (!file) {
+		if (log_level >= LL_ERROR)
+			ERROR("cannot register \"%s\" with nscd\n", path);
+		return;
+	}
+	
+	if (log_level >= LL_DBG)
+		DBG("nscd traces \"%s\"\n", path);
+	
+	cb(nscd_db, file);
+}
+
+// registers the directory of $db and its files with nscd
+void nscd_trace_db(struct db *db, size_t nscd_db, void (*cb)(size_t, struct traced_file *)) {
+	struct dirent *dent;
+	const char *dirpath;
+	char *path;
+	size_t len, n_files;
+	DIR *dir;
+	
+	dirpath = db_dirpath(db);
+	
+	// nscd compares the last component with the names in inotify events
+	len = strlen(dirpath);
+	while (len > 1 && dirpath[len-1] == '/')
+		len -= 1;
+	
+	dir = opendir(dirpath);
+	if (dir) {
+		n_files = 0;
+		
+		// all regular files, the .membership files of split members as well
+		while ((dent = readdir(dir)) && n_files < NSCD_MAX_FILES) {
+			if (dent->d_type != DT_REG)
+				continue;
+			
+			if (asprintf(&path, "%.*s/%s", (int) len, dirpath, dent->d_name) < 0)
+				break;
+			
+			trace_path(nscd_db, path, cb);
+			free(path);
+			n_files += 1;
+		}
+		
+		closedir(dir);
+	}
+	
+	// nscd also watches a directory that does not exist yet for its creation
+	if (asprintf(&path, "%.*s", (int) len, dirpath) < 0)
+		return;
+	
+	trace_path(nscd_db, path, cb);
+	free(path);
+}
+
+/*
+ * nscd calls this function after loading the module, other processes never
+ * call it. nscd does not cache shadow entries.
+ */
+void _nss_confd_init(void (*cb)(size_t, struct traced_file *)) {
+	trace_pwent(cb);
+	trace_grent(cb);
+}
@@ -0,0 +1,204 @@
+/*
+ * nss-confd-parse
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file splits the lines of a table into their colon-separated fields.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+/*
+ * Parses a number like parse_llong() does: it has to start with a digit, a
+ * "0x" prefix selects base 16 and parsing stops at the first character that
+ * is not a digit. An empty field results in -1.
+ */
+static int parse_number(const char *str, size_t len, long long *value) {
+	unsigned long long val, base, digit;
+	size_t i;
+	
+	if (len == 0) {
+		*value = -1;
+		return 0;
+	}
+	
+	if (str[0] < '0' || str[0] > '9')
+		return -EINVAL;
+	
+	i = 0;
+	base = 10;
+	if (len > 2 && str[0] == '0' && str[1] == 'x') {
+		char c = str[2];
+		
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+			base = 16;
+			i = 2;
+		}
+	}
+	
+	val = 0;
+	for (; i < len; i++) {
+		char c = str[i];
+		
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (base == 16 && c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (base == 16 && c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			break;
+		
+		if (val > (LLONG_MAX - digit) / base)
+			return -ERANGE;
+		
+		val = val * base + digit;
+	}
+	
+	*value = (long long) val;
+	
+	return 0;
+}
+
+/*
+ * Splits the line starting at $pos into $n_fields colon-separated fields.
+ * The line ends at the next newline or at $end, nothing beyond $end is
+ * accessed. Fields whose bit is set in $numeric are also converted into
+ * fields[i].value.
+ * 
+ * *next is set to the start of the following line in any case.
+ * 
+ * Returns 0 for a valid record, -EINVAL if the line does not have exactly
+ * $n_fields fields and -ERANGE if a numeric field is invalid.
+ */
+int parse_line(const char *pos, const char *end, struct field *fields, unsigned int n_fields, unsigned int numeric, const char **next) {
+	const char *eol, *col;
+	unsigned int i;
+	int r;
+	
+	eol = memchr(pos, '\n', end - pos);
+	if (eol) {
+		*next = eol + 1;
+	} else {
+		eol = end;
+		*next = end;
+	}
+	
+	for (i=0; i < n_fields; i++) {
+		if (i < n_fields - 1) {
+			col = memchr(pos, ':', eol - pos);
+			if (!col)
+				return -EINVAL;
+		} else {
+			col = eol;
+			if (memchr(pos, ':', eol - pos))
+				return -EINVAL;
+		}
+		
+		fields[i].str = pos;
+		fields[i].len = col - pos;
+		
+		pos = col + 1;
+	}
+	
+	for (i=0; i < n_fields; i++) {
+		if (!(numeric & (1u << i)))
+			continue;
+		
+		r = parse_number(fields[i].str, fields[i].len, &fields[i].value);
+		if (r) {
+			if (log_level >= LL_ERROR)
+				ERROR("invalid argument: %.*s\n", (int) fields[i].len, fields[i].str);
+			return -ERANGE;
+		}
+	}
+	
+	return 0;
+}
+
+// copies a field into the buffer as zero-terminated string
+char *copy_field(struct field *field, char **bufpos, char *bufend) {
+	char *str;
+	
+	if ((size_t) (bufend - *bufpos) < field->len + 1)
+		return 0;
+	
+	str = *bufpos;
+	memcpy(str, field->str, field->len);
+	str[field->len] = 0;
+	
+	*bufpos += field->len + 1;
+	
+	return str;
+}
+
+/*
+ * Looks for the next valid record starting at *cur_pos in *cur_table and
+ * continues with the following tables if necessary. Lines that are not a
+ * valid record are skipped.
+ * 
+ * *cur_pos is not moved beyond the returned record, the caller has to set
+ * *cur_pos = *next once it has consumed the record. Hence, a caller that has
+ * to return ERANGE will get the same record again during the next call.
+ * 
+ * Returns 0 if a record was found and -ENOENT at the end of the last table.
+ */
+int next_record(struct table *tables, size_t n_tables, struct table **cur_table, char **cur_pos,
+	struct field *fields, unsigned int n_fields, unsigned int numeric, char **next)
+{
+	const char *end, *line_end;
+	int r;
+	
+	while (1) {
+		if ((*cur_table) >= tables + n_tables)
+			return -ENOENT;
+		
+		end = (*cur_table)->data + (*cur_table)->stat.st_size;
+		
+		if ((*cur_pos) >= end) {
+			if (log_level >= LL_DBG)
+				DBG("EOF\n");
+			
+			(*cur_table) += 1;
+			if ((*cur_table) < tables + n_tables)
+				(*cur_pos) = (*cur_table)->data;
+			
+			continue;
+		}
+		
+		r = parse_line((*cur_pos), end, fields, n_fields, numeric, &line_end);
+		if (r == 0) {
+			if (log_level >= LL_DBG)
+				DBG("%s: |%.*s|\n", (*cur_table)->filepath, (int) (fields[n_fields-1].str + fields[n_fields-1].len - (*cur_pos)), (*cur_pos));
+			
+			*next = (char *) line_end;
+			
+			// the file, the offset and the length of the record
+			PROBE(record_parse, (*cur_table)->filepath, (*cur_pos) - (*cur_table)->data, line_end - (*cur_pos));
+			
+			return 0;
+		}
+		
+		if (r == -ERANGE) {
+			if (log_level >= LL_ERROR)
+				ERROR("ignoring invalid entry\n");
+			
+			PROBE(record_invalid, (*cur_table)->filepath, (*cur_pos) - (*cur_table)->data);
+		}
+		
+		(*cur_pos) = (char *) line_end;
+	}
+}
@@ -0,0 +1,215 @@
+/*
+ * nss-confd-retry
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * If the buffer of the caller is too small for a record, a lookup returns
+ * ERANGE and glibc calls it again with a larger buffer. This file keeps a copy
+ * of such a record per thread, so the next call copies the record directly
+ * instead of searching it again and merging the split members again.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+// a retry follows immediately, an older copy might not be up to date anymore
+#define RETRY_MAX_AGE 1
+
+#define RETRY_MAX_FIELDS 9
+
+struct retry {
+	int valid;
+	time_t stored;
+	
+	uint8_t db;
+	uint32_t id;
+	char *name;
+	
+	struct field fields[RETRY_MAX_FIELDS];
+	unsigned int n_fields;
+	size_t size;
+	
+	char *data;
+	size_t data_alloc;
+};
+
+static pthread_key_t retry_key;
+static pthread_once_t retry_once = PTHREAD_ONCE_INIT;
+static int retry_key_valid;
+
+static void retry_free(void *arg) {
+	struct retry *retry = (struct retry *) arg;
+	
+	free(retry->name);
+	free(retry->data);
+	free(retry);
+}
+
+static void retry_key_create(void) {
+	retry_key_valid = (pthread_key_create(&retry_key, retry_free) == 0);
+}
+
+// returns the state of the calling thread, it is only allocated if $create is set
+static struct retry *retry_get(int create) {
+	struct retry *retry;
+	
+	pthread_once(&retry_once, retry_key_create);
+	if (!retry_key_valid)
+		return 0;
+	
+	retry = (struct retry *) pthread_getspecific(retry_key);
+	if (retry || !create)
+		return retry;
+	
+	retry = (struct retry *) calloc(1, sizeof(struct retry));
+	if (!retry)
+		return 0;
+	
+	if (pthread_setspecific(retry_key, retry)) {
+		free(retry);
+		
+		return 0;
+	}
+	
+	return retry;
+}
+
+static time_t now_sec(void) {
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	
+	return now.tv_sec;
+}
+
+// returns the buffer size copy_field() needs for the string fields of a record
+size_t fields_size(struct field *fields, unsigned int n_fields, unsigned int numeric) {
+	unsigned int i;
+	size_t size;
+	
+	size = 0;
+	for (i=0; i < n_fields; i++) {
+		if (!(numeric & (1 << i)))
+			size += fields[i].len + 1;
+	}
+	
+	return size;
+}
+
+/*
+ * Keeps a copy of the record that the lookup of $name or, if $name is 0, of
+ * $id in database $db found and that needs a buffer of $size bytes.
+ */
+void retry_store(uint8_t db, const char *name, uint32_t id, struct field *fields, unsigned int n_fields, size_t size) {
+	struct retry *retry;
+	size_t data_size, i;
+	char *pos;
+	
+	if (n_fields > RETRY_MAX_FIELDS)
+		return;
+	
+	retry = retry_get(1);
+	if (!retry)
+		return;
+	
+	retry->valid = 0;
+	
+	data_size = 0;
+	for (i=0; i < n_fields; i++)
+		data_size += fields[i].len;
+	
+	if (data_size > retry->data_alloc) {
+		char *new_data;
+		
+		new_data = (char *) realloc(retry->data, data_size);
+		if (!new_data)
+			return;
+		
+		retry->data = new_data;
+		retry->data_alloc = data_size;
+	}
+	
+	free(retry->name);
+	retry->name = 0;
+	if (name) {
+		retry->name = strdup(name);
+		if (!retry->name)
+			return;
+	}
+	
+	pos = retry->data;
+	for (i=0; i < n_fields; i++) {
+		retry->fields[i] = fields[i];
+		retry->fields[i].str = pos;
+		
+		memcpy(pos, fields[i].str, fields[i].len);
+		pos += fields[i].len;
+	}
+	
+	retry->db = db;
+	retry->id = id;
+	retry->n_fields = n_fields;
+	retry->size = size;
+	retry->stored = now_sec();
+	retry->valid = 1;
+}
+
+/*
+ * Returns 0 and the fields of the stored record if the previous lookup of this
+ * thread failed with ERANGE and was a lookup of the same key. Any other lookup
+ * drops the record, so a later lookup of the key sees changes of the files.
+ */
+int retry_find(uint8_t db, const char *name, uint32_t id, struct field *fields, unsigned int n_fields) {
+	struct retry *retry;
+	
+	retry = retry_get(0);
+	if (!retry || !retry->valid)
+		return -ENOENT;
+	
+	if (retry->db != db || retry->n_fields != n_fields ||
+		(name ? !retry->name || strcmp(retry->name, name) : retry->name || retry->id != id) ||
+		now_sec() - retry->stored > RETRY_MAX_AGE)
+	{
+		retry->valid = 0;
+		
+		return -ENOENT;
+	}
+	
+	memcpy(fields, retry->fields, sizeof(struct field) * n_fields);
+	
+	return 0;
+}
+
+// drops the stored record once the retry has filled the buffer of the caller
+void retry_clear(void) {
+	struct retry *retry;
+	
+	retry = retry_get(0);
+	if (retry)
+		retry->valid = 0;
+}
+
+// returns the buffer size the stored record needs or 0 if there is none
+size_t retry_size(void) {
+	struct retry *retry;
+	
+	retry = retry_get(0);
+	if (!retry || !retry->valid)
+		return 0;
+	
+	return retry->size;
+}
@@ -0,0 +1,194 @@
+/*
+ * nss-confd-snapshot
+ * ------------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file manages the loaded databases as immutable snapshots. Lookups read
+ * the current snapshot without taking a lock, a reload publishes a new
+ * snapshot and frees the old one after all lookups that might still use it
+ * have finished (similar to RCU in the kernel).
+ * 
+ * A reader announces itself by incrementing one of two counters in a slot
+ * that is selected by the CPU it runs on. Hence, readers on different CPUs do
+ * not write to the same cache line. After publishing a new snapshot, the
+ * writer switches the readers to the other counter and waits until the
+ * previous counter of every slot drops to zero, twice, so every reader that
+ * might have seen the old snapshot has finished.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+#define SNAPSHOT_SLOTS 64
+
+struct reader_slot {
+	unsigned long count[2];
+} __attribute__ ((aligned(64)));
+
+static struct reader_slot readers[SNAPSHOT_SLOTS];
+static unsigned int phase;
+
+// serializes the writers of all databases as they share the reader slots
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The readers that other threads counted at fork() never leave in the child,
+ * hence the first writer of the child would wait for them forever.
+ */
+static void snapshot_atfork_child(void) {
+	memset(readers, 0, sizeof(readers));
+	phase = 0;
+	pthread_mutex_init(&sync_lock, 0);
+}
+
+static void atfork_init(void) {
+	pthread_atfork(0, 0, snapshot_atfork_child);
+}
+
+struct snapshot *snapshot_new(void) {
+	struct snapshot *snap;
+	
+	// there are no readers before the first snapshot
+	pthread_once(&atfork_once, atfork_init);
+	
+	snap = (struct snapshot *) calloc(1, sizeof(struct snapshot));
+	if (!snap) {
+		if (log_level >= LL_ERROR)
+			ERROR("calloc(%zu) failed: %s\n", sizeof(struct snapshot), strerror(errno));
+		return 0;
+	}
+	
+	snap->refs = 1;
+	
+	return snap;
+}
+
+static void snapshot_free(struct snapshot *snap) {
+	size_t i;
+	
+	index_free(&snap->name_index);
+	index_free(&snap->id_index);
+	
+	cdb_close(&snap->cdb);
+	
+	// the member index points into the tables and the map
+	if (snap->users) {
+		member_index_free(snap->users);
+		free(snap->users);
+	}
+	
+	// the map points into the split members tables
+	members_map_free(&snap->split_map);
+	
+	for (i=0; i < snap->n_tables; i++)
+		table_close(&snap->tables[i]);
+	free(snap->tables);
+	
+	for (i=0; i < snap->n_split_members; i++)
+		table_close(&snap->split_members[i]);
+	free(snap->split_members);
+	
+	free(snap);
+}
+
+void snapshot_put(struct snapshot *snap) {
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		snapshot_free(snap);
+}
+
+/*
+ * Starts a lookup in the current snapshot. Until snapshot_leave() is called
+ * with the returned value, a published snapshot is not freed.
+ */
+unsigned int snapshot_enter(void) {
+	unsigned int slot, p;
+	int cpu;
+	
+	// the thread might migrate to another CPU, it leaves the same slot though
+	cpu = sched_getcpu();
+	slot = (cpu < 0 ? 0 : (unsigned int) cpu) % SNAPSHOT_SLOTS;
+	
+	p = __atomic_load_n(&phase, __ATOMIC_RELAXED) & 1;
+	
+	// pairs with the exchange of the snapshot pointer in snapshot_publish()
+	__atomic_fetch_add(&readers[slot].count[p], 1, __ATOMIC_SEQ_CST);
+	
+	return (slot << 1) | p;
+}
+
+void snapshot_leave(unsigned int token) {
+	__atomic_fetch_sub(&readers[token >> 1].count[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+// returns the current snapshot, only valid between snapshot_enter() and snapshot_leave()
+struct snapshot *snapshot_current(struct snapshot **current) {
+	return __atomic_load_n(current, __ATOMIC_SEQ_CST);
+}
+
+// returns a reference to the current snapshot that stays valid until snapshot_put()
+struct snapshot *snapshot_get(struct snapshot **current) {
+	struct snapshot *snap;
+	unsigned int token;
+	
+	token = snapshot_enter();
+	
+	snap = snapshot_current(current);
+	if (snap)
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	
+	snapshot_leave(token);
+	
+	return snap;
+}
+
+// waits until all readers that started before this call have left
+static void snapshot_synchronize(void) {
+	unsigned int i, p, round;
+	
+	pthread_mutex_lock(&sync_lock);
+	
+	for (round=0; round < 2; round++) {
+		p = __atomic_load_n(&phase, __ATOMIC_RELAXED) & 1;
+		__atomic_store_n(&phase, p ^ 1, __ATOMIC_SEQ_CST);
+		
+		// the sections are short, hence we do not need more than yielding here
+		for (i=0; i < SNAPSHOT_SLOTS; i++) {
+			while (__atomic_load_n(&readers[i].count[p], __ATOMIC_SEQ_CST))
+				sched_yield();
+		}
+	}
+	
+	pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Replaces *current with $snap, which may be 0, and drops the reference of
+ * *current to the previous snapshot after all lookups in it have finished.
+ * The caller has to serialize the writers of *current.
+ */
+void snapshot_publish(struct snapshot **current, struct snapshot *snap) {
+	struct snapshot *old;
+	
+	old = __atomic_exchange_n(current, snap, __ATOMIC_SEQ_CST);
+	if (!old)
+		return;
+	
+	snapshot_synchronize();
+	
+	snapshot_put(old);
+}
@@ -0,0 +1,138 @@
+/*
+ * nss-confd-stat
+ * --------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This tool sums up the statistics that the processes keep in the directory
+ * given by NSS_CONFD_STATS_DIR and prints them like NSS_CONFD_STATS=1 does
+ * when a process exits.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nss-confd.h"
+
+#define STATS_PREFIX "nss-confd-stats-"
+
+// reads the statistics of a process, the process might still be updating them
+static int read_segment(int dirfd, const char *name, struct stats_segment *seg) {
+	ssize_t n;
+	int fd;
+	
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	
+	n = pread(fd, seg, sizeof(struct stats_segment), 0);
+	close(fd);
+	
+	if (n != sizeof(struct stats_segment) || memcmp(seg->magic, STATS_MAGIC, sizeof(seg->magic)) ||
+		seg->version != STATS_VERSION || seg->size != sizeof(struct stats_segment))
+	{
+		return -EINVAL;
+	}
+	
+	return 0;
+}
+
+// returns 1 if the process still runs, a process with a reused pid counts as well
+static int process_running(pid_t pid) {
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options] [<directory>]\n", argv0);
+	printf("\n");
+	printf("Sums up the statistics of all processes in <directory> (default: NSS_CONFD_STATS_DIR).\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -l  also print the statistics of every process\n");
+	printf("  -p  remove the files of processes that exited after reading them\n");
+}
+
+int main(int argc, char **argv) {
+	struct stats_segment total, seg;
+	struct dirent *dent;
+	unsigned long n_processes, n_running;
+	char *dirpath;
+	int c, list, prune, running;
+	DIR *dir;
+	
+	list = 0;
+	prune = 0;
+	
+	while ((c = getopt(argc, argv, "hlp")) != -1) {
+		switch (c) {
+			case 'l': list = 1; break;
+			case 'p': prune = 1; break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (argc - optind > 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	dirpath = argc - optind == 1 ? argv[optind] : getenv("NSS_CONFD_STATS_DIR");
+	if (!dirpath || dirpath[0] == 0) {
+		fprintf(stderr, "no directory given and NSS_CONFD_STATS_DIR is not set\n");
+		return 1;
+	}
+	
+	dir = opendir(dirpath);
+	if (!dir) {
+		fprintf(stderr, "cannot open \"%s\": %s\n", dirpath, strerror(errno));
+		return 1;
+	}
+	
+	memset(&total, 0, sizeof(struct stats_segment));
+	n_processes = 0;
+	n_running = 0;
+	
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, STATS_PREFIX, strlen(STATS_PREFIX)))
+			continue;
+		
+		if (read_segment(dirfd(dir), dent->d_name, &seg))
+			continue;
+		
+		running = process_running(seg.pid);
+		
+		if (list) {
+			printf("process %d (uid %u, %s)\n", (int) seg.pid, (unsigned int) seg.uid, running ? "running" : "exited");
+			stats_print(stdout, &seg);
+			printf("\n");
+		}
+		
+		stats_merge(&total, &seg);
+		n_processes += 1;
+		n_running += running;
+		
+		if (prune && !running && unlinkat(dirfd(dir), dent->d_name, 0))
+			fprintf(stderr, "cannot remove \"%s\": %s\n", dent->d_name, strerror(errno));
+	}
+	
+	closedir(dir);
+	
+	printf("processes %lu running %lu\n", n_processes, n_running);
+	stats_print(stdout, &total);
+	
+	return 0;
+}
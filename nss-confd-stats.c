@@ -0,0 +1,300 @@
+/*
+ * nss-confd-stats
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file counts the lookups and loads of every database and keeps
+ * histograms of their latencies. Nothing is counted unless NSS_CONFD_STATS=1
+ * or NSS_CONFD_STATS_DIR is set. With the first, the statistics are printed to
+ * stderr when the process exits. With the latter, every process keeps its
+ * statistics in a file of its own in this directory and nss-confd-stat sums
+ * up the files of all processes.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "nss-confd.h"
+
+const char *stats_db_names[STATS_N_DBS] = { "passwd", "group", "shadow" };
+
+const char *stats_counter_names[STATS_N_COUNTERS] = {
+	"lookups",
+	"hits",
+	"misses",
+	"erange",
+	"retries",
+	"cached",
+	"by_filename",
+	"setent",
+	"getent",
+	"initgroups",
+	"loads",
+	"reloads",
+	"index_loads",
+	"load_errors",
+	"files",
+	"bytes",
+};
+
+const char *stats_timer_names[STATS_N_TIMERS] = {
+	"lookup",
+	"setent",
+	"getent",
+	"initgroups",
+	"load",
+	"open_index",
+	"scan",
+	"build_index",
+	"publish_shm",
+};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static struct stats_segment *stats_seg;
+static struct stats_segment stats_local;
+static char *stats_dir;
+static int stats_dump;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void segment_init(struct stats_segment *seg) {
+	seg->version = STATS_VERSION;
+	seg->size = sizeof(struct stats_segment);
+	seg->pid = getpid();
+	seg->uid = geteuid();
+	
+	// readers ignore the file until the header is complete
+	memcpy(seg->magic, STATS_MAGIC, sizeof(seg->magic));
+}
+
+/*
+ * Creates the file of this process in $dir and maps it. The name contains the
+ * time, hence a later process with the same pid does not overwrite it.
+ */
+static struct stats_segment *segment_open(const char *dir) {
+	struct stats_segment *seg;
+	char path[4096];
+	int fd;
+	
+	if (snprintf(path, sizeof(path), "%s/nss-confd-stats-%d-%llx", dir, (int) getpid(), (unsigned long long) now_ns()) >= (int) sizeof(path))
+		return 0;
+	
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		if (log_level >= LL_ERROR)
+			ERROR("cannot create \"%s\": %s\n", path, strerror(errno));
+		return 0;
+	}
+	
+	if (ftruncate(fd, sizeof(struct stats_segment))) {
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+	
+	seg = (struct stats_segment *) mmap(0, sizeof(struct stats_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		unlink(path);
+		return 0;
+	}
+	
+	segment_init(seg);
+	
+	return seg;
+}
+
+static void stats_exit(void) {
+	if (stats_seg)
+		stats_print(stderr, stats_seg);
+}
+
+// a child must neither count into the file of its parent nor report the counts of its parent again
+static void stats_atfork_child(void) {
+	if (stats_seg && stats_seg != &stats_local) {
+		munmap(stats_seg, sizeof(struct stats_segment));
+		stats_seg = segment_open(stats_dir);
+	}
+	
+	if (!stats_seg && stats_dump)
+		stats_seg = &stats_local;
+	
+	if (stats_seg == &stats_local) {
+		memset(&stats_local, 0, sizeof(struct stats_segment));
+		segment_init(&stats_local);
+	}
+}
+
+/*
+ * Reads the configuration once. The variables are ignored in setuid programs
+ * as they would let the caller create files with the privileges of the program.
+ */
+static void stats_init(void) {
+	char *env;
+	
+	env = secure_getenv("NSS_CONFD_STATS");
+	stats_dump = env && env[0] && strcmp(env, "0");
+	
+	env = secure_getenv("NSS_CONFD_STATS_DIR");
+	if (env && env[0]) {
+		stats_dir = strdup(env);
+		if (stats_dir)
+			stats_seg = segment_open(stats_dir);
+	}
+	
+	if (!stats_seg && stats_dump) {
+		segment_init(&stats_local);
+		stats_seg = &stats_local;
+	}
+	
+	if (!stats_seg)
+		return;
+	
+	if (stats_dump)
+		atexit(stats_exit);
+	
+	pthread_atfork(0, 0, stats_atfork_child);
+}
+
+static struct stats_segment *stats_get(void) {
+	pthread_once(&stats_once, stats_init);
+	
+	return stats_seg;
+}
+
+void stats_add(uint8_t db, unsigned int counter, uint64_t n) {
+	struct stats_segment *seg;
+	
+	seg = stats_get();
+	if (!seg || db >= STATS_N_DBS)
+		return;
+	
+	__atomic_fetch_add(&seg->dbs[db].counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_set(uint8_t db, unsigned int counter, uint64_t value) {
+	struct stats_segment *seg;
+	
+	seg = stats_get();
+	if (!seg || db >= STATS_N_DBS)
+		return;
+	
+	__atomic_store_n(&seg->dbs[db].counters[counter], value, __ATOMIC_RELAXED);
+}
+
+// returns the start time for stats_time() or 0 if nothing is counted, then it does not read the clock
+uint64_t stats_start(void) {
+	if (!stats_get())
+		return 0;
+	
+	return now_ns();
+}
+
+// adds the time since $start to the histogram of $timer
+void stats_time(uint8_t db, unsigned int timer, uint64_t start) {
+	struct stats_hist *hist;
+	uint64_t ns, max;
+	unsigned int bucket;
+	
+	// a child after fork() might not count anymore
+	if (!start || !stats_seg || db >= STATS_N_DBS)
+		return;
+	
+	ns = now_ns() - start;
+	hist = &stats_seg->dbs[db].timers[timer];
+	
+	// bucket i holds the latencies below 2^i ns
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+	
+	max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// adds the statistics of $src to $dst
+void stats_merge(struct stats_segment *dst, struct stats_segment *src) {
+	struct stats_hist *d, *s;
+	size_t i, j, k;
+	
+	for (i=0; i < STATS_N_DBS; i++) {
+		for (j=0; j < STATS_N_COUNTERS; j++)
+			dst->dbs[i].counters[j] += src->dbs[i].counters[j];
+		
+		for (j=0; j < STATS_N_TIMERS; j++) {
+			d = &dst->dbs[i].timers[j];
+			s = &src->dbs[i].timers[j];
+			
+			d->count += s->count;
+			d->sum_ns += s->sum_ns;
+			if (s->max_ns > d->max_ns)
+				d->max_ns = s->max_ns;
+			for (k=0; k < STATS_BUCKETS; k++)
+				d->buckets[k] += s->buckets[k];
+		}
+	}
+}
+
+// returns the upper bound of the bucket that contains the latency at $fraction of the histogram
+static uint64_t hist_percentile(struct stats_hist *hist, double fraction) {
+	uint64_t rank, sum;
+	unsigned int i;
+	
+	rank = (uint64_t) (hist->count * fraction);
+	sum = 0;
+	for (i=0; i < STATS_BUCKETS - 1; i++) {
+		sum += hist->buckets[i];
+		if (sum > rank)
+			return i ? (1ull << i) - 1 : 0;
+	}
+	
+	return hist->max_ns;
+}
+
+// prints the counters and histograms that are not zero, one per line
+void stats_print(FILE *f, struct stats_segment *seg) {
+	struct stats_hist *hist;
+	size_t i, j;
+	
+	for (i=0; i < STATS_N_DBS; i++) {
+		for (j=0; j < STATS_N_COUNTERS; j++) {
+			if (seg->dbs[i].counters[j])
+				fprintf(f, "%s.%s %llu\n", stats_db_names[i], stats_counter_names[j], (unsigned long long) seg->dbs[i].counters[j]);
+		}
+		
+		for (j=0; j < STATS_N_TIMERS; j++) {
+			hist = &seg->dbs[i].timers[j];
+			if (!hist->count)
+				continue;
+			
+			fprintf(f, "%s.%s_ns count %llu avg %llu p50 %llu p99 %llu max %llu\n", stats_db_names[i], stats_timer_names[j],
+				(unsigned long long) hist->count, (unsigned long long) (hist->sum_ns / hist->count),
+				(unsigned long long) hist_percentile(hist, 0.5), (unsigned long long) hist_percentile(hist, 0.99),
+				(unsigned long long) hist->max_ns);
+		}
+	}
+}
@@ -0,0 +1,778 @@
+/*
+ * nss-confd-table
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file loads the individual files of a directory and keeps them across
+ * reloads as long as their content does not change. Small files are read into
+ * one arena per load, only large files are mapped, and no descriptor stays
+ * open.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "nss-confd.h"
+
+// hashes the content of a file, eight bytes at a time as files can be large
+static uint64_t table_hash(const char *data, size_t size) {
+	uint64_t hash, word;
+	size_t i;
+	
+	hash = 0x9e3779b97f4a7c15ull ^ size;
+	for (i=0; i + 8 <= size; i += 8) {
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+		hash ^= hash >> 32;
+	}
+	
+	word = 0;
+	memcpy(&word, data + i, size - i);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 29;
+	
+	return hash;
+}
+
+/*
+ * Initializes $table for the file $name in $dirpath with the status $st and
+ * its content $data, which is either a mapping of the file or a part of
+ * $arena.
+ */
+static int table_init(struct table *table, const char *dirpath, const char *name, struct stat *st, char *data, struct arena *arena) {
+	table->keys = 0;
+	table->n_keys = 0;
+	table->stat = *st;
+	table->data = data;
+	table->arena = arena;
+	
+	table->refs = (unsigned long *) malloc(sizeof(unsigned long));
+	if (!table->refs)
+		return -ENOMEM;
+	*table->refs = 1;
+	
+	if (asprintf(&table->filepath, "%s/%s", dirpath, name) < 0) {
+		free(table->refs);
+		
+		return -ENOMEM;
+	}
+	
+	if (arena)
+		__atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+	
+	table->hash = data ? table_hash(data, st->st_size) : 0;
+	
+	return 0;
+}
+
+static void arena_put(struct arena *arena) {
+	if (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(arena);
+}
+
+// releases the table, the file stays loaded as long as another copy of the table uses it
+void table_close(struct table *table) {
+	if (__atomic_sub_fetch(table->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	
+	if (table->arena)
+		arena_put(table->arena);
+	else if (table->data)
+		munmap(table->data, table->stat.st_size);
+	
+	free(table->filepath);
+	free(table->keys);
+	free(table->refs);
+}
+
+static const char *table_name(struct table *table) {
+	return strrchr(table->filepath, '/') + 1;
+}
+
+// returns 1 if $st still describes the file of $old
+static int table_unchanged(struct table *old, struct stat *st) {
+	return st->st_ino == old->stat.st_ino &&
+		st->st_size == old->stat.st_size &&
+		st->st_mtim.tv_sec == old->stat.st_mtim.tv_sec &&
+		st->st_mtim.tv_nsec == old->stat.st_mtim.tv_nsec;
+}
+
+/*
+ * Copies the keys of $old into $table, which was opened again, if the file
+ * still has the same content. Returns 1 if the records of the file have to be
+ * parsed again and 0 if not.
+ */
+static int table_reuse_keys(struct table *table, struct table *old) {
+	// e.g., configuration management rewrote the file with the same content
+	if (table->stat.st_size == old->stat.st_size && table->hash == old->hash && old->keys) {
+		if (log_level >= LL_DBG)
+			DBG("content of \"%s\" did not change\n", table->filepath);
+		
+		table->keys = (struct table_key *) malloc(sizeof(struct table_key) * (old->n_keys ? old->n_keys : 1));
+		if (table->keys) {
+			memcpy(table->keys, old->keys, sizeof(struct table_key) * old->n_keys);
+			table->n_keys = old->n_keys;
+			
+			return 0;
+		}
+	}
+	
+	if (log_level >= LL_DBG)
+		DBG("\"%s\" changed\n", table->filepath);
+	
+	return 1;
+}
+
+// the layout of the records that getdents64() returns
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#define DENTS_BUFFER_SIZE (64 * 1024)
+
+static int cmp_name(const void *a, const void *b) {
+	return strcoll(*(const char **) a, *(const char **) b);
+}
+
+/*
+ * Reads the names of the entries in $dirfd that $filter accepts with large
+ * getdents64() batches and returns them sorted like alphasort() does. *names
+ * points into *pool, both are malloc'ed.
+ */
+static int read_names(int dirfd, int (*filter)(const struct dirent *), char ***names, size_t *n_names, char **pool) {
+	struct linux_dirent64 *d;
+	struct dirent ent;
+	char *buf, *new_pool;
+	size_t pool_size, pool_alloc, *offsets, n, alloc, i, len;
+	ssize_t nread, pos;
+	int r;
+	
+	*names = 0;
+	*n_names = 0;
+	*pool = 0;
+	
+	buf = (char *) malloc(DENTS_BUFFER_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	
+	offsets = 0;
+	n = 0;
+	alloc = 0;
+	pool_size = 0;
+	pool_alloc = 0;
+	r = 0;
+	
+	while (1) {
+		nread = syscall(SYS_getdents64, dirfd, buf, DENTS_BUFFER_SIZE);
+		if (nread < 0) {
+			r = -errno;
+			break;
+		}
+		if (nread == 0)
+			break;
+		
+		for (pos = 0; pos < nread; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *) (buf + pos);
+			len = strlen(d->d_name);
+			
+			// the filters only look at the type and the name
+			if (len >= sizeof(ent.d_name))
+				continue;
+			ent.d_ino = d->d_ino;
+			ent.d_off = d->d_off;
+			ent.d_reclen = sizeof(ent);
+			ent.d_type = d->d_type;
+			memcpy(ent.d_name, d->d_name, len + 1);
+			
+			if (filter && !filter(&ent))
+				continue;
+			
+			if (n == alloc) {
+				size_t *new_offsets;
+				
+				alloc = alloc ? alloc * 2 : 64;
+				new_offsets = (size_t *) realloc(offsets, sizeof(size_t) * alloc);
+				if (!new_offsets) {
+					r = -ENOMEM;
+					goto out;
+				}
+				offsets = new_offsets;
+			}
+			
+			if (pool_size + len + 1 > pool_alloc) {
+				pool_alloc = pool_alloc ? pool_alloc * 2 : 4096;
+				while (pool_size + len + 1 > pool_alloc)
+					pool_alloc *= 2;
+				
+				new_pool = (char *) realloc(*pool, pool_alloc);
+				if (!new_pool) {
+					r = -ENOMEM;
+					goto out;
+				}
+				*pool = new_pool;
+			}
+			
+			memcpy(*pool + pool_size, d->d_name, len + 1);
+			offsets[n] = pool_size;
+			pool_size += len + 1;
+			n += 1;
+		}
+	}
+	
+	if (r == 0) {
+		*names = (char **) malloc(sizeof(char *) * (n ? n : 1));
+		if (!*names) {
+			r = -ENOMEM;
+			goto out;
+		}
+		
+		for (i=0; i < n; i++)
+			(*names)[i] = *pool + offsets[i];
+		
+		qsort(*names, n, sizeof(char *), cmp_name);
+		*n_names = n;
+	}
+	
+out:
+	free(buf);
+	free(offsets);
+	
+	if (r) {
+		free(*pool);
+		*pool = 0;
+	}
+	
+	return r;
+}
+
+// the state of a file while a directory is loaded
+struct load_item {
+	const char *name;
+	struct table *old;
+	struct stat st;
+	struct statx stx;
+	int fd;
+	int res;
+	int done;
+	
+	// the content of the file, a part of the arena if the file is read
+	char *data;
+	size_t n_read;
+	int read;
+};
+
+#define LOAD_STAT 0
+#define LOAD_OPEN 1
+#define LOAD_FSTAT 2
+#define LOAD_READ 3
+
+// files of at least this size are mapped instead of being read into the arena
+#define MMAP_MIN_DEFAULT (64 * 1024)
+
+// no syscall per file is worth a ring for small directories
+#define URING_MIN_FILES 16
+#define URING_ENTRIES 256
+
+static void stat_from_statx(struct stat *st, struct statx *stx) {
+	memset(st, 0, sizeof(struct stat));
+	
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+struct load_batch {
+	struct load_item *items;
+	int op;
+};
+
+static void load_complete(uint64_t user_data, int res, void *arg) {
+	struct load_batch *batch = (struct load_batch *) arg;
+	struct load_item *item = &batch->items[user_data];
+	
+	item->done = 1;
+	item->res = res < 0 ? res : 0;
+	
+	if (res < 0)
+		return;
+	
+	if (batch->op == LOAD_OPEN)
+		item->fd = res;
+	else if (batch->op == LOAD_READ)
+		item->n_read = res;
+	else
+		stat_from_statx(&item->st, &item->stx);
+}
+
+// queues $op for $item, see load_files()
+static int load_queue(struct uring *ring, int dirfd, struct load_item *item, uint64_t i, int op) {
+	if (op == LOAD_STAT)
+		return uring_queue_statx(ring, dirfd, item->name, 0, &item->stx, i);
+	if (op == LOAD_OPEN)
+		return uring_queue_openat(ring, dirfd, item->name, O_RDONLY | O_CLOEXEC, i);
+	if (op == LOAD_READ)
+		return uring_queue_read(ring, item->fd, item->data, item->st.st_size, 0, i);
+	
+	return uring_queue_statx(ring, item->fd, "", AT_EMPTY_PATH, &item->stx, i);
+}
+
+/*
+ * Executes $op (stat the name, open the name, stat the opened file or read
+ * it) for the items for which $select returns 1. With $ring, all operations are submitted
+ * at once, operations that did not complete through the ring are executed
+ * with plain syscalls afterwards.
+ */
+static void load_files(struct uring *ring, int dirfd, struct load_item *items, size_t n, int op, int (*select)(struct load_item *item)) {
+	struct load_batch batch;
+	size_t i;
+	
+	for (i=0; i < n; i++)
+		items[i].done = 0;
+	
+	if (ring && ring->fd >= 0) {
+		batch.items = items;
+		batch.op = op;
+		
+		for (i=0; i < n; i++) {
+			if (!select(&items[i]))
+				continue;
+			
+			if (load_queue(ring, dirfd, &items[i], i, op) == -EBUSY) {
+				if (uring_wait(ring, load_complete, &batch))
+					break;
+				
+				if (load_queue(ring, dirfd, &items[i], i, op))
+					break;
+			}
+		}
+		
+		uring_wait(ring, load_complete, &batch);
+	}
+	
+	for (i=0; i < n; i++) {
+		struct load_item *item = &items[i];
+		
+		if (item->done || !select(item))
+			continue;
+		
+		item->res = 0;
+		if (op == LOAD_STAT) {
+			if (fstatat(dirfd, item->name, &item->st, 0) == -1)
+				item->res = -errno;
+		} else if (op == LOAD_OPEN) {
+			item->fd = openat(dirfd, item->name, O_RDONLY | O_CLOEXEC);
+			if (item->fd < 0)
+				item->res = -errno;
+		} else if (op == LOAD_READ) {
+			ssize_t n;
+			
+			n = pread(item->fd, item->data, item->st.st_size, 0);
+			if (n < 0)
+				item->res = -errno;
+			else
+				item->n_read = n;
+		} else {
+			if (fstat(item->fd, &item->st) == -1)
+				item->res = -errno;
+		}
+	}
+}
+
+// files that have a table in the previous snapshot are checked first
+static int select_old(struct load_item *item) {
+	return item->old != 0;
+}
+
+// the files that are not shared with the previous snapshot are opened
+static int select_open(struct load_item *item) {
+	return item->res == 0 && item->fd == -1 && (!item->old || !table_unchanged(item->old, &item->st));
+}
+
+static int select_opened(struct load_item *item) {
+	return item->fd >= 0;
+}
+
+static int select_read(struct load_item *item) {
+	return item->res == 0 && item->read && item->st.st_size > 0;
+}
+
+// returns the size from which on files are mapped, NSS_CONFD_MMAP_MIN can change it
+static size_t mmap_min(void) {
+	long long value;
+	char *env;
+	
+	env = secure_getenv("NSS_CONFD_MMAP_MIN");
+	if (!env || env[0] == 0 || parse_llong(env, &value) || value < 0)
+		return MMAP_MIN_DEFAULT;
+	
+	return value;
+}
+
+/*
+ * Reads the small files among the opened $items into one arena and maps the
+ * large ones. Returns the arena with a reference for the caller or 0 if no
+ * file is read. Items that cannot be loaded get an error in ->res.
+ */
+static struct arena *load_data(struct uring *ring, struct load_item *items, size_t n) {
+	struct arena *arena;
+	size_t i, size, limit;
+	
+	limit = mmap_min();
+	
+	size = 0;
+	for (i=0; i < n; i++) {
+		struct load_item *item = &items[i];
+		
+		if (item->fd < 0 || item->res)
+			continue;
+		
+		item->read = (size_t) item->st.st_size < limit;
+		if (item->read)
+			size += item->st.st_size;
+	}
+	
+	arena = 0;
+	if (size > 0) {
+		arena = (struct arena *) malloc(sizeof(struct arena) + size);
+		if (!arena) {
+			if (log_level >= LL_ERROR)
+				ERROR("malloc(%zu) failed: %s\n", sizeof(struct arena) + size, strerror(errno));
+			
+			// map all files instead
+			for (i=0; i < n; i++)
+				items[i].read = 0;
+		} else {
+			arena->refs = 1;
+			arena->size = size;
+		}
+	}
+	
+	size = 0;
+	for (i=0; i < n; i++) {
+		struct load_item *item = &items[i];
+		
+		if (item->fd < 0 || item->res || item->st.st_size == 0)
+			continue;
+		
+		if (item->read) {
+			item->data = arena->data + size;
+			size += item->st.st_size;
+			
+			continue;
+		}
+		
+		item->data = mmap(0, item->st.st_size, PROT_READ, MAP_SHARED, item->fd, 0);
+		if (item->data == MAP_FAILED) {
+			item->res = -errno;
+			item->data = 0;
+		}
+	}
+	
+	if (!arena)
+		return 0;
+	
+	load_files(ring, -1, items, n, LOAD_READ, select_read);
+	
+	// a file that shrank in the meantime is kept with the part that was read, a reload notices the change
+	for (i=0; i < n; i++) {
+		if (items[i].res == 0 && items[i].read && (off_t) items[i].n_read < items[i].st.st_size)
+			items[i].st.st_size = items[i].n_read;
+	}
+	
+	return arena;
+}
+
+/*
+ * Opens the files in $dirpath that $filter accepts as *tables, ordered like
+ * alphasort() does. The tables of files in $old that did not change are
+ * shared with *tables including their keys, $old stays valid until the
+ * caller closes its tables. *changed is set if a file was added, removed or
+ * changed, i.e. if the index has to be built again.
+ * 
+ * The directory is read with getdents64() and the statx(), openat() and
+ * read() calls for all files are submitted as io_uring batches if
+ * NSS_CONFD_IO_URING=1 is set and the kernel allows it. Small files are read
+ * into a single arena and the descriptors of all files are closed afterwards.
+ */
+int tables_load(const char *dirpath, int (*filter)(const struct dirent *), struct table *old, size_t n_old,
+	struct table **tables, size_t *n_tables, int *changed)
+{
+	struct load_item *items;
+	struct table *new_tables;
+	struct arena *arena;
+	struct uring ring;
+	char **names, *pool;
+	size_t n_names, n_new, i, j;
+	int r, dirfd;
+	
+	PROBE(scan_start, dirpath, n_old);
+	
+	dirfd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		r = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("open(%s) failed: %s\n", dirpath, strerror(errno));
+		
+		PROBE(scan_done, dirpath, 0, 0, r);
+		
+		return r;
+	}
+	
+	r = read_names(dirfd, filter, &names, &n_names, &pool);
+	if (r) {
+		if (log_level >= LL_ERROR)
+			ERROR("getdents64(%s) failed: %s\n", dirpath, strerror(-r));
+		
+		close(dirfd);
+		PROBE(scan_done, dirpath, 0, 0, r);
+		
+		return r;
+	}
+	
+	new_tables = (struct table *) malloc(sizeof(struct table) * (n_names ? n_names : 1));
+	items = (struct load_item *) calloc(n_names ? n_names : 1, sizeof(struct load_item));
+	if (!new_tables || !items) {
+		if (log_level >= LL_ERROR)
+			ERROR("malloc(%zu) failed: %s\n", sizeof(struct table) * n_names, strerror(errno));
+		
+		free(new_tables);
+		free(items);
+		free(names);
+		free(pool);
+		close(dirfd);
+		PROBE(scan_done, dirpath, 0, 0, -ENOMEM);
+		
+		return -ENOMEM;
+	}
+	
+	// both lists are sorted the same way, hence we can walk through them in parallel
+	j = 0;
+	for (i=0; i < n_names; i++) {
+		items[i].name = names[i];
+		items[i].fd = -1;
+		
+		while (j < n_old && strcoll(table_name(&old[j]), names[i]) < 0)
+			j += 1;
+		
+		if (j < n_old && !strcmp(table_name(&old[j]), names[i])) {
+			items[i].old = &old[j];
+			j += 1;
+		}
+	}
+	
+	if (n_names < URING_MIN_FILES || uring_init(&ring, n_names < URING_ENTRIES ? n_names : URING_ENTRIES))
+		ring.fd = -1;
+	
+	if (log_level >= LL_DBG)
+		DBG("loading %zu files%s\n", n_names, ring.fd >= 0 ? " with io_uring" : "");
+	
+	// the tables of a published database already have their keys, hence unchanged files are shared
+	load_files(&ring, dirfd, items, n_names, LOAD_STAT, select_old);
+	load_files(&ring, dirfd, items, n_names, LOAD_OPEN, select_open);
+	load_files(&ring, dirfd, items, n_names, LOAD_FSTAT, select_opened);
+	arena = load_data(&ring, items, n_names);
+	
+	if (ring.fd >= 0)
+		uring_free(&ring);
+	
+	// neither the mappings nor the arena need the descriptors
+	for (i=0; i < n_names; i++) {
+		if (items[i].fd >= 0)
+			close(items[i].fd);
+	}
+	
+	n_new = 0;
+	*changed = 0;
+	
+	for (i=0; i < n_names; i++) {
+		struct load_item *item = &items[i];
+		
+		if (item->old && item->fd < 0 && item->res == 0) {
+			new_tables[n_new] = *item->old;
+			__atomic_add_fetch(new_tables[n_new].refs, 1, __ATOMIC_RELAXED);
+			PROBE(file_reuse, new_tables[n_new].filepath, new_tables[n_new].stat.st_size);
+			n_new += 1;
+			
+			continue;
+		}
+		
+		if (item->res) {
+			if (item->data && !item->read)
+				munmap(item->data, item->st.st_size);
+			*changed = 1;
+			
+			continue;
+		}
+		
+		r = table_init(&new_tables[n_new], dirpath, item->name, &item->st, item->data, item->read ? arena : 0);
+		if (r) {
+			if (item->data && !item->read)
+				munmap(item->data, item->st.st_size);
+			*changed = 1;
+			
+			continue;
+		}
+		
+		if (!item->old || table_reuse_keys(&new_tables[n_new], item->old))
+			*changed = 1;
+		
+		// the file was either read into the arena or mapped
+		PROBE(file_load, new_tables[n_new].filepath, item->st.st_size, item->read);
+		n_new += 1;
+	}
+	
+	if (arena)
+		arena_put(arena);
+	
+	free(items);
+	free(names);
+	free(pool);
+	close(dirfd);
+	
+	// a removed file changes the database as well
+	if (n_new != n_old)
+		*changed = 1;
+	
+	*tables = new_tables;
+	*n_tables = n_new;
+	
+	PROBE(scan_done, dirpath, n_new, *changed, 0);
+	
+	return 0;
+}
+
+// returns 1 if lookups by name try the file named after the name first, see NSS_CONFD_BY_FILENAME
+int table_by_filename(void) {
+	char *env;
+	
+	env = secure_getenv("NSS_CONFD_BY_FILENAME");
+	
+	return env && env[0] && strcmp(env, "0");
+}
+
+/*
+ * Looks for the record with the key $name in the file $name in $dirpath
+ * without reading the rest of the directory. The file is only considered if
+ * $filter accepts it like tables_load() would. On success, *table holds the
+ * file and $fields point into it until the caller calls table_close().
+ * 
+ * Returns -ENOENT if there is no such file or it does not contain the key.
+ */
+int table_find_file(const char *dirpath, const char *name, int (*filter)(const struct dirent *), struct table *table,
+	struct field *fields, unsigned int n_fields, unsigned int numeric)
+{
+	struct table *cur_table;
+	struct arena *arena;
+	struct dirent ent;
+	struct stat st;
+	char *cur_pos, *next;
+	size_t len;
+	ssize_t n;
+	int dirfd, fd, r;
+	
+	// only a plain file name may select a file
+	len = strlen(name);
+	if (len == 0 || len >= sizeof(ent.d_name) || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+		return -ENOENT;
+	
+	dirfd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return -ENOENT;
+	
+	// the filters only look at the type and the name
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		close(dirfd);
+		
+		return -ENOENT;
+	}
+	
+	memset(&ent, 0, sizeof(ent));
+	ent.d_ino = st.st_ino;
+	ent.d_reclen = sizeof(ent);
+	ent.d_type = S_ISREG(st.st_mode) ? DT_REG : (S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN);
+	memcpy(ent.d_name, name, len + 1);
+	
+	if (filter && !filter(&ent)) {
+		close(dirfd);
+		
+		return -ENOENT;
+	}
+	
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	close(dirfd);
+	if (fd < 0)
+		return -ENOENT;
+	
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		
+		return -ENOENT;
+	}
+	
+	arena = (struct arena *) malloc(sizeof(struct arena) + st.st_size);
+	if (!arena) {
+		close(fd);
+		
+		return -ENOMEM;
+	}
+	arena->refs = 1;
+	arena->size = st.st_size;
+	
+	n = st.st_size > 0 ? pread(fd, arena->data, st.st_size, 0) : 0;
+	close(fd);
+	if (n < 0) {
+		free(arena);
+		
+		return -ENOENT;
+	}
+	st.st_size = n;
+	
+	r = table_init(table, dirpath, name, &st, arena->data, arena);
+	arena_put(arena);
+	if (r)
+		return r;
+	
+	cur_table = table;
+	cur_pos = table->data;
+	while (next_record(table, 1, &cur_table, &cur_pos, fields, n_fields, numeric, &next) == 0) {
+		if (fields[0].len == len && !memcmp(fields[0].str, name, len))
+			return 0;
+		
+		cur_pos = next;
+	}
+	
+	table_close(table);
+	
+	return -ENOENT;
+}
@@ -0,0 +1,304 @@
+/*
+ * nss-confd-uring
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file provides a minimal io_uring instance that the loader uses to
+ * submit the openat(), statx() and read() calls for all files of a directory at once
+ * instead of one syscall after another. It only uses the raw syscalls, hence
+ * it does not need liburing. The ring is only set up if NSS_CONFD_IO_URING=1,
+ * as a seccomp filter may kill a process on io_uring_setup() instead of
+ * returning an error. If the kernel does not allow io_uring or one of the
+ * required operations, uring_init() fails and the loader falls back to plain
+ * syscalls.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "nss-confd.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+// the operations the loader submits, older kernels do not support all of them
+static const unsigned char required_ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ };
+
+static int uring_probe(struct uring *ring) {
+	struct io_uring_probe *probe;
+	size_t size, i;
+	int r;
+	
+	size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = (struct io_uring_probe *) calloc(1, size);
+	if (!probe)
+		return -ENOMEM;
+	
+	r = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		r = -errno;
+	} else {
+		for (i=0; i < sizeof(required_ops); i++) {
+			if (required_ops[i] > probe->last_op || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+				r = -EOPNOTSUPP;
+				break;
+			}
+		}
+	}
+	
+	free(probe);
+	
+	return r;
+}
+
+int uring_init(struct uring *ring, unsigned int entries) {
+	struct io_uring_params params;
+	char *env;
+	int r;
+	
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = -1;
+	
+	// opt-in, a seccomp filter may kill the process instead of failing io_uring_setup()
+	env = secure_getenv("NSS_CONFD_IO_URING");
+	if (!env || strcmp(env, "1"))
+		return -ENOSYS;
+	
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		r = -errno;
+		ring->fd = -1;
+		
+		if (log_level >= LL_DBG)
+			DBG("io_uring_setup() failed: %s\n", strerror(-r));
+		
+		return r;
+	}
+	
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	
+	// since 5.4 both rings share one mapping
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = 0;
+		r = -errno;
+		uring_free(ring);
+		return r;
+	}
+	
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = 0;
+			r = -errno;
+			uring_free(ring);
+			return r;
+		}
+	}
+	
+	ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = 0;
+		r = -errno;
+		uring_free(ring);
+		return r;
+	}
+	
+	ring->sq_head = (uint32_t *) ((char *) ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (uint32_t *) ((char *) ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = *(uint32_t *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_array = (uint32_t *) ((char *) ring->sq_ring + params.sq_off.array);
+	
+	ring->cq_head = (uint32_t *) ((char *) (ring->cq_ring ? ring->cq_ring : ring->sq_ring) + params.cq_off.head);
+	ring->cq_tail = (uint32_t *) ((char *) (ring->cq_ring ? ring->cq_ring : ring->sq_ring) + params.cq_off.tail);
+	ring->cq_mask = *(uint32_t *) ((char *) (ring->cq_ring ? ring->cq_ring : ring->sq_ring) + params.cq_off.ring_mask);
+	ring->cqes = (char *) (ring->cq_ring ? ring->cq_ring : ring->sq_ring) + params.cq_off.cqes;
+	
+	r = uring_probe(ring);
+	if (r) {
+		if (log_level >= LL_DBG)
+			DBG("io_uring does not support the required operations: %s\n", strerror(-r));
+		
+		uring_free(ring);
+		return r;
+	}
+	
+	return 0;
+}
+
+void uring_free(struct uring *ring) {
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = -1;
+}
+
+// returns a zeroed submission entry or 0 if all entries are queued, then uring_wait() has to be called
+static struct io_uring_sqe *uring_sqe(struct uring *ring, uint64_t user_data) {
+	struct io_uring_sqe *sqe;
+	uint32_t tail;
+	
+	if (ring->n_queued == ring->sq_entries)
+		return 0;
+	
+	// the kernel only reads the entries after the tail was updated in uring_wait()
+	tail = *ring->sq_tail + ring->n_queued;
+	
+	sqe = &((struct io_uring_sqe *) ring->sqes)[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = user_data;
+	
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	ring->n_queued += 1;
+	
+	return sqe;
+}
+
+int uring_queue_openat(struct uring *ring, int dirfd, const char *name, int flags, uint64_t user_data) {
+	struct io_uring_sqe *sqe;
+	
+	sqe = uring_sqe(ring, user_data);
+	if (!sqe)
+		return -EBUSY;
+	
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) name;
+	sqe->open_flags = flags;
+	
+	return 0;
+}
+
+int uring_queue_read(struct uring *ring, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+	struct io_uring_sqe *sqe;
+	
+	sqe = uring_sqe(ring, user_data);
+	if (!sqe)
+		return -EBUSY;
+	
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = offset;
+	
+	return 0;
+}
+
+int uring_queue_statx(struct uring *ring, int dirfd, const char *name, int flags, struct statx *stx, uint64_t user_data) {
+	struct io_uring_sqe *sqe;
+	
+	sqe = uring_sqe(ring, user_data);
+	if (!sqe)
+		return -EBUSY;
+	
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) name;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t) stx;
+	sqe->statx_flags = flags;
+	
+	return 0;
+}
+
+/*
+ * Submits all queued entries with a single syscall, if possible, and calls
+ * $complete for every completion until all of them finished.
+ */
+int uring_wait(struct uring *ring, void (*complete)(uint64_t user_data, int res, void *arg), void *arg) {
+	struct io_uring_cqe *cqe;
+	uint32_t head, tail;
+	unsigned int pending;
+	long r;
+	
+	// publish the queued entries, pairs with the acquire of the kernel
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->n_queued, __ATOMIC_RELEASE);
+	
+	pending = ring->n_queued;
+	ring->n_queued = 0;
+	
+	while (pending > 0) {
+		r = syscall(__NR_io_uring_enter, ring->fd, __atomic_load_n(ring->sq_tail, __ATOMIC_RELAXED) - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), 1, IORING_ENTER_GETEVENTS, 0, 0);
+		if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -errno;
+		
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			cqe = &((struct io_uring_cqe *) ring->cqes)[head & ring->cq_mask];
+			complete(cqe->user_data, cqe->res, arg);
+			
+			head += 1;
+			pending -= 1;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	
+	return 0;
+}
+
+#else
+
+int uring_init(struct uring *ring, unsigned int entries) {
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = -1;
+	
+	return -ENOSYS;
+}
+
+void uring_free(struct uring *ring) {
+}
+
+int uring_queue_openat(struct uring *ring, int dirfd, const char *name, int flags, uint64_t user_data) {
+	return -ENOSYS;
+}
+
+int uring_queue_read(struct uring *ring, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+	return -ENOSYS;
+}
+
+int uring_queue_statx(struct uring *ring, int dirfd, const char *name, int flags, struct statx *stx, uint64_t user_data) {
+	return -ENOSYS;
+}
+
+int uring_wait(struct uring *ring, void (*complete)(uint64_t user_data, int res, void *arg), void *arg) {
+	return -ENOSYS;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * nss-confd-watch
+ * ---------------
+ * 
+ * With nss-confd, entries of certain NSS files like /etc/passwd can be
+ * split among multiple files in a certain directory (e.g., /etc/passwd.d/).
+ * 
+ * This file watches a directory with inotify to tell long-running processes
+ * that a database has to be loaded again.
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "nss-confd.h"
+
+// at most one read() per millisecond, clock_gettime() is much cheaper than a syscall
+#define WATCH_CHECK_INTERVAL_US 1000
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns the debounce interval in milliseconds from NSS_CONFD_WATCH or -1 if
+ * watching is disabled. Every watching process needs an inotify instance and
+ * their number is limited per user, hence it is disabled by default.
+ */
+int watch_debounce(void) {
+	long long value;
+	char *env;
+	
+	env = secure_getenv("NSS_CONFD_WATCH");
+	if (!env || env[0] == 0)
+		return -1;
+	
+	if (parse_llong(env, &value) || value < 0 || value > 60000)
+		return -1;
+	
+	return (int) value;
+}
+
+int watch_init(struct watch *w, const char *dirpath, unsigned int debounce) {
+	int r, fd;
+	
+	if (w->fd >= 0)
+		return 0;
+	
+	w->pending = 0;
+	w->last_event = 0;
+	// watch_due() of other threads might still read it from before the last watch_close()
+	__atomic_store_n(&w->last_check, 0, __ATOMIC_RELAXED);
+	w->debounce = debounce;
+	
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		r = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("inotify_init1() failed: %s\n", strerror(errno));
+		return r;
+	}
+	
+	if (inotify_add_watch(fd, dirpath, WATCH_EVENTS) < 0) {
+		r = -errno;
+		if (log_level >= LL_ERROR)
+			ERROR("cannot watch \"%s\": %s\n", dirpath, strerror(errno));
+		
+		close(fd);
+		
+		return r;
+	}
+	
+	__atomic_store_n(&w->fd, fd, __ATOMIC_RELAXED);
+	
+	if (log_level >= LL_DBG)
+		DBG("watching \"%s\"\n", dirpath);
+	
+	return 0;
+}
+
+/*
+ * Returns 1 if watch_changed() has to check for events. As it only reads the
+ * state, lookups of other threads can call it while one thread checks.
+ */
+int watch_due(struct watch *w) {
+	if (__atomic_load_n(&w->fd, __ATOMIC_RELAXED) < 0)
+		return 0;
+	
+	return now_us() - __atomic_load_n(&w->last_check, __ATOMIC_RELAXED) >= WATCH_CHECK_INTERVAL_US;
+}
+
+void watch_close(struct watch *w) {
+	if (w->fd >= 0)
+		close(w->fd);
+	
+	__atomic_store_n(&w->fd, -1, __ATOMIC_RELAXED);
+	w->pending = 0;
+}
+
+/*
+ * Returns 1 if the directory changed and no further change happened during the
+ * debounce interval. While packages are installed, many files might change in
+ * a short time and we only want to load the database once afterwards. Only
+ * one thread at a time may call this function.
+ */
+int watch_changed(struct watch *w) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	uint64_t now;
+	
+	if (w->fd < 0)
+		return 0;
+	
+	now = now_us();
+	if (now - w->last_check < WATCH_CHECK_INTERVAL_US)
+		return 0;
+	__atomic_store_n(&w->last_check, now, __ATOMIC_RELAXED);
+	
+	// we are only interested if something happened, not what happened
+	while (read(w->fd, buf, sizeof(buf)) > 0) {
+		w->pending = 1;
+		w->last_event = now;
+	}
+	
+	if (!w->pending)
+		return 0;
+	
+	if (now - w->last_event < (uint64_t) w->debounce * 1000)
+		return 0;
+	
+	w->pending = 0;
+	
+	return 1;
+}
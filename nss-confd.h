@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <pthread.h>
+#include <nss.h>
 
 #define LL_NONE 0
 #define LL_ERROR 1
@@ -8,31 +11,608 @@
 
 extern int log_level;
 
+/*
+ * Static tracepoints (USDT) of the provider "nss_confd" for tracers like
+ * bpftrace or perf. They are built in if <sys/sdt.h> is available and
+ * WITH_SDT is not 0. Without an attached tracer, a probe is a nop.
+ */
+#if !defined(NSS_CONFD_WITHOUT_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NSS_CONFD_WITH_SDT 1
+#endif
+#endif
+
+#ifdef NSS_CONFD_WITH_SDT
+#define PROBE(name, ...) STAP_PROBEV(nss_confd, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
 // in nss-confd-pw.c
 extern int parse_llong(char *arg, long long *value);
 
+// the keys of a record, kept per table to build the index without parsing unchanged files
+struct table_key {
+	uint32_t name_hash;
+	uint32_t id_hash;
+	size_t offset;
+};
+
+// the contents of the small files of a directory, shared by their tables
+struct arena {
+	unsigned long refs;
+	size_t size;
+	char data[];
+};
+
 struct table {
 	char *filepath;
 	struct stat stat;
+	char *data;
+	
+	// set if $data is a part of an arena instead of a mapping of the file
+	struct arena *arena;
+	
+	uint64_t hash;
+	struct table_key *keys;
+	size_t n_keys;
+	
+	// the snapshots of a database share the tables of unchanged files
+	unsigned long *refs;
+};
+
+// in nss-confd-uring.c
+struct statx;
+
+struct uring {
 	int fd;
+	
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_array;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	unsigned int n_queued;
+	
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	void *cqes;
+};
+
+extern int uring_init(struct uring *ring, unsigned int entries);
+extern void uring_free(struct uring *ring);
+extern int uring_queue_openat(struct uring *ring, int dirfd, const char *name, int flags, uint64_t user_data);
+extern int uring_queue_read(struct uring *ring, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data);
+extern int uring_queue_statx(struct uring *ring, int dirfd, const char *name, int flags, struct statx *stx, uint64_t user_data);
+extern int uring_wait(struct uring *ring, void (*complete)(uint64_t user_data, int res, void *arg), void *arg);
+
+// in nss-confd-table.c
+struct dirent;
+struct field;
+
+extern void table_close(struct table *table);
+extern int tables_load(const char *dirpath, int (*filter)(const struct dirent *), struct table *old, size_t n_old,
+	struct table **tables, size_t *n_tables, int *changed);
+extern int table_by_filename(void);
+extern int table_find_file(const char *dirpath, const char *name, int (*filter)(const struct dirent *), struct table *table,
+	struct field *fields, unsigned int n_fields, unsigned int numeric);
+
+// in nss-confd-parse.c
+struct field {
+	const char *str;
+	size_t len;
+	long long value;
+};
+
+extern int parse_line(const char *pos, const char *end, struct field *fields, unsigned int n_fields, unsigned int numeric, const char **next);
+extern char *copy_field(struct field *field, char **bufpos, char *bufend);
+extern int next_record(struct table *tables, size_t n_tables, struct table **cur_table, char **cur_pos,
+	struct field *fields, unsigned int n_fields, unsigned int numeric, char **next);
+
+// in nss-confd-bloom.c
+#define BLOOM_BLOCK_WORDS 8
+
+struct bloom {
+	uint64_t *bits;
+	uint32_t n_blocks;
+};
+
+extern uint32_t bloom_blocks(size_t n_keys);
+extern int bloom_init(struct bloom *bloom, size_t n_keys);
+extern void bloom_free(struct bloom *bloom);
+extern void bloom_add(struct bloom *bloom, uint64_t hash);
+extern int bloom_check(const struct bloom *bloom, uint64_t hash);
+extern void bloom_prefetch(const struct bloom *bloom, uint64_t hash);
+
+// in nss-confd-index.c
+#define INDEX_START ((size_t) -1)
+
+struct index_entry {
+	uint32_t hash;
+	uint32_t table;
+	size_t offset;
+};
+
+struct index {
+	struct index_entry *entries;
+	size_t size;
+	size_t n_entries;
+	
+	// rejects most hashes that were never added before the entries are probed
+	struct bloom bloom;
+};
+
+extern uint32_t index_hash_name(const char *name, size_t len);
+extern uint32_t index_hash_id(id_t id);
+extern uint32_t index_hash_dir(const char *dirpath);
+extern int index_init(struct index *idx, size_t n_entries);
+extern void index_free(struct index *idx);
+extern int index_add(struct index *idx, uint32_t hash, uint32_t table, size_t offset);
+extern void index_prefetch(struct index *idx, uint32_t hash);
+extern struct index_entry *index_next(struct index *idx, uint32_t hash, size_t *pos);
+extern int index_build(struct table *tables, size_t n_tables, unsigned int n_fields, unsigned int numeric, int id_field, struct index *name_index, struct index *id_index);
+
+// in nss-confd-cdb.c
+#define CDB_MAGIC "CONFDIDX"
+#define CDB_VERSION 5
+
+// the records are encoded relative to the first record of every group of this many records
+#define CDB_RESTART_INTERVAL 16
+
+struct cdb_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_fields;
+	char db[8];
+	uint32_t numeric;
+	int32_t id_field;
+	int32_t list_field;
+	uint32_t n_dict;
+	uint64_t seed;
+	
+	// state of the directory at compile time
+	uint64_t dir_ino;
+	uint64_t dir_mtime_sec;
+	uint64_t dir_mtime_nsec;
+	
+	uint64_t size;
+	uint32_t n_files;
+	uint32_t n_records;
+	uint32_t n_names;
+	uint32_t n_name_buckets;
+	uint32_t n_ids;
+	uint32_t n_id_buckets;
+	uint32_t n_members;
+	uint32_t n_name_blocks;
+	uint32_t n_id_blocks;
+	uint32_t n_restarts;
+	
+	uint64_t files_off;
+	uint64_t restarts_off;
+	uint64_t records_off;
+	uint64_t records_size;
+	uint64_t dict_off;
+	uint64_t name_disp_off;
+	uint64_t name_slots_off;
+	uint64_t id_disp_off;
+	uint64_t id_slots_off;
+	uint64_t members_off;
+	uint64_t name_bloom_off;
+	uint64_t id_bloom_off;
+	uint64_t strings_off;
+	uint64_t strings_size;
+};
+
+struct cdb_file {
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+	uint32_t name;
+	uint32_t reserved;
+};
+
+// a string in the string pool, e.g., an interned value in the dictionary
+struct cdb_string {
+	uint32_t str;
+	uint32_t len;
+};
+
+// a member of a group, sorted by the name and then by the record of the group
+struct cdb_member {
+	uint32_t str;
+	uint32_t len;
+	uint32_t id;
+	uint32_t record;
+};
+
+struct cdb_disp {
+	uint32_t d0;
+	uint32_t d1;
+};
+
+struct cdb {
+	char *data;
+	size_t size;
+	
+	struct cdb_header *header;
+	struct cdb_file *files;
+	uint32_t *restarts;
+	const unsigned char *records;
+	struct cdb_string *dict;
+	struct cdb_disp *name_disp;
+	uint32_t *name_slots;
+	struct cdb_disp *id_disp;
+	uint32_t *id_slots;
+	struct cdb_member *members;
+	struct bloom name_bloom;
+	struct bloom id_bloom;
+	const char *strings;
+};
+
+// a field of a record in the builder, the string is an offset in the values of the builder
+struct cdb_field {
+	uint32_t str;
+	uint32_t len;
+	int64_t value;
+};
+
+struct cdb_builder {
+	const char *db;
+	unsigned int n_fields;
+	unsigned int numeric;
+	int id_field;
+	int list_field;
+	struct stat dir_stat;
+	
+	struct cdb_file *files;
+	size_t n_files;
+	size_t files_alloc;
+	uint64_t files_size;
+	
+	struct cdb_field *records;
+	size_t n_records;
+	size_t records_alloc;
+	
+	char *values;
+	size_t values_size;
+	size_t values_alloc;
+	
+	char *strings;
+	size_t strings_size;
+	size_t strings_alloc;
+	
+	// sizes of the last image created by cdb_builder_finish()
+	uint64_t size;
+	uint64_t records_size;
+};
+
+extern int cdb_enabled;
+
+extern char *cdb_path(const char *path, const char *dirpath);
+extern int cdb_open(struct cdb *cdb, const char *path, const char *db, unsigned int n_fields, const char *dirpath);
+extern void cdb_close(struct cdb *cdb);
+extern int cdb_decode(struct cdb *cdb, uint32_t i, struct field *fields, char *buffer, size_t buflen, size_t *size);
+extern int cdb_decode_key(struct cdb *cdb, uint32_t i, char *buffer, size_t buflen, size_t *len, id_t *id);
+extern void cdb_prefetch_name(struct cdb *cdb, const char *name);
+extern void cdb_prefetch_id(struct cdb *cdb, id_t id);
+extern int cdb_find_name(struct cdb *cdb, const char *name, uint32_t *record);
+extern int cdb_find_id(struct cdb *cdb, id_t id, uint32_t *record);
+extern size_t cdb_find_members(struct cdb *cdb, const char *name, struct cdb_member **first);
+
+extern int cdb_builder_init(struct cdb_builder *b, const char *db, unsigned int n_fields, unsigned int numeric, int id_field, int list_field, struct stat *dir_stat);
+extern int cdb_builder_add_file(struct cdb_builder *b, const char *name, struct stat *st);
+extern int cdb_builder_add_record(struct cdb_builder *b, struct field *fields);
+extern int cdb_builder_finish(struct cdb_builder *b, char **image, size_t *image_size);
+extern void cdb_builder_free(struct cdb_builder *b);
+extern int cdb_write(const char *path, char *image, size_t size, mode_t mode);
+extern int cdb_publish(struct cdb_builder *b, const char *path, mode_t mode);
+extern char *cdb_shm_path(const char *db, const char *dirpath, uid_t uid);
+
+// in nss-confd-members.c
+struct members_group {
+	const char *name;
+	size_t name_len;
+	char *members;
+	size_t members_len;
+};
+
+struct members_map {
+	struct members_group *groups;
+	size_t n_groups;
+	struct index index;
 	char *data;
 };
 
-#define SWITCH_ENTRY(i, entry) \
-	case i: { \
-		int r; \
-		long long value; \
-		\
-		if (slen > 0) { \
-			r = parse_llong(bufpos, &value); \
-			if (r == 0) { \
-				result->entry = value; \
-			} else { \
-				valid = 0; \
-			} \
-		} else { \
-			result->entry = -1; \
-		} \
-		\
-		break;\
-	}
+extern int members_map_build(struct members_map *map, struct table *tables, size_t n_tables);
+extern void members_map_free(struct members_map *map);
+extern int members_map_find(struct members_map *map, const char *name, size_t len, const char **members, size_t *members_len);
+extern ssize_t members_append(char *list, size_t list_len, const char *extra, size_t extra_len);
+
+// a group that lists a user as member, sorted by the user and then in file order
+struct member_entry {
+	const char *user;
+	uint32_t len;
+	uint32_t gid;
+	size_t seq;
+};
+
+struct member_index {
+	struct member_entry *entries;
+	size_t n_entries;
+	size_t alloc;
+};
+
+extern int member_index_add(struct member_index *idx, const char *members, size_t len, gid_t gid);
+extern void member_index_sort(struct member_index *idx);
+extern size_t member_index_find(struct member_index *idx, const char *user, struct member_entry **first);
+extern void member_index_free(struct member_index *idx);
+
+// in nss-confd-snapshot.c
+struct snapshot {
+	unsigned long refs;
+	
+	struct table *tables;
+	size_t n_tables;
+	struct stat dir_stat;
+	
+	// the .membership files of the group database and their members by group
+	struct table *split_members;
+	size_t n_split_members;
+	struct members_map split_map;
+	
+	// the groups of every member, built by the first initgroups_dyn() call
+	struct member_index *users;
+	
+	struct cdb cdb;
+	struct index name_index;
+	struct index id_index;
+};
+
+extern struct snapshot *snapshot_new(void);
+extern void snapshot_put(struct snapshot *snap);
+extern unsigned int snapshot_enter(void);
+extern void snapshot_leave(unsigned int token);
+extern struct snapshot *snapshot_current(struct snapshot **current);
+extern struct snapshot *snapshot_get(struct snapshot **current);
+extern void snapshot_publish(struct snapshot **current, struct snapshot *snap);
+
+// in nss-confd-watch.c
+struct watch {
+	int fd;
+	int pending;
+	uint64_t last_event;
+	uint64_t last_check;
+	unsigned int debounce;
+};
+
+#define WATCH_INIT { .fd = -1 }
+
+extern int watch_debounce(void);
+extern int watch_init(struct watch *w, const char *dirpath, unsigned int debounce);
+extern void watch_close(struct watch *w);
+extern int watch_due(struct watch *w);
+extern int watch_changed(struct watch *w);
+
+// in nss-confd-client.c
+#define CACHED_VERSION 1
+#define CACHED_MAX_KEY 4096
+#define CACHED_TIMEOUT 1
+#define CACHED_RETRY 1
+
+#define CACHED_PASSWD 0
+#define CACHED_GROUP 1
+#define CACHED_SHADOW 2
+
+#define CACHED_BY_NAME 0
+#define CACHED_BY_ID 1
+#define CACHED_INITGROUPS 2
+
+// a request is followed by the key, a response by a record line or an array of uint32_t gids
+struct cached_request {
+	uint32_t version;
+	uint8_t db;
+	uint8_t type;
+	uint16_t reserved;
+	uint32_t id;
+	uint32_t dir_hash;
+};
+
+struct cached_response {
+	int32_t status;
+	uint32_t size;
+};
+
+extern int cached_enabled;
+
+extern const char *cached_socket_path(void);
+extern int cached_lookup(uint8_t db, const char *dirpath, const char *name, uint32_t id, struct field *fields, unsigned int n_fields, unsigned int numeric);
+extern int cached_initgroups(const char *dirpath, const char *user, gid_t **gids, size_t *n_gids);
+
+// in nss-confd-retry.c
+extern size_t fields_size(struct field *fields, unsigned int n_fields, unsigned int numeric);
+extern void retry_store(uint8_t db, const char *name, uint32_t id, struct field *fields, unsigned int n_fields, size_t size);
+extern int retry_find(uint8_t db, const char *name, uint32_t id, struct field *fields, unsigned int n_fields);
+extern void retry_clear(void);
+extern size_t retry_size(void);
+
+// in nss-confd-stats.c
+#define STATS_MAGIC "CONFDSTA"
+#define STATS_VERSION 1
+
+// indexed like CACHED_PASSWD, CACHED_GROUP and CACHED_SHADOW
+#define STATS_N_DBS 3
+
+// latencies are counted in buckets of powers of two nanoseconds, the last one holds the rest
+#define STATS_BUCKETS 32
+
+enum {
+	STATS_LOOKUPS,
+	STATS_HITS,
+	STATS_MISSES,
+	STATS_ERANGE,
+	STATS_RETRIES,
+	STATS_CACHED,
+	STATS_BY_FILENAME,
+	STATS_SETENT,
+	STATS_GETENT,
+	STATS_INITGROUPS,
+	STATS_LOADS,
+	STATS_RELOADS,
+	STATS_INDEX_LOADS,
+	STATS_LOAD_ERRORS,
+	// the files and bytes of the last loaded snapshot
+	STATS_FILES,
+	STATS_BYTES,
+	STATS_N_COUNTERS,
+};
+
+enum {
+	STATS_TIME_LOOKUP,
+	STATS_TIME_SETENT,
+	STATS_TIME_GETENT,
+	STATS_TIME_INITGROUPS,
+	STATS_TIME_LOAD,
+	STATS_TIME_OPEN_INDEX,
+	STATS_TIME_SCAN,
+	STATS_TIME_BUILD_INDEX,
+	STATS_TIME_PUBLISH_SHM,
+	STATS_N_TIMERS,
+};
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_db {
+	uint64_t counters[STATS_N_COUNTERS];
+	struct stats_hist timers[STATS_N_TIMERS];
+};
+
+// the statistics of a process, also the layout of its file in NSS_CONFD_STATS_DIR
+struct stats_segment {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	int32_t pid;
+	uint32_t uid;
+	struct stats_db dbs[STATS_N_DBS];
+};
+
+extern const char *stats_db_names[STATS_N_DBS];
+extern const char *stats_counter_names[STATS_N_COUNTERS];
+extern const char *stats_timer_names[STATS_N_TIMERS];
+
+extern void stats_add(uint8_t db, unsigned int counter, uint64_t n);
+extern void stats_set(uint8_t db, unsigned int counter, uint64_t value);
+extern uint64_t stats_start(void);
+extern void stats_time(uint8_t db, unsigned int timer, uint64_t start);
+extern void stats_merge(struct stats_segment *dst, struct stats_segment *src);
+extern void stats_print(FILE *f, struct stats_segment *seg);
+
+// in nss-confd-db.c
+#define DB_MAX_FIELDS 9
+
+// the types of the fields of a record, DB_ID, DB_LONG and DB_ULONG are numeric
+#define DB_STR 0
+#define DB_ID 1
+#define DB_LONG 2
+#define DB_ULONG 3
+#define DB_LIST 4
+
+// where a field of a record is stored in the result struct of glibc
+struct db_field {
+	int type;
+	size_t offset;
+};
+
+/*
+ * Describes a database and holds its state. The name is field 0 of a record,
+ * $id_field is -1 if the database has no ids and $list_field is -1 if there
+ * is no comma-separated list, which has to be the last string field.
+ */
+struct db {
+	const char *name;
+	uint8_t cached_db;
+	const char *dir_env;
+	const char *default_dir;
+	const char *index_env;
+	mode_t shm_mode;
+	
+	const struct db_field *schema;
+	unsigned int n_fields;
+	unsigned int numeric;
+	int id_field;
+	int list_field;
+	
+	int (*filter)(const struct dirent *);
+	
+	// optional, loads further files into a snapshot after its tables
+	int (*load_extra)(struct snapshot *snap, struct snapshot *old, const char *dirpath, int *changed);
+	// optional, adds these files to a compiled database
+	int (*add_extra_files)(struct snapshot *snap, struct cdb_builder *b);
+	// optional, returns entries from these files that are appended to the list of a record
+	int (*list_extra)(struct snapshot *snap, struct field *fields, const char **extra, size_t *extra_len);
+	
+	// the loaded database, lookups read it without taking a lock
+	struct snapshot *current;
+	
+	// serializes loading the database
+	pthread_mutex_t load_lock;
+	struct watch watch;
+	
+	// the databases whose locks a forked child initializes again, see nss-confd-db.c
+	int tracked;
+	struct db *next_tracked;
+	
+	// getent() iterates through its own snapshot, hence a reload does not disturb it
+	pthread_mutex_t ent_lock;
+	struct snapshot *ent_snap;
+	struct table *cur_table;
+	char *cur_pos;
+	size_t cur_record;
+};
+
+#define DB_STATE_INIT .load_lock = PTHREAD_MUTEX_INITIALIZER, .watch = WATCH_INIT, .ent_lock = PTHREAD_MUTEX_INITIALIZER
+
+extern int shm_publish;
+
+extern char *db_dirpath(struct db *db);
+extern enum nss_status db_update(struct db *db);
+extern enum nss_status db_setent(struct db *db);
+extern enum nss_status db_endent(struct db *db);
+extern enum nss_status db_getent(struct db *db, void *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status db_lookup(struct db *db, const char *name, id_t id, void *result, char *buffer, size_t buflen, int *errnop);
+extern enum nss_status db_lookup_size(struct db *db, const char *name, id_t id, void *result, size_t *size, int *errnop);
+extern int db_ids_to_names(struct db *db, const id_t *ids, size_t n, char ***names);
+extern int db_names_to_ids(struct db *db, const char *const *names, size_t n, id_t *ids);
+extern int db_compile(struct db *db, struct cdb_builder *b);
+
+// in nss-confd-pw.c, nss-confd-gr.c and nss-confd-sp.c
+extern int compile_pwent(struct cdb_builder *b);
+extern int compile_grent(struct cdb_builder *b);
+extern int compile_spent(struct cdb_builder *b);
+
+// in nss-confd-pw.c and nss-confd-gr.c
+extern void trace_pwent(void (*cb)(size_t, struct traced_file *));
+extern void trace_grent(void (*cb)(size_t, struct traced_file *));
+
+// in nss-confd-nscd.c
+// the databases of nscd, as in nscd/nscd.h of glibc
+#define NSCD_PASSWD 0
+#define NSCD_GROUP 1
+
+extern void nscd_trace_db(struct db *db, size_t nscd_db, void (*cb)(size_t, struct traced_file *));
+extern void _nss_confd_init(void (*cb)(size_t, struct traced_file *));
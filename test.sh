@@ -4,13 +4,25 @@
 
 TEST_SPLIT_MEMBERS="$1"
 
+TESTS_DIR=$(pwd)/tests
+INDEX_DIR=""
+SHM_DIR=""
+SOCKET=""
+BY_FILENAME=""
+
 function getent_call() {
 #	VALGRIND="valgrind --leak-check=full"
 
 	NSS_CONFD_DEBUG=1 \
-		NSS_CONFD_PASSWD_DIR=$(pwd)/tests/passwd.d/ \
-		NSS_CONFD_GROUP_DIR=$(pwd)/tests/group.d/ \
-		NSS_CONFD_SHADOW_DIR=$(pwd)/tests/shadow.d/ \
+		NSS_CONFD_PASSWD_DIR=${TESTS_DIR}/passwd.d/ \
+		NSS_CONFD_GROUP_DIR=${TESTS_DIR}/group.d/ \
+		NSS_CONFD_SHADOW_DIR=${TESTS_DIR}/shadow.d/ \
+		NSS_CONFD_PASSWD_INDEX=${INDEX_DIR:+${INDEX_DIR}/passwd.index} \
+		NSS_CONFD_GROUP_INDEX=${INDEX_DIR:+${INDEX_DIR}/group.index} \
+		NSS_CONFD_SHADOW_INDEX=${INDEX_DIR:+${INDEX_DIR}/shadow.index} \
+		NSS_CONFD_SHM=${SHM_DIR} \
+		NSS_CONFD_SOCKET=${SOCKET} \
+		NSS_CONFD_BY_FILENAME=${BY_FILENAME} \
 		LD_LIBRARY_PATH=$(pwd) \
 		${VALGRIND} getent $*
 	RES="$?"
@@ -30,33 +42,189 @@ function getent_test() {
 	fi
 }
 
+function mkindex() {
+	NSS_CONFD_PASSWD_DIR=${TESTS_DIR}/passwd.d/ \
+		NSS_CONFD_GROUP_DIR=${TESTS_DIR}/group.d/ \
+		NSS_CONFD_SHADOW_DIR=${TESTS_DIR}/shadow.d/ \
+		NSS_CONFD_PASSWD_INDEX=${INDEX_DIR}/passwd.index \
+		NSS_CONFD_GROUP_INDEX=${INDEX_DIR}/group.index \
+		NSS_CONFD_SHADOW_INDEX=${INDEX_DIR}/shadow.index \
+		NSS_CONFD_SHM=${SHM_DIR} \
+		./nss-confd-mkindex $* > /dev/null || { echo "nss-confd-mkindex failed"; exit 1; }
+}
+
+function start_cached() {
+	rm -f "${SOCKET}"
+
+	NSS_CONFD_PASSWD_DIR=${TESTS_DIR}/passwd.d/ \
+		NSS_CONFD_GROUP_DIR=${TESTS_DIR}/group.d/ \
+		NSS_CONFD_SHADOW_DIR=${TESTS_DIR}/shadow.d/ \
+		NSS_CONFD_PASSWD_INDEX= \
+		NSS_CONFD_GROUP_INDEX= \
+		NSS_CONFD_SHADOW_INDEX= \
+		NSS_CONFD_WATCH=0 \
+		NSS_CONFD_SHM=${SHM_DIR} \
+		./nss-confd-cached -s "${SOCKET}" &
+	CACHED_PID=$!
+
+	for i in $(seq 50); do
+		[ -S "${SOCKET}" ] && break
+		sleep 0.1
+	done
+	[ -S "${SOCKET}" ] || { echo "nss-confd-cached did not start"; exit 1; }
+}
+
+function stop_cached() {
+	kill ${CACHED_PID}
+	wait ${CACHED_PID}
+	CACHED_PID=""
+}
+
+function run_tests() {
+	getent_test passwd f1 "f1:f2:3:4:f5:f6:f7"
+	getent_test passwd g1 "g1:g2:5:6:g5:g6:g7"
+	getent_test passwd h1 "h1:h2:3:4:h5:h6:h7"
+	getent_test passwd j1 "j1:j2:3:4:::"
+
+	getent_test passwd x1 ""
+	getent_test passwd y1 ""
+	getent_test passwd z1 ""
+
+	getent_test group a1 "a1:a2:1:"
+	getent_test group b1 "b1:b2:2:user1"
+	getent_test group c1 "c1:c2:3:user1,user2"
+	getent_test group d1 "d1:d2:4:user1,user2,"
+	getent_test group e1 "e1:e2:5:user1,user2,user3"
+	# larger than the initial buffer of glibc, hence it repeats the lookup after ERANGE
+	getent_test group l1 "l1:l2:8:$(seq -s , -f "member%03g" 300)"
+	if [ "${TEST_SPLIT_MEMBERS}" == "1" ]; then
+		getent_test group f1 "f1:f2:6:user4,user5"
+		getent_test group g1 "g1:g2:7:user0,user4,user5"
+		# user6 is in the group line and in the .membership file
+		getent_test group h1 "h1:h2:9:user6,user7,user8"
+	fi
+
+	getent_test group x1 ""
+
+	getent_test initgroups user1 "user1                 2 3 4 5"
+	getent_test initgroups user2 "user2                 3 4 5"
+	getent_test initgroups member150 "member150             8"
+	if [ "${TEST_SPLIT_MEMBERS}" == "1" ]; then
+		getent_test initgroups user4 "user4                 6 7"
+		getent_test initgroups user6 "user6                 9"
+	fi
+
+	getent_test shadow a1 "a1:a2:10:11:12:13:14:15:16"
+	getent_test shadow b1 "b1:b2:20:21:22:23:24:25:26"
+	getent_test shadow c1 "c1:c2:30:31:32:33:34:35:36"
+	getent_test shadow d1 ""
+
+	getent_test shadow x1 ""
+}
+
+# without index
+run_tests
+
+# with a compiled index
+INDEX_DIR=$(mktemp -d)
+trap '[ -n "${CACHED_PID}" ] && kill ${CACHED_PID}; rm -rf "${INDEX_DIR}" "${SHM_DIR}" "${SOCKET_DIR}" "${TMP_TESTS_DIR}" "${STATS_DIR}"' EXIT
+
+mkindex
+run_tests
+
+# a lookup only attaches to a shared copy, nss-confd-mkindex --shm publishes it
+SHM_DIR=$(mktemp -d)
+INDEX_DIR_SAVED=${INDEX_DIR}
+INDEX_DIR=""
+
+run_tests
+ls "${SHM_DIR}"/nss-confd-* > /dev/null 2>&1 && { echo "a lookup published a shared copy"; exit 1; }
+mkindex --shm
+for db in passwd group shadow; do
+	ls "${SHM_DIR}"/nss-confd-${db}-* > /dev/null 2>&1 || { echo "no shared copy of ${db}"; exit 1; }
+done
+STATS=$(NSS_CONFD_STATS=1 getent_call passwd f1 2>&1 > /dev/null)
+echo "${STATS}" | grep -qx "passwd.index_loads 1" || { echo "shared copy not used: ${STATS}"; exit 1; }
+run_tests
+
+# the daemon publishes a copy of the databases it loaded
+rm -f "${SHM_DIR}"/nss-confd-*
+SOCKET_DIR=$(mktemp -d)
+SOCKET=${SOCKET_DIR}/socket
+start_cached
 getent_test passwd f1 "f1:f2:3:4:f5:f6:f7"
-getent_test passwd g1 "g1:g2:5:6:g5:g6:g7"
-getent_test passwd h1 "h1:h2:3:4:h5:h6:h7"
-getent_test passwd j1 "j1:j2:3:4:::"
+ls "${SHM_DIR}"/nss-confd-passwd-* > /dev/null 2>&1 || { echo "no shared copy of passwd from the daemon"; exit 1; }
+stop_cached
+SOCKET=""
+
+INDEX_DIR=${INDEX_DIR_SAVED}
+SHM_DIR=""
 
+# lookups answered by the caching daemon
+SOCKET=${SOCKET_DIR}/socket
+
+start_cached
+run_tests
+
+# the module falls back to its own lookup if the daemon is gone
+stop_cached
+
+getent_test passwd f1 "f1:f2:3:4:f5:f6:f7"
 getent_test passwd x1 ""
-getent_test passwd y1 ""
-getent_test passwd z1 ""
-
-getent_test group a1 "a1:a2:1:"
-getent_test group b1 "b1:b2:2:user1"
-getent_test group c1 "c1:c2:3:user1,user2"
-getent_test group d1 "d1:d2:4:user1,user2,"
-getent_test group e1 "e1:e2:5:user1,user2,user3"
-if [ "${TEST_SPLIT_MEMBERS}" == "1" ]; then
-	getent_test group f1 "f1:f2:6:user4,user5"
-	getent_test group g1 "g1:g2:7:user0,user5,user4"
-fi
-
-getent_test group x1 ""
-
-getent_test shadow a1 "a1:a2:10:11:12:13:14:15:16"
-getent_test shadow b1 "b1:b2:20:21:22:23:24:25:26"
-getent_test shadow c1 "c1:c2:30:31:32:33:34:35:36"
-getent_test shadow d1 ""
-
-getent_test shadow x1 ""
+
+SOCKET=""
+
+# an index must not be used after a file was changed
+TMP_TESTS_DIR=$(mktemp -d)
+cp -r tests/passwd.d tests/group.d tests/shadow.d "${TMP_TESTS_DIR}"
+TESTS_DIR=${TMP_TESTS_DIR}
+
+mkindex
+echo "k1:k2:8:9:k5:k6:k7" >> "${TESTS_DIR}/passwd.d/test2"
+getent_test passwd k1 "k1:k2:8:9:k5:k6:k7"
+getent_test passwd g1 "g1:g2:5:6:g5:g6:g7"
+
+# lookups by name try the file named after the account first
+BY_FILENAME=1
+run_tests
+echo "n1:n2:12:13:n5:n6:n7" > "${TESTS_DIR}/passwd.d/n1"
+echo "o1:o2:14:15:o5:o6:o7" > "${TESTS_DIR}/passwd.d/p1"
+echo "n1:n2:12:" > "${TESTS_DIR}/group.d/n1"
+getent_test passwd n1 "n1:n2:12:13:n5:n6:n7"
+getent_test passwd o1 "o1:o2:14:15:o5:o6:o7"
+getent_test passwd p1 ""
+getent_test passwd 12 "n1:n2:12:13:n5:n6:n7"
+getent_test group n1 "n1:n2:12:"
+BY_FILENAME=""
+
+# a long-running process notices a changed file
+SOCKET=${SOCKET_DIR}/socket
+start_cached
+
+getent_test passwd l1 ""
+echo "l1:l2:10:11:l5:l6:l7" >> "${TESTS_DIR}/passwd.d/test2"
+getent_test passwd l1 "l1:l2:10:11:l5:l6:l7"
+
+# the daemon answers initgroups of a user without groups with an empty list, then the module does not load the directory
+STATS=$(NSS_CONFD_STATS=1 getent_call initgroups nogroups 2>&1 > /dev/null)
+echo "${STATS}" | grep -q "^group.loads " && { echo "group directory loaded despite the daemon: ${STATS}"; exit 1; }
+
+stop_cached
+SOCKET=""
+
+# every process keeps its statistics in a file of its own, nss-confd-stat sums them up
+STATS_DIR=$(mktemp -d)
+NSS_CONFD_STATS_DIR=${STATS_DIR} getent_test passwd f1 "f1:f2:3:4:f5:f6:f7"
+NSS_CONFD_STATS_DIR=${STATS_DIR} getent_test passwd x1 ""
+STATS=$(./nss-confd-stat "${STATS_DIR}")
+for line in "processes 2 running 0" "passwd.lookups 2" "passwd.hits 1" "passwd.misses 1"; do
+	echo "${STATS}" | grep -qx "${line}" || { echo "statistics lack \"${line}\": ${STATS}"; exit 1; }
+done
+
+# glibc repeats the lookup of a large group after ERANGE
+STATS=$(NSS_CONFD_STATS=1 getent_call group l1 2>&1 > /dev/null)
+echo "${STATS}" | grep -qx "group.hits 1" || { echo "no statistics printed at exit: ${STATS}"; exit 1; }
+echo "${STATS}" | grep -q "^group.erange " || { echo "no ERANGE counted: ${STATS}"; exit 1; }
 
 echo success
 exit 0